@@ -5,6 +5,17 @@
 #include <fstream>
 #include <strstream>
 #include <algorithm>
+#include <map>
+#include <unordered_map>
+#include <tuple>
+#include <list>
+#include <deque>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <cfloat>
 
 #include "olcConsoleGameEngine.h"
 
@@ -29,8 +40,867 @@ struct Triangle {
 	short colour;
 };
 
+struct Mat4x4 {
+	float m[4][4] = { 0 };
+};
+
+// Vector and matrix helpers. Matrices apply to row vectors, so MultiplyMatMat(a, b)
+// is a then b
+Vec3D VecsAdd(const Vec3D& v1, const Vec3D& v2) {
+	return { v1.x + v2.x, v1.y + v2.y, v1.z + v2.z };
+}
+Vec3D VecsSubtract(const Vec3D& v1, const Vec3D& v2) {
+	return { v1.x - v2.x, v1.y - v2.y, v1.z - v2.z };
+}
+Vec3D VecsMultiply(const Vec3D& v, float k) {
+	return{ v.x * k, v.y * k, v.z * k };
+}
+Vec3D VecsDivide(const Vec3D& v, float k) {
+	return{ v.x / k, v.y / k, v.z / k };
+}
+
+float VecsDotProduct(const Vec3D& v1, const Vec3D& v2) {
+	return v1.x * v2.x + v1.y * v2.y + v1.z * v2.z;
+}
+float VecLength(const Vec3D& v) {
+	return sqrtf(VecsDotProduct(v, v));
+}
+
+Vec3D VecNormalise(const Vec3D& v) {
+	float l = VecLength(v);
+	return { v.x / l, v.y / l, v.z / l };
+}
+Vec3D VecsCrossProduct(const Vec3D& v1, const Vec3D& v2) {
+	Vec3D v;
+	v.x = v1.y * v2.z - v1.z * v2.y;
+	v.y = v1.z * v2.x - v1.x * v2.z;
+	v.z = v1.x * v2.y - v1.y * v2.x;
+	return v;
+}
+
+Vec3D VecIntersectPlane(Vec3D& vPlanePoint, Vec3D& vPlaneNormal, Vec3D& vLineStart, Vec3D& vLineEnd, float& t) {
+	vPlaneNormal = VecNormalise(vPlaneNormal);
+
+	// Vector notation of line-plane intersection
+	Vec3D v = VecsSubtract(vPlanePoint, vLineStart);
+	float n = VecsDotProduct(v, vPlaneNormal);
+	Vec3D vLine = VecsSubtract(vLineEnd, vLineStart);
+	float d = VecsDotProduct(vLine, vPlaneNormal);
+	t = n / d; // Normalised distance along the line between two points where the intersection happened
+	Vec3D vLineToIntersect = VecsMultiply(vLine, t);
+
+	return VecsAdd(vLineStart, vLineToIntersect);
+}
+
+Mat4x4 MatMakeIdentity() {
+	Mat4x4 matrix;
+	matrix.m[0][0] = 1.0f;
+	matrix.m[1][1] = 1.0f;
+	matrix.m[2][2] = 1.0f;
+	matrix.m[3][3] = 1.0f;
+	return matrix;
+}
+Mat4x4 MatMakeRotationX(float fAngleRad) {
+	Mat4x4 matrix;
+	matrix.m[0][0] = 1.0f;
+	matrix.m[1][1] = cosf(fAngleRad);
+	matrix.m[1][2] = sinf(fAngleRad);
+	matrix.m[2][1] = -sinf(fAngleRad);
+	matrix.m[2][2] = cosf(fAngleRad);
+	matrix.m[3][3] = 1.0f;
+	return matrix;
+}
+Mat4x4 MatMakeRotationY(float fAngleRad) {
+	Mat4x4 matrix;
+	matrix.m[0][0] = cosf(fAngleRad);
+	matrix.m[0][2] = sinf(fAngleRad);
+	matrix.m[2][0] = -sinf(fAngleRad);
+	matrix.m[1][1] = 1.0f;
+	matrix.m[2][2] = cosf(fAngleRad);
+	matrix.m[3][3] = 1.0f;
+	return matrix;
+}
+Mat4x4 MatMakeRotationZ(float fAngleRad) {
+	Mat4x4 matrix;
+	matrix.m[0][0] = cosf(fAngleRad);
+	matrix.m[0][1] = sinf(fAngleRad);
+	matrix.m[1][0] = -sinf(fAngleRad);
+	matrix.m[1][1] = cosf(fAngleRad);
+	matrix.m[2][2] = 1.0f;
+	matrix.m[3][3] = 1.0f;
+	return matrix;
+}
+Mat4x4 MatMakeProjection(float fFOVDeg, float fAspectRatio, float fNear, float fFar) {
+	float fFOVRad = 1.0f / tanf(fFOVDeg * 0.5f / 180.0f * 3.1415926f);
+	Mat4x4 matrix;
+	matrix.m[0][0] = fAspectRatio * fFOVRad;
+	matrix.m[1][1] = fFOVRad;
+	matrix.m[2][2] = fFar / (fFar - fNear);
+	matrix.m[3][2] = (-fFar * fNear) / (fFar - fNear);
+	matrix.m[2][3] = -1.0f;
+	matrix.m[3][3] = 0.0f;
+	return matrix;
+}
+Mat4x4 MatMakeTranslation(float x, float y, float z) {
+	Mat4x4 matrix;
+	matrix.m[0][0] = 1.0f;
+	matrix.m[1][1] = 1.0f;
+	matrix.m[2][2] = 1.0f;
+	matrix.m[3][3] = 1.0f;
+	matrix.m[3][0] = x;
+	matrix.m[3][1] = y;
+	matrix.m[3][2] = z;
+	return matrix;
+}
+
+Vec3D MultiplyMatVec(const Mat4x4& m, const Vec3D& vi) {
+	Vec3D vo;
+	vo.x = vi.x * m.m[0][0] + vi.y * m.m[1][0] + vi.z * m.m[2][0] + vi.w * m.m[3][0];
+	vo.y = vi.x * m.m[0][1] + vi.y * m.m[1][1] + vi.z * m.m[2][1] + vi.w * m.m[3][1];
+	vo.z = vi.x * m.m[0][2] + vi.y * m.m[1][2] + vi.z * m.m[2][2] + vi.w * m.m[3][2];
+	vo.w = vi.x * m.m[0][3] + vi.y * m.m[1][3] + vi.z * m.m[2][3] + vi.w * m.m[3][3];
+	return vo;
+}
+Mat4x4 MultiplyMatMat(const Mat4x4& m1, const Mat4x4& m2) {
+	Mat4x4 matrix;
+	for (int c = 0; c < 4; c++) {
+		for (int r = 0; r < 4; r++) {
+			matrix.m[r][c] = m1.m[r][0] * m2.m[0][c] + m1.m[r][1] * m2.m[1][c] + m1.m[r][2] * m2.m[2][c] + m1.m[r][3] * m2.m[3][c];
+		}
+	}
+	return matrix;
+}
+
+Mat4x4 MatPointAt(const Vec3D& vPos, const Vec3D& vTarget, const Vec3D& vUp) {
+	// Calculate new forward direction
+	Vec3D vNewForward = VecsSubtract(vTarget, vPos);
+	vNewForward = VecNormalise(vNewForward);
+
+	// Create new up direction
+	// Calculate original up vector projected on new forward vector
+	Vec3D v = VecsMultiply(vNewForward, VecsDotProduct(vUp, vNewForward));
+	Vec3D vNewUp = VecsSubtract(vUp, v);
+	vNewUp = VecNormalise(vNewUp);
+
+	// Create new right direction
+	Vec3D vNewRight = VecsCrossProduct(vNewUp, vNewForward);
+	//vNewRight = VecNormalise(vNewRight);
+
+	// Construct dimensioning and translation matrix
+	Mat4x4 matrix;
+	matrix.m[0][0] = vNewRight.x;	  matrix.m[0][1] = vNewRight.y;	  matrix.m[0][2] = vNewRight.z;	  matrix.m[0][3] = 0.0f;
+	matrix.m[1][0] = vNewUp.x;		  matrix.m[1][1] = vNewUp.y;		  matrix.m[1][2] = vNewUp.z;		  matrix.m[1][3] = 0.0f;
+	matrix.m[2][0] = vNewForward.x;	matrix.m[2][1] = vNewForward.y;	matrix.m[2][2] = vNewForward.z;	matrix.m[2][3] = 0.0f;
+	matrix.m[3][0] = vPos.x;			  matrix.m[3][1] = vPos.y;			  matrix.m[3][2] = vPos.z;			  matrix.m[3][3] = 1.0f;
+	return matrix;
+}
+// We can get the "LookAt" matrix by inverting the "PointAt" matrix (only for rotation/translation matrices)
+Mat4x4 MatQuickInverse(const Mat4x4& m) {
+	Mat4x4 matrix;
+	matrix.m[0][0] = m.m[0][0]; matrix.m[0][1] = m.m[1][0]; matrix.m[0][2] = m.m[2][0]; matrix.m[0][3] = 0.0f;
+	matrix.m[1][0] = m.m[0][1]; matrix.m[1][1] = m.m[1][1]; matrix.m[1][2] = m.m[2][1]; matrix.m[1][3] = 0.0f;
+	matrix.m[2][0] = m.m[0][2]; matrix.m[2][1] = m.m[1][2]; matrix.m[2][2] = m.m[2][2]; matrix.m[2][3] = 0.0f;
+	matrix.m[3][0] = -(m.m[3][0] * matrix.m[0][0] + m.m[3][1] * matrix.m[1][0] + m.m[3][2] * matrix.m[2][0]);
+	matrix.m[3][1] = -(m.m[3][0] * matrix.m[0][1] + m.m[3][1] * matrix.m[1][1] + m.m[3][2] * matrix.m[2][1]);
+	matrix.m[3][2] = -(m.m[3][0] * matrix.m[0][2] + m.m[3][1] * matrix.m[1][2] + m.m[3][2] * matrix.m[2][2]);
+	matrix.m[3][3] = 1.0f;
+	return matrix;
+}
+
+struct AABB {
+	Vec3D vMin = { FLT_MAX, FLT_MAX, FLT_MAX };
+	Vec3D vMax = { -FLT_MAX, -FLT_MAX, -FLT_MAX };
+
+	void Grow(const Vec3D& v) {
+		vMin.x = (std::min)(vMin.x, v.x); vMin.y = (std::min)(vMin.y, v.y); vMin.z = (std::min)(vMin.z, v.z);
+		vMax.x = (std::max)(vMax.x, v.x); vMax.y = (std::max)(vMax.y, v.y); vMax.z = (std::max)(vMax.z, v.z);
+	}
+	void Grow(const AABB& b) {
+		Grow(b.vMin);
+		Grow(b.vMax);
+	}
+	float SurfaceArea() const {
+		float dx = vMax.x - vMin.x, dy = vMax.y - vMin.y, dz = vMax.z - vMin.z;
+		return (dx < 0.0f) ? 0.0f : 2.0f * (dx * dy + dy * dz + dz * dx);
+	}
+};
+
+// Six planes (a, b, c, d) with a*x + b*y + c*z + d >= 0 inside
+struct Frustum {
+	float planes[6][4];
+};
+
+// Bounding volume hierarchy over a triangle list. Built top-down, splitting
+// each node where the surface area heuristic says tracing through it is
+// cheapest, judged over a handful of bins of triangle centres per axis. If the
+// triangles move but stay the same triangles, Refit() updates the boxes in one
+// pass without rebuilding.
+//
+// Queries report indices into the triangle list the tree was built from
+class BVH {
+public:
+	struct Node {
+		AABB box;
+		int nLeft = 0;  // Inner nodes: children are nLeft and nLeft + 1
+		int nFirst = 0; // Leaves: triangles vecIndices[nFirst .. nFirst + nCount)
+		int nCount = 0; // 0 for inner nodes
+	};
+
+	std::vector<Node> vecNodes;
+	std::vector<int> vecIndices;
+
+	bool Empty() const {
+		return vecNodes.empty();
+	}
+
+	// Subtrees bigger than nParallelThreshold triangles are built as jobs
+	// Tris can be anything that has size() and gives a Triangle from operator[]
+	template<typename Tris>
+	void Build(const Tris& tris, olcJobSystem* jobs = nullptr, int nParallelThreshold = 4096) {
+		int n = (int)tris.size();
+		vecNodes.clear();
+		vecIndices.resize(n);
+		vecBounds.resize(n);
+		vecCentres.resize(n);
+		if (n == 0) {
+			return;
+		}
+
+		auto Prepare = [&](size_t nChunk, size_t nBegin, size_t nEnd) {
+			for (size_t i = nBegin; i < nEnd; i++) {
+				vecIndices[i] = (int)i;
+				vecBounds[i] = TriangleBounds(tris[i]);
+				vecCentres[i] = Centre(vecBounds[i]);
+			}
+		};
+		if (jobs) {
+			jobs->ParallelFor(n, 4096, Prepare);
+		}
+		else {
+			Prepare(0, 0, n);
+		}
+
+		// A binary tree with one triangle per leaf at most has 2n - 1 nodes.
+		// Children are claimed in pairs from nNodesUsed, so jobs don't collide
+		vecNodes.resize(2 * n);
+		std::atomic<int> nNodesUsed{ 1 };
+		vecNodes[0].nFirst = 0;
+		vecNodes[0].nCount = n;
+		Subdivide(0, 0, nNodesUsed, jobs, nParallelThreshold);
+		vecNodes.resize(nNodesUsed);
+		vecNodes.shrink_to_fit();
+		std::vector<AABB>().swap(vecBounds);
+		std::vector<Vec3D>().swap(vecCentres);
+	}
+
+	// The triangles have moved. Children always come after their parent, so
+	// walking backwards sees every child before the parent that needs it
+	template<typename Tris>
+	void Refit(const Tris& tris) {
+		for (int i = (int)vecNodes.size() - 1; i >= 0; i--) {
+			Node& node = vecNodes[i];
+			node.box = AABB();
+			if (node.nCount > 0) {
+				for (int j = 0; j < node.nCount; j++) {
+					node.box.Grow(TriangleBounds(tris[vecIndices[node.nFirst + j]]));
+				}
+			}
+			else {
+				node.box.Grow(vecNodes[node.nLeft].box);
+				node.box.Grow(vecNodes[node.nLeft + 1].box);
+			}
+		}
+	}
+
+	// Call func(index) for every triangle whose node box touches the frustum.
+	// Whole subtrees inside it are reported without further tests
+	template<typename F>
+	void QueryFrustum(const Frustum& frustum, F&& func) const {
+		if (Empty()) {
+			return;
+		}
+
+		int stack[64], nStack = 0;
+		bool inside[64];
+		stack[nStack] = 0; inside[nStack++] = false;
+		while (nStack > 0) {
+			nStack--;
+			const Node& node = vecNodes[stack[nStack]];
+			bool bInside = inside[nStack];
+			if (!bInside) {
+				int nClass = Classify(frustum, node.box);
+				if (nClass < 0) {
+					continue;
+				}
+				bInside = nClass > 0;
+			}
+
+			if (node.nCount > 0) {
+				for (int j = 0; j < node.nCount; j++) {
+					func(vecIndices[node.nFirst + j]);
+				}
+			}
+			else {
+				// Right first, so the left subtree comes out first
+				stack[nStack] = node.nLeft + 1; inside[nStack++] = bInside;
+				stack[nStack] = node.nLeft; inside[nStack++] = bInside;
+			}
+		}
+	}
+
+	// Nearest triangle hit by the ray from vOrigin along vDir within fMaxT.
+	// Returns its index, or -1, and the distance along vDir in fT
+	template<typename Tris>
+	int Raycast(const Tris& tris, const Vec3D& vOrigin, const Vec3D& vDir, float& fT, float fMaxT = FLT_MAX) const {
+		int nHit = -1;
+		fT = fMaxT;
+		if (Empty()) {
+			return nHit;
+		}
+
+		Vec3D vInvDir = { 1.0f / vDir.x, 1.0f / vDir.y, 1.0f / vDir.z };
+		int stack[64], nStack = 0;
+		stack[nStack++] = 0;
+		while (nStack > 0) {
+			const Node& node = vecNodes[stack[--nStack]];
+			if (RayBox(node.box, vOrigin, vInvDir) >= fT) {
+				continue;
+			}
+
+			if (node.nCount > 0) {
+				for (int j = 0; j < node.nCount; j++) {
+					int nTri = vecIndices[node.nFirst + j];
+					float t = RayTriangle(tris[nTri], vOrigin, vDir);
+					if (t < fT) {
+						fT = t;
+						nHit = nTri;
+					}
+				}
+			}
+			else {
+				// Visit the nearer child first, it's the likelier to cut the ray short
+				float t1 = RayBox(vecNodes[node.nLeft].box, vOrigin, vInvDir);
+				float t2 = RayBox(vecNodes[node.nLeft + 1].box, vOrigin, vInvDir);
+				int nNear = t1 <= t2 ? node.nLeft : node.nLeft + 1;
+				stack[nStack++] = (nNear == node.nLeft) ? node.nLeft + 1 : node.nLeft;
+				stack[nStack++] = nNear;
+			}
+		}
+		return nHit;
+	}
+
+private:
+	static const int BINS = 12;
+	static const int MAX_LEAF = 8;
+	static const int MAX_DEPTH = 48;
+
+	// Only needed while building
+	std::vector<AABB> vecBounds;
+	std::vector<Vec3D> vecCentres;
+
+	static AABB TriangleBounds(const Triangle& tri) {
+		AABB box;
+		box.Grow(tri.t[0]);
+		box.Grow(tri.t[1]);
+		box.Grow(tri.t[2]);
+		return box;
+	}
+
+	static Vec3D Centre(const AABB& box) {
+		return { (box.vMin.x + box.vMax.x) * 0.5f, (box.vMin.y + box.vMax.y) * 0.5f, (box.vMin.z + box.vMax.z) * 0.5f };
+	}
+
+	static float Axis(const Vec3D& v, int a) {
+		return a == 0 ? v.x : (a == 1 ? v.y : v.z);
+	}
+
+	void Subdivide(int nNode, int nDepth, std::atomic<int>& nNodesUsed, olcJobSystem* jobs, int nParallelThreshold) {
+		Node& node = vecNodes[nNode];
+		AABB centres;
+		node.box = AABB();
+		for (int i = node.nFirst; i < node.nFirst + node.nCount; i++) {
+			node.box.Grow(vecBounds[vecIndices[i]]);
+			centres.Grow(vecCentres[vecIndices[i]]);
+		}
+		// Depth is bounded by the traversal stacks; past that, just stop splitting
+		if (node.nCount <= 2 || nDepth >= MAX_DEPTH) {
+			return;
+		}
+
+		// Bin the triangle centres along each axis, and find the cheapest plane
+		// between bins: area of each side times the triangles on it. The end bins
+		// always hold the extreme centres, so neither side is ever empty
+		float fBestCost = FLT_MAX;
+		int nBestAxis = -1, nBestSplit = 0;
+		for (int a = 0; a < 3; a++) {
+			float fLo = Axis(centres.vMin, a), fHi = Axis(centres.vMax, a);
+			if (fHi <= fLo) {
+				continue;
+			}
+
+			AABB bins[BINS];
+			int counts[BINS] = { 0 };
+			float fScale = BINS / (fHi - fLo);
+			for (int i = node.nFirst; i < node.nFirst + node.nCount; i++) {
+				int b = (std::min)(BINS - 1, (int)((Axis(vecCentres[vecIndices[i]], a) - fLo) * fScale));
+				counts[b]++;
+				bins[b].Grow(vecBounds[vecIndices[i]]);
+			}
+
+			float fLeftArea[BINS - 1];
+			int nLeftCount[BINS - 1];
+			AABB box;
+			int nCount = 0;
+			for (int b = 0; b < BINS - 1; b++) {
+				box.Grow(bins[b]);
+				nCount += counts[b];
+				fLeftArea[b] = box.SurfaceArea();
+				nLeftCount[b] = nCount;
+			}
+			box = AABB();
+			nCount = 0;
+			for (int b = BINS - 1; b > 0; b--) {
+				box.Grow(bins[b]);
+				nCount += counts[b];
+				float fCost = fLeftArea[b - 1] * nLeftCount[b - 1] + box.SurfaceArea() * nCount;
+				if (fCost < fBestCost) {
+					fBestCost = fCost;
+					nBestAxis = a;
+					nBestSplit = b;
+				}
+			}
+		}
+
+		// Not splitting costs the area times every triangle. Big leaves are split
+		// regardless, since the cost of a leaf grows with it
+		if (node.nCount <= MAX_LEAF && (nBestAxis < 0 || fBestCost >= node.box.SurfaceArea() * node.nCount)) {
+			return;
+		}
+
+		int nMid;
+		if (nBestAxis >= 0) {
+			float fLo = Axis(centres.vMin, nBestAxis);
+			float fScale = BINS / (Axis(centres.vMax, nBestAxis) - fLo);
+			int* pMid = std::partition(&vecIndices[node.nFirst], &vecIndices[node.nFirst] + node.nCount, [&](int i) {
+				return (std::min)(BINS - 1, (int)((Axis(vecCentres[i], nBestAxis) - fLo) * fScale)) < nBestSplit;
+			});
+			nMid = (int)(pMid - &vecIndices[0]);
+		}
+		else {
+			// Every centre is in the same place; any split is as good as another
+			nMid = node.nFirst + node.nCount / 2;
+		}
+
+		int nLeft = nNodesUsed.fetch_add(2);
+		vecNodes[nLeft].nFirst = node.nFirst;
+		vecNodes[nLeft].nCount = nMid - node.nFirst;
+		vecNodes[nLeft + 1].nFirst = nMid;
+		vecNodes[nLeft + 1].nCount = node.nFirst + node.nCount - nMid;
+		node.nLeft = nLeft;
+		node.nCount = 0;
+
+		if (jobs && vecNodes[nLeft].nCount + vecNodes[nLeft + 1].nCount > nParallelThreshold) {
+			jobs->ParallelFor(2, 1, [&](size_t nChunk, size_t nBegin, size_t nEnd) {
+				Subdivide(nLeft + (int)nChunk, nDepth + 1, nNodesUsed, jobs, nParallelThreshold);
+			});
+		}
+		else {
+			Subdivide(nLeft, nDepth + 1, nNodesUsed, jobs, nParallelThreshold);
+			Subdivide(nLeft + 1, nDepth + 1, nNodesUsed, jobs, nParallelThreshold);
+		}
+	}
+
+	// -1 outside, 0 crossing, 1 inside
+	static int Classify(const Frustum& frustum, const AABB& box) {
+		int nResult = 1;
+		for (int p = 0; p < 6; p++) {
+			const float* f = frustum.planes[p];
+			// Corner furthest along the plane normal, and the one furthest against it
+			float fFar = f[0] * (f[0] >= 0 ? box.vMax.x : box.vMin.x) + f[1] * (f[1] >= 0 ? box.vMax.y : box.vMin.y) + f[2] * (f[2] >= 0 ? box.vMax.z : box.vMin.z) + f[3];
+			if (fFar < 0.0f) {
+				return -1;
+			}
+			float fNear = f[0] * (f[0] >= 0 ? box.vMin.x : box.vMax.x) + f[1] * (f[1] >= 0 ? box.vMin.y : box.vMax.y) + f[2] * (f[2] >= 0 ? box.vMin.z : box.vMax.z) + f[3];
+			if (fNear < 0.0f) {
+				nResult = 0;
+			}
+		}
+		return nResult;
+	}
+
+	// Distance to where the ray enters the box, or FLT_MAX if it misses
+	static float RayBox(const AABB& box, const Vec3D& vOrigin, const Vec3D& vInvDir) {
+		float tMin = -FLT_MAX, tMax = FLT_MAX;
+		if (!RaySlab(box.vMin.x, box.vMax.x, vOrigin.x, vInvDir.x, tMin, tMax) ||
+			!RaySlab(box.vMin.y, box.vMax.y, vOrigin.y, vInvDir.y, tMin, tMax) ||
+			!RaySlab(box.vMin.z, box.vMax.z, vOrigin.z, vInvDir.z, tMin, tMax)) {
+			return FLT_MAX;
+		}
+		return (tMax >= tMin && tMax >= 0.0f) ? (std::max)(tMin, 0.0f) : FLT_MAX;
+	}
+
+	// Narrow [tMin, tMax] to where the ray lies between fMin and fMax on one
+	// axis. A ray parallel to the axis is inside the slab all along or never.
+	// That's tested directly, since a ray starting on one of the planes would
+	// otherwise give 0 * inf, and the NaN would make it miss. Returns false if
+	// the ray misses the slab
+	static bool RaySlab(float fMin, float fMax, float fOrigin, float fInvDir, float& tMin, float& tMax) {
+		if (std::isinf(fInvDir)) {
+			return fOrigin >= fMin && fOrigin <= fMax;
+		}
+		float t1 = (fMin - fOrigin) * fInvDir, t2 = (fMax - fOrigin) * fInvDir;
+		tMin = (std::max)(tMin, (std::min)(t1, t2));
+		tMax = (std::min)(tMax, (std::max)(t1, t2));
+		return true;
+	}
+
+	// Moller-Trumbore. Distance along vDir, or FLT_MAX
+	static float RayTriangle(const Triangle& tri, const Vec3D& o, const Vec3D& d) {
+		Vec3D e1 = { tri.t[1].x - tri.t[0].x, tri.t[1].y - tri.t[0].y, tri.t[1].z - tri.t[0].z };
+		Vec3D e2 = { tri.t[2].x - tri.t[0].x, tri.t[2].y - tri.t[0].y, tri.t[2].z - tri.t[0].z };
+		Vec3D p = { d.y * e2.z - d.z * e2.y, d.z * e2.x - d.x * e2.z, d.x * e2.y - d.y * e2.x };
+		float det = e1.x * p.x + e1.y * p.y + e1.z * p.z;
+		if (fabsf(det) < 1e-12f) {
+			return FLT_MAX;
+		}
+		float inv = 1.0f / det;
+		Vec3D s = { o.x - tri.t[0].x, o.y - tri.t[0].y, o.z - tri.t[0].z };
+		float u = (s.x * p.x + s.y * p.y + s.z * p.z) * inv;
+		if (u < 0.0f || u > 1.0f) {
+			return FLT_MAX;
+		}
+		Vec3D q = { s.y * e1.z - s.z * e1.y, s.z * e1.x - s.x * e1.z, s.x * e1.y - s.y * e1.x };
+		float v = (d.x * q.x + d.y * q.y + d.z * q.z) * inv;
+		if (v < 0.0f || u + v > 1.0f) {
+			return FLT_MAX;
+		}
+		float t = (e2.x * q.x + e2.y * q.y + e2.z * q.z) * inv;
+		return t >= 0.0f ? t : FLT_MAX;
+	}
+};
+
+// Compressed vertex storage. A Triangle carries three 16 byte positions, three
+// texture coordinates, and its shading, about 80 bytes. A QuantizedMesh stores
+// each distinct corner once in 12 bytes - position as 16-bit fractions of the
+// mesh bounds, texture coordinates likewise, and the normal octahedron-encoded
+// in two bytes - plus three indices per triangle, 16-bit when there are few
+// enough corners. Decoding the position is a scale and offset, which the
+// renderer folds into the transform matrix.
+struct QuantizedVertex {
+	unsigned short pos[3];
+	unsigned short uv[2];
+	signed char normal[2];
+};
+
+class QuantizedMesh {
+public:
+	std::vector<QuantizedVertex> verts;
+	// 3 per triangle, in the order of the source triangles. Only one of these
+	// is used: the 16-bit one if every corner can be indexed with it
+	std::vector<unsigned short> indices16;
+	std::vector<unsigned int> indices32;
+
+	// position = vOrigin + pos * vScale, texture = vUVOrigin + uv * vUVScale
+	Vec3D vOrigin, vScale;
+	Vec2D vUVOrigin, vUVScale;
+
+	bool Empty() const {
+		return IndexCount() == 0;
+	}
+
+	size_t size() const {
+		return IndexCount() / 3;
+	}
+
+	size_t IndexCount() const {
+		return indices16.size() + indices32.size();
+	}
+
+	unsigned int Index(size_t i) const {
+		return indices16.empty() ? indices32[i] : indices16[i];
+	}
+
+	// Corners with the same position and texture coordinates are shared, unless
+	// the surfaces meeting there bend by more than fCreaseAngle, so flat shaded
+	// edges stay sharp and smooth surfaces get smooth normals
+	void Build(const std::vector<Triangle>& tris, float fCreaseAngle = 0.785f) {
+		verts.clear();
+		indices16.clear();
+		indices32.clear();
+
+		AABB box;
+		Vec2D vUVMin = { FLT_MAX, FLT_MAX }, vUVMax = { -FLT_MAX, -FLT_MAX };
+		for (auto& tri : tris) {
+			for (int i = 0; i < 3; i++) {
+				box.Grow(tri.t[i]);
+				vUVMin.u = (std::min)(vUVMin.u, tri.tx[i].u); vUVMin.v = (std::min)(vUVMin.v, tri.tx[i].v);
+				vUVMax.u = (std::max)(vUVMax.u, tri.tx[i].u); vUVMax.v = (std::max)(vUVMax.v, tri.tx[i].v);
+			}
+		}
+		if (tris.empty()) {
+			return;
+		}
+		vOrigin = box.vMin;
+		vScale = { Step(box.vMin.x, box.vMax.x), Step(box.vMin.y, box.vMax.y), Step(box.vMin.z, box.vMax.z) };
+		vUVOrigin = vUVMin;
+		vUVScale = { Step(vUVMin.u, vUVMax.u), Step(vUVMin.v, vUVMax.v) };
+
+		// Quantize first, then share corners that quantized to the same thing
+		struct Corner {
+			QuantizedVertex q;
+			Vec3D vNormal;
+		};
+		std::vector<Corner> vecCorners;
+		std::map<std::tuple<unsigned short, unsigned short, unsigned short, unsigned short, unsigned short>, std::vector<int>> mapShared;
+		float fCosCrease = cosf(fCreaseAngle);
+
+		indices32.reserve(tris.size() * 3);
+		for (auto& tri : tris) {
+			Vec3D e1 = { tri.t[1].x - tri.t[0].x, tri.t[1].y - tri.t[0].y, tri.t[1].z - tri.t[0].z };
+			Vec3D e2 = { tri.t[2].x - tri.t[0].x, tri.t[2].y - tri.t[0].y, tri.t[2].z - tri.t[0].z };
+			Vec3D n = { e1.y * e2.z - e1.z * e2.y, e1.z * e2.x - e1.x * e2.z, e1.x * e2.y - e1.y * e2.x };
+			float l = sqrtf(n.x * n.x + n.y * n.y + n.z * n.z);
+			Vec3D nUnit = l > 0.0f ? Vec3D{ n.x / l, n.y / l, n.z / l } : Vec3D{ 0.0f, 1.0f, 0.0f };
+
+			for (int i = 0; i < 3; i++) {
+				QuantizedVertex q;
+				q.pos[0] = Quantize(tri.t[i].x, vOrigin.x, vScale.x);
+				q.pos[1] = Quantize(tri.t[i].y, vOrigin.y, vScale.y);
+				q.pos[2] = Quantize(tri.t[i].z, vOrigin.z, vScale.z);
+				q.uv[0] = Quantize(tri.tx[i].u, vUVOrigin.u, vUVScale.u);
+				q.uv[1] = Quantize(tri.tx[i].v, vUVOrigin.v, vUVScale.v);
+
+				std::vector<int>& vecShared = mapShared[std::make_tuple(q.pos[0], q.pos[1], q.pos[2], q.uv[0], q.uv[1])];
+				int nCorner = -1;
+				for (int c : vecShared) {
+					Vec3D& m = vecCorners[c].vNormal;
+					float ml = sqrtf(m.x * m.x + m.y * m.y + m.z * m.z);
+					if (ml > 0.0f && (m.x * nUnit.x + m.y * nUnit.y + m.z * nUnit.z) >= fCosCrease * ml) {
+						nCorner = c;
+						break;
+					}
+				}
+				if (nCorner < 0) {
+					nCorner = (int)vecCorners.size();
+					vecCorners.push_back({ q, { 0.0f, 0.0f, 0.0f } });
+					vecShared.push_back(nCorner);
+				}
+
+				// Area weighted, so slivers don't skew the average
+				vecCorners[nCorner].vNormal.x += n.x;
+				vecCorners[nCorner].vNormal.y += n.y;
+				vecCorners[nCorner].vNormal.z += n.z;
+				indices32.push_back((unsigned int)nCorner);
+			}
+		}
+
+		verts.resize(vecCorners.size());
+		for (size_t i = 0; i < vecCorners.size(); i++) {
+			verts[i] = vecCorners[i].q;
+			EncodeNormal(vecCorners[i].vNormal, verts[i].normal);
+		}
+		if (verts.size() <= 65536) {
+			indices16.assign(indices32.begin(), indices32.end());
+			std::vector<unsigned int>().swap(indices32);
+		}
+	}
+
+	Vec3D Position(const QuantizedVertex& q) const {
+		return { vOrigin.x + q.pos[0] * vScale.x, vOrigin.y + q.pos[1] * vScale.y, vOrigin.z + q.pos[2] * vScale.z };
+	}
+
+	Vec2D UV(const QuantizedVertex& q) const {
+		return { vUVOrigin.u + q.uv[0] * vUVScale.u, vUVOrigin.v + q.uv[1] * vUVScale.v };
+	}
+
+	// Triangle i, decoded
+	Triangle operator[](size_t i) const {
+		Triangle tri = {};
+		for (int c = 0; c < 3; c++) {
+			const QuantizedVertex& q = verts[Index(i * 3 + c)];
+			tri.t[c] = Position(q);
+			tri.tx[c] = UV(q);
+		}
+		return tri;
+	}
+
+	size_t MemoryUsage() const {
+		return verts.size() * sizeof(QuantizedVertex) + indices16.size() * sizeof(unsigned short) + indices32.size() * sizeof(unsigned int);
+	}
+
+	// Octahedral encoding: project the unit normal onto the octahedron
+	// |x| + |y| + |z| = 1, fold the lower half over the upper, and store x, y
+	static void EncodeNormal(Vec3D n, signed char out[2]) {
+		float l = fabsf(n.x) + fabsf(n.y) + fabsf(n.z);
+		if (l == 0.0f) {
+			out[0] = 0; out[1] = 127;
+			return;
+		}
+		float x = n.x / l, y = n.y / l;
+		if (n.z < 0.0f) {
+			float fx = (1.0f - fabsf(y)) * (x >= 0.0f ? 1.0f : -1.0f);
+			float fy = (1.0f - fabsf(x)) * (y >= 0.0f ? 1.0f : -1.0f);
+			x = fx;
+			y = fy;
+		}
+		out[0] = (signed char)roundf(x * 127.0f);
+		out[1] = (signed char)roundf(y * 127.0f);
+	}
+
+	static Vec3D DecodeNormal(const signed char in[2]) {
+		float x = in[0] / 127.0f, y = in[1] / 127.0f;
+		float z = 1.0f - fabsf(x) - fabsf(y);
+		if (z < 0.0f) {
+			float fx = (1.0f - fabsf(y)) * (x >= 0.0f ? 1.0f : -1.0f);
+			float fy = (1.0f - fabsf(x)) * (y >= 0.0f ? 1.0f : -1.0f);
+			x = fx;
+			y = fy;
+		}
+		float l = sqrtf(x * x + y * y + z * z);
+		return { x / l, y / l, z / l, 0.0f };
+	}
+
+private:
+	static float Step(float fMin, float fMax) {
+		return (fMax > fMin) ? (fMax - fMin) / 65535.0f : 1.0f;
+	}
+
+	static unsigned short Quantize(float f, float fOrigin, float fStep) {
+		float q = (f - fOrigin) / fStep + 0.5f;
+		return (unsigned short)(std::max)(0.0f, (std::min)(65535.0f, q));
+	}
+};
+
+struct Edge {
+	int v[2]; // Indices into Mesh::verts
+	int tri[2]; // Triangles either side, -1 if the mesh is open here
+};
+
+// A mesh's triangles in world space, lit, with their normals, and its welded
+// vertices in world space. Only depends on the mesh and its transform, so while
+// neither changes only the camera dependent work is redone each frame
+struct WorldCache {
+	bool bValid = false;
+	Mat4x4 matTransformation; // What it was built with
+	unsigned int nShadowVersion = 0; // And the shadow map it was lit with, 0 for none
+	std::vector<Triangle> tris;
+	std::vector<Vec3D> normals;
+	std::vector<Vec3D> verts;
+};
+
+// Material IDs, which deferred shading keeps for every cell. 0 is no surface
+const int MATERIAL_NONE = 0;
+const int MATERIAL_MODEL = 1;
+const int MATERIAL_TERRAIN = 2;
+const int MATERIAL_COUNT = 3;
+
 struct Mesh {
 	std::vector<Triangle> tris;
+	int nMaterial = MATERIAL_MODEL;
+
+	// Welded vertices, and the edges between them with each shared edge stored
+	// once. Built by BuildEdges(), from tris or, once they're dropped, from the
+	// quantized copy
+	std::vector<Vec3D> verts;
+	std::vector<int> triVerts; // 3 per triangle
+	std::vector<Edge> edges;
+
+	// Spatial index over tris, for culling and picking
+	BVH bvh;
+
+	// Call after changing tris. Drops the world space cache as well
+	void BuildBVH(olcJobSystem* jobs = nullptr) {
+		bvh.Build(tris, jobs);
+		world.bValid = false;
+	}
+
+	// Kept by the renderer for meshes drawn from tris
+	WorldCache world;
+
+	// Compressed copy of tris. Once built, tris can be dropped and everything
+	// is drawn from this instead
+	QuantizedMesh quantized;
+
+	// Dropping the triangles drops the edges too; BuildEdges() makes them again
+	// from the quantized copy if they're wanted
+	void Quantize(bool bDropTriangles) {
+		quantized.Build(tris);
+		if (bDropTriangles) {
+			std::vector<Triangle>().swap(tris);
+			ClearEdges();
+		}
+	}
+
+	size_t TriangleCount() {
+		return tris.empty() ? quantized.size() : tris.size();
+	}
+
+	void BuildEdges() {
+		verts.clear();
+		triVerts.clear();
+		edges.clear();
+
+		// Weld corners with identical positions into one vertex
+		if (!tris.empty()) {
+			std::map<std::tuple<float, float, float>, int> mapVerts;
+			for (auto& tri : tris) {
+				for (int i = 0; i < 3; i++) {
+					auto key = std::make_tuple(tri.t[i].x, tri.t[i].y, tri.t[i].z);
+					auto it = mapVerts.find(key);
+					if (it == mapVerts.end()) {
+						it = mapVerts.insert({ key, (int)verts.size() }).first;
+						verts.push_back(tri.t[i]);
+					}
+					triVerts.push_back(it->second);
+				}
+			}
+		}
+		else {
+			// Quantized corners split by a crease share a position
+			std::map<std::tuple<unsigned short, unsigned short, unsigned short>, int> mapVerts;
+			std::vector<int> vecWelded(quantized.verts.size());
+			for (size_t i = 0; i < quantized.verts.size(); i++) {
+				const QuantizedVertex& q = quantized.verts[i];
+				auto it = mapVerts.insert({ std::make_tuple(q.pos[0], q.pos[1], q.pos[2]), (int)verts.size() }).first;
+				if (it->second == (int)verts.size()) {
+					verts.push_back(quantized.Position(q));
+				}
+				vecWelded[i] = it->second;
+			}
+			triVerts.resize(quantized.IndexCount());
+			for (size_t i = 0; i < triVerts.size(); i++) {
+				triVerts[i] = vecWelded[quantized.Index(i)];
+			}
+		}
+
+		// Each edge is keyed by its two vertices, lowest first, so the
+		// neighbouring triangle finds the same one going the other way
+		std::unordered_map<unsigned long long, int> mapEdges;
+		for (int t = 0; t < (int)TriangleCount(); t++) {
+			for (int i = 0; i < 3; i++) {
+				int a = triVerts[t * 3 + i], b = triVerts[t * 3 + (i + 1) % 3];
+				if (a == b) {
+					continue;
+				}
+				unsigned long long key = ((unsigned long long)(std::min)(a, b) << 32) | (unsigned int)(std::max)(a, b);
+				auto it = mapEdges.find(key);
+				if (it == mapEdges.end()) {
+					mapEdges[key] = (int)edges.size();
+					edges.push_back({ { a, b }, { t, -1 } });
+				}
+				else if (edges[it->second].tri[1] < 0) {
+					edges[it->second].tri[1] = t;
+				}
+			}
+		}
+	}
+
+	void ClearEdges() {
+		std::vector<Vec3D>().swap(verts);
+		std::vector<int>().swap(triVerts);
+		std::vector<Edge>().swap(edges);
+	}
+
 	bool LoadFromObjectFile(std::string sFilename) {
 		std::ifstream f(sFilename);
 		if (!f.is_open()) {
@@ -61,20 +931,835 @@ struct Mesh {
 
 		return true;
 	}
-};
+};
+
+// Scene graph. Each node has a transform local to its parent, and a world
+// matrix worked out from them. Nodes live in flat arrays indexed by node, and a
+// node is always added after its parent, so a single pass from front to back
+// reaches every parent before its children. SetLocal() marks a node dirty, and
+// Update() makes that pass from the first dirty node, recomputing the world
+// matrix of every dirty node and of everything below one.
+class SceneGraph {
+public:
+	// nParent is -1 for a root. Returns the new node
+	int AddNode(int nParent, const Mat4x4& matLocal) {
+		int nNode = (int)vecParent.size();
+		vecParent.push_back(nParent);
+		vecLocal.push_back(matLocal);
+		vecWorld.push_back(matLocal);
+		vecDirty.push_back(1);
+		vecChanged.push_back(0);
+		nFirstDirty = (std::min)(nFirstDirty, (size_t)nNode);
+		return nNode;
+	}
+
+	void SetLocal(int nNode, const Mat4x4& matLocal) {
+		vecLocal[nNode] = matLocal;
+		vecDirty[nNode] = 1;
+		nFirstDirty = (std::min)(nFirstDirty, (size_t)nNode);
+	}
+
+	const Mat4x4& Local(int nNode) const {
+		return vecLocal[nNode];
+	}
+
+	// As of the last Update()
+	const Mat4x4& World(int nNode) const {
+		return vecWorld[nNode];
+	}
+
+	int Parent(int nNode) const {
+		return vecParent[nNode];
+	}
+
+	// Whether the last Update() moved the node
+	bool Changed(int nNode) const {
+		return vecChanged[nNode] != 0;
+	}
+
+	size_t size() const {
+		return vecParent.size();
+	}
+
+	// Returns how many world matrices were recomputed
+	size_t Update() {
+		std::fill(vecChanged.begin() + (std::min)(nFirstChanged, vecChanged.size()), vecChanged.end(), 0);
+		nFirstChanged = nFirstDirty;
+
+		size_t nUpdated = 0;
+		for (size_t i = nFirstDirty; i < vecParent.size(); i++) {
+			int nParent = vecParent[i];
+			if (!vecDirty[i] && (nParent < 0 || !vecChanged[nParent])) {
+				continue;
+			}
+			vecWorld[i] = nParent < 0 ? vecLocal[i] : MultiplyMatMat(vecLocal[i], vecWorld[nParent]);
+			vecDirty[i] = 0;
+			vecChanged[i] = 1;
+			nUpdated++;
+		}
+		nFirstDirty = SIZE_MAX;
+		return nUpdated;
+	}
+
+private:
+	std::vector<int> vecParent;
+	std::vector<Mat4x4> vecLocal;
+	std::vector<Mat4x4> vecWorld;
+	std::vector<char> vecDirty;
+	std::vector<char> vecChanged;
+	size_t nFirstDirty = SIZE_MAX;
+	size_t nFirstChanged = SIZE_MAX; // Nothing before here was changed by the last Update()
+};
+
+// Terrain streaming. The world is cut into square chunks of heightmap. A
+// background thread builds the chunks around the camera, nearest first, and
+// the renderer picks up whichever are ready; the rest fill in over the next
+// frames. Built chunks are kept in an LRU cache of bounded size, so flying
+// back over ground you've seen is free, but memory doesn't grow with the world.
+
+// Where heights come from. Only ever called from the streaming thread
+class TerrainSource {
+public:
+	virtual ~TerrainSource() {}
+
+	// Fill vecHeights with nSamples x nSamples heights, row by row, starting at
+	// sample (x0, z0) of the world
+	virtual void LoadHeights(int x0, int z0, int nSamples, std::vector<float>& vecHeights) = 0;
+};
+
+// Endless rolling hills from a few octaves of value noise
+class ProceduralTerrain : public TerrainSource {
+public:
+	ProceduralTerrain(unsigned int seed = 1, float fBase = -6.0f, float fAmplitude = 8.0f, float fFeatureSize = 24.0f)
+		: nSeed(seed), fBase(fBase), fAmplitude(fAmplitude), fFeatureSize(fFeatureSize) {
+	}
+
+	void LoadHeights(int x0, int z0, int nSamples, std::vector<float>& vecHeights) override {
+		vecHeights.resize(nSamples * nSamples);
+		for (int z = 0; z < nSamples; z++) {
+			for (int x = 0; x < nSamples; x++) {
+				float fx = (float)(x0 + x) / fFeatureSize, fz = (float)(z0 + z) / fFeatureSize;
+				float fHeight = 0.0f, fScale = 0.5f;
+				for (int o = 0; o < 5; o++) {
+					fHeight += fScale * Noise(fx, fz, o);
+					fx *= 2.0f;
+					fz *= 2.0f;
+					fScale *= 0.5f;
+				}
+				vecHeights[z * nSamples + x] = fBase + fAmplitude * fHeight;
+			}
+		}
+	}
+
+private:
+	unsigned int nSeed;
+	float fBase, fAmplitude, fFeatureSize;
+
+	float Lattice(int x, int z, int octave) {
+		unsigned int h = nSeed * 0x9E3779B9u ^ (unsigned int)x * 0x85EBCA6Bu ^ (unsigned int)z * 0xC2B2AE35u ^ (unsigned int)octave * 0x27D4EB2Fu;
+		h ^= h >> 15; h *= 0x2C1B3C6Du; h ^= h >> 12; h *= 0x297A2D39u; h ^= h >> 15;
+		return (float)(h & 0xFFFF) / 65535.0f;
+	}
+
+	float Noise(float x, float z, int octave) {
+		int ix = (int)floorf(x), iz = (int)floorf(z);
+		float tx = x - ix, tz = z - iz;
+		tx = tx * tx * (3.0f - 2.0f * tx);
+		tz = tz * tz * (3.0f - 2.0f * tz);
+		float a = Lattice(ix, iz, octave) + (Lattice(ix + 1, iz, octave) - Lattice(ix, iz, octave)) * tx;
+		float b = Lattice(ix, iz + 1, octave) + (Lattice(ix + 1, iz + 1, octave) - Lattice(ix, iz + 1, octave)) * tx;
+		return a + (b - a) * tz;
+	}
+};
+
+// A raw 16-bit little-endian heightmap on disk, nWidth x nDepth samples. Only
+// the rows a chunk needs are read, so the map can be bigger than memory.
+// Outside the map the edge samples carry on
+class HeightmapTerrain : public TerrainSource {
+public:
+	HeightmapTerrain(std::string sFilename, int nWidth, int nDepth, float fBase = -10.0f, float fScale = 16.0f / 65535.0f)
+		: nWidth(nWidth), nDepth(nDepth), fBase(fBase), fScale(fScale) {
+		f.open(sFilename, std::ios::binary);
+	}
+
+	bool IsOpen() {
+		return f.is_open();
+	}
+
+	void LoadHeights(int x0, int z0, int nSamples, std::vector<float>& vecHeights) override {
+		vecHeights.assign(nSamples * nSamples, fBase);
+		if (!f.is_open()) {
+			return;
+		}
+
+		// Read the part of each row we need in one go, then stretch the edges
+		int xa = (std::max)(0, (std::min)(x0, nWidth - 1));
+		int xb = (std::max)(0, (std::min)(x0 + nSamples - 1, nWidth - 1));
+		vecRow.resize(xb - xa + 1);
+		for (int z = 0; z < nSamples; z++) {
+			int zs = (std::max)(0, (std::min)(z0 + z, nDepth - 1));
+			f.clear();
+			f.seekg(((std::streamoff)zs * nWidth + xa) * 2);
+			f.read((char*)vecRow.data(), vecRow.size() * 2);
+			for (int x = 0; x < nSamples; x++) {
+				int xs = (std::max)(xa, (std::min)(x0 + x, xb));
+				vecHeights[z * nSamples + x] = fBase + fScale * (float)vecRow[xs - xa];
+			}
+		}
+	}
+
+private:
+	std::ifstream f;
+	int nWidth, nDepth;
+	float fBase, fScale;
+	std::vector<unsigned short> vecRow;
+};
+
+struct TerrainChunk {
+	int cx, cz;
+	Mesh mesh;
+};
+
+class TerrainStreamer {
+public:
+	// Chunks are nChunkCells x nChunkCells cells of fCellSize. Everything within
+	// nRadius chunks of the camera is requested, and at most nMaxChunks are kept
+	TerrainStreamer(TerrainSource* source, int nChunkCells = 32, float fCellSize = 1.0f, int nRadius = 4, size_t nMaxChunks = 128)
+		: source(source), nChunkCells(nChunkCells), fCellSize(fCellSize), nRadius(nRadius) {
+		this->nMaxChunks = (std::max)(nMaxChunks, (size_t)((2 * nRadius + 1) * (2 * nRadius + 1)));
+		threadWorker = std::thread(&TerrainStreamer::WorkerThread, this);
+	}
+
+	~TerrainStreamer() {
+		{
+			std::unique_lock<std::mutex> lm(mux);
+			bRunning = false;
+			cvRequest.notify_all();
+		}
+		threadWorker.join();
+	}
+
+	// Call once a frame. Takes in chunks that finished building, asks for the
+	// ones around the camera that are missing, and returns those ready to draw
+	void Update(Vec3D& vCamera, std::vector<std::shared_ptr<TerrainChunk>>& vecVisible) {
+		std::vector<std::shared_ptr<TerrainChunk>> vecReady;
+		{
+			std::unique_lock<std::mutex> lm(mux);
+			vecReady.swap(vecBuilt);
+		}
+		for (auto& chunk : vecReady) {
+			// A chunk requested again before its first build arrived comes in
+			// twice. Keep the first, so each key has exactly one node in listLRU
+			unsigned long long key = Key(chunk->cx, chunk->cz);
+			if (mapCache.count(key) != 0) {
+				continue;
+			}
+			listLRU.push_front(key);
+			mapCache[key] = { chunk, listLRU.begin() };
+		}
+
+		float fChunkSize = nChunkCells * fCellSize;
+		int ccx = (int)floorf(vCamera.x / fChunkSize), ccz = (int)floorf(vCamera.z / fChunkSize);
+
+		vecVisible.clear();
+		std::vector<std::pair<int, unsigned long long>> vecWanted;
+		for (int dz = -nRadius; dz <= nRadius; dz++) {
+			for (int dx = -nRadius; dx <= nRadius; dx++) {
+				int d = dx * dx + dz * dz;
+				if (d > nRadius * nRadius) {
+					continue;
+				}
+				unsigned long long key = Key(ccx + dx, ccz + dz);
+				auto it = mapCache.find(key);
+				if (it != mapCache.end()) {
+					listLRU.splice(listLRU.begin(), listLRU, it->second.itLRU);
+					vecVisible.push_back(it->second.chunk);
+				}
+				else {
+					vecWanted.push_back({ d, key });
+				}
+			}
+		}
+
+		// Replace the request queue, nearest first. Chunks that have gone out of
+		// range since last frame are dropped before they're built, and those
+		// being built or finished since we looked aren't asked for again
+		std::sort(vecWanted.begin(), vecWanted.end());
+		{
+			std::unique_lock<std::mutex> lm(mux);
+			dequeRequests.clear();
+			for (auto& w : vecWanted) {
+				bool bBuilt = std::any_of(vecBuilt.begin(), vecBuilt.end(), [&](const std::shared_ptr<TerrainChunk>& chunk) {
+					return Key(chunk->cx, chunk->cz) == w.second;
+				});
+				if (w.second != nBuilding && !bBuilt) {
+					dequeRequests.push_back(w.second);
+				}
+			}
+			cvRequest.notify_one();
+		}
+
+		// Everything visible was just moved to the front, so this only drops
+		// chunks we've left behind
+		while (mapCache.size() > nMaxChunks) {
+			mapCache.erase(listLRU.back());
+			listLRU.pop_back();
+		}
+	}
+
+	size_t CachedChunks() {
+		return mapCache.size();
+	}
+
+private:
+	struct CacheEntry {
+		std::shared_ptr<TerrainChunk> chunk;
+		std::list<unsigned long long>::iterator itLRU;
+	};
+
+	TerrainSource* source;
+	int nChunkCells;
+	float fCellSize;
+	int nRadius;
+	size_t nMaxChunks;
+
+	// Only touched by the render thread
+	std::list<unsigned long long> listLRU;
+	std::unordered_map<unsigned long long, CacheEntry> mapCache;
+
+	// Shared with the streaming thread, under mux
+	std::deque<unsigned long long> dequeRequests;
+	std::vector<std::shared_ptr<TerrainChunk>> vecBuilt;
+	unsigned long long nBuilding = ~0ull;
+	bool bRunning = true;
+	std::mutex mux;
+	std::condition_variable cvRequest;
+	std::thread threadWorker;
+
+	static unsigned long long Key(int cx, int cz) {
+		return ((unsigned long long)(unsigned int)cx << 32) | (unsigned int)cz;
+	}
+
+	void WorkerThread() {
+		std::vector<float> vecHeights;
+		while (true) {
+			unsigned long long key;
+			{
+				std::unique_lock<std::mutex> lm(mux);
+				cvRequest.wait(lm, [&] { return !bRunning || !dequeRequests.empty(); });
+				if (!bRunning) {
+					return;
+				}
+				key = dequeRequests.front();
+				dequeRequests.pop_front();
+				nBuilding = key;
+			}
+
+			auto chunk = BuildChunk((int)(key >> 32), (int)(unsigned int)key, vecHeights);
+
+			std::unique_lock<std::mutex> lm(mux);
+			vecBuilt.push_back(chunk);
+			nBuilding = ~0ull;
+		}
+	}
+
+	std::shared_ptr<TerrainChunk> BuildChunk(int cx, int cz, std::vector<float>& vecHeights) {
+		auto chunk = std::make_shared<TerrainChunk>();
+		chunk->cx = cx;
+		chunk->cz = cz;
+
+		// One more row and column of samples than cells, shared with the
+		// neighbours so there are no cracks
+		int n = nChunkCells + 1;
+		int x0 = cx * nChunkCells, z0 = cz * nChunkCells;
+		source->LoadHeights(x0, z0, n, vecHeights);
+
+		auto Vertex = [&](int x, int z) {
+			Vec3D v = { (x0 + x) * fCellSize, vecHeights[z * n + x], (z0 + z) * fCellSize };
+			return v;
+		};
+
+		std::vector<Triangle>& tris = chunk->mesh.tris;
+		tris.reserve(nChunkCells * nChunkCells * 2);
+		for (int z = 0; z < nChunkCells; z++) {
+			for (int x = 0; x < nChunkCells; x++) {
+				Triangle t1 = {}, t2 = {};
+				t1.t[0] = Vertex(x, z); t1.t[1] = Vertex(x, z + 1); t1.t[2] = Vertex(x + 1, z);
+				t2.t[0] = Vertex(x + 1, z); t2.t[1] = Vertex(x, z + 1); t2.t[2] = Vertex(x + 1, z + 1);
+				tris.push_back(t1);
+				tris.push_back(t2);
+			}
+		}
+		chunk->mesh.nMaterial = MATERIAL_TERRAIN;
+		chunk->mesh.BuildBVH();
+		chunk->mesh.Quantize(true);
+		return chunk;
+	}
+};
+
+// What the raster stage sorts and draws. A projected Triangle is 80 bytes,
+// most of which sorting and rasterizing never read; a ScreenTriangle is 32:
+// screen coordinates in the 28.4 fixed point FillTriangleSubpixel takes, the
+// depth to sort on, and the index of the rest of the triangle in
+// RasterQueue::attributes
+struct ScreenTriangle {
+	int x[3], y[3];
+	float fDepth;
+	int nAttributes;
+};
+
+struct ScreenTriangleAttributes {
+	Vec2D tx[3];
+	wchar_t symbol;
+	short colour;
+	float w[3]; // 1/z of each corner in view space, for the G-buffer
+	uint32_t nSurface; // Normal and material, see GBuffer::PackSurface()
+};
+
+struct RasterQueue {
+	std::vector<ScreenTriangle> tris;
+	std::vector<ScreenTriangleAttributes> attributes;
+
+	void Clear() {
+		tris.clear();
+		attributes.clear();
+	}
+
+	// tri is in screen space, within the guard band. Corners snap to the
+	// nearest sub-pixel, once, so triangles sharing a corner share it exactly
+	void Push(const Triangle& tri, float fDepth, uint32_t nSurface) {
+		const float fOne = (float)(1 << olcConsoleGameEngine::SUBPIXEL_BITS);
+		ScreenTriangle s;
+		for (int i = 0; i < 3; i++) {
+			s.x[i] = (int)floorf(tri.t[i].x * fOne + 0.5f);
+			s.y[i] = (int)floorf(tri.t[i].y * fOne + 0.5f);
+		}
+		s.fDepth = fDepth;
+		s.nAttributes = (int)attributes.size();
+		tris.push_back(s);
+		attributes.push_back({ { tri.tx[0], tri.tx[1], tri.tx[2] }, tri.symbol, tri.colour, { tri.t[0].z, tri.t[1].z, tri.t[2].z }, nSurface });
+	}
+
+	// Append another queue after this one, moving its attribute indices up
+	// past ours
+	void Append(const RasterQueue& queue) {
+		int nBase = (int)attributes.size();
+		for (ScreenTriangle s : queue.tris) {
+			s.nAttributes += nBase;
+			tris.push_back(s);
+		}
+		attributes.insert(attributes.end(), queue.attributes.begin(), queue.attributes.end());
+	}
+};
+
+// One camera and the rectangle of the screen it's drawn into. Viewports share
+// everything that doesn't depend on the camera - world space triangles, the
+// BVHs, the scene graph, terrain streaming - so only culling, projection and
+// raster are done once per viewport
+struct Viewport {
+	int x = 0, y = 0, w = 0, h = 0;
+	Vec3D vCamera, vTarget, vUp;
+	Mat4x4 matCamera; // View space to world space
+	Mat4x4 matView;
+	Mat4x4 matProjection;
+	RasterQueue queue;
+	std::vector<int> vecVisibleTris; // Of the mesh being drawn
+};
+
+// Shadow map for a directional light. Casters are gathered in world space, the
+// light looks at them through an orthographic box fitted around them all, and
+// the depth along the light of the nearest surface is rasterized into
+// nSize x nSize texels. Only depth is written, with no clipping, sorting or
+// attributes, and the map is cut into bands of rows that are rasterized as
+// separate jobs, so no two threads ever write the same texel
+class ShadowMap {
+public:
+	// Start gathering casters. vLightDir points towards the light
+	void Begin(int nSize, const Vec3D& vLightDir) {
+		this->nSize = nSize;
+		vForward = { -vLightDir.x, -vLightDir.y, -vLightDir.z };
+		// Any axis not along the light will do for the map's up
+		Vec3D vAxis = fabsf(vForward.y) < 0.9f ? Vec3D{ 0.0f, 1.0f, 0.0f } : Vec3D{ 0.0f, 0.0f, 1.0f };
+		vRight = VecNormalise(VecsCrossProduct(vAxis, vForward));
+		vUp = VecsCrossProduct(vForward, vRight);
+		vecVerts.clear();
+		vecTris.clear();
+	}
+
+	// Welded vertices and 3 indices per triangle, as Mesh keeps them
+	void AddMesh(const std::vector<Vec3D>& verts, const std::vector<int>& triVerts, const Mat4x4& matTransformation) {
+		int nBase = (int)vecVerts.size();
+		for (const Vec3D& v : verts) {
+			AddVertex(v, matTransformation);
+		}
+		for (int i : triVerts) {
+			vecTris.push_back(nBase + i);
+		}
+	}
+
+	// Or straight from a quantized mesh, decoding the positions
+	void AddMesh(const QuantizedMesh& mesh, const Mat4x4& matTransformation) {
+		int nBase = (int)vecVerts.size();
+		for (const QuantizedVertex& q : mesh.verts) {
+			AddVertex(mesh.Position(q), matTransformation);
+		}
+		for (size_t i = 0; i < mesh.IndexCount(); i++) {
+			vecTris.push_back(nBase + (int)mesh.Index(i));
+		}
+	}
+
+	// Fit the light's box around the casters and rasterize them
+	void Render(olcJobSystem& jobs) {
+		vecDepth.assign((size_t)nSize * nSize, FLT_MAX);
+		nVersion++;
+		if (vecVerts.empty()) {
+			return;
+		}
+
+		// To light space, then scaled so the wider side of the box fills the map
+		float fMinX = FLT_MAX, fMinY = FLT_MAX, fMaxX = -FLT_MAX, fMaxY = -FLT_MAX;
+		for (Vec3D& v : vecVerts) {
+			v = { VecsDotProduct(v, vRight), VecsDotProduct(v, vUp), VecsDotProduct(v, vForward) };
+			fMinX = (std::min)(fMinX, v.x); fMaxX = (std::max)(fMaxX, v.x);
+			fMinY = (std::min)(fMinY, v.y); fMaxY = (std::max)(fMaxY, v.y);
+		}
+		fScale = (float)nSize / (std::max)((std::max)(fMaxX - fMinX, fMaxY - fMinY), 1e-3f);
+		fOffsetX = -fMinX * fScale;
+		fOffsetY = -fMinY * fScale;
+		for (Vec3D& v : vecVerts) {
+			v.x = v.x * fScale + fOffsetX;
+			v.y = v.y * fScale + fOffsetY;
+		}
+
+		int nBands = (nSize + BAND_ROWS - 1) / BAND_ROWS;
+		vecBands.resize(nBands);
+		for (auto& band : vecBands) {
+			band.clear();
+		}
+		for (size_t t = 0; t < vecTris.size(); t += 3) {
+			float fMin = (std::min)(vecVerts[vecTris[t]].y, (std::min)(vecVerts[vecTris[t + 1]].y, vecVerts[vecTris[t + 2]].y));
+			float fMax = (std::max)(vecVerts[vecTris[t]].y, (std::max)(vecVerts[vecTris[t + 1]].y, vecVerts[vecTris[t + 2]].y));
+			int nFirst = (std::max)(0, (int)floorf(fMin) / BAND_ROWS);
+			int nLast = (std::min)(nBands - 1, (int)floorf(fMax) / BAND_ROWS);
+			for (int b = nFirst; b <= nLast; b++) {
+				vecBands[b].push_back((int)t);
+			}
+		}
+
+		jobs.ParallelFor(nBands, 1, [&](size_t nChunk, size_t nBegin, size_t nEnd) {
+			for (size_t b = nBegin; b < nEnd; b++) {
+				RasterizeBand((int)b);
+			}
+		});
+	}
+
+	// How much of the light reaches a world space point on a surface facing
+	// vNormal: 1 lit, 0 in shadow. Points outside the map are lit
+	float Lit(const Vec3D& v, const Vec3D& vNormal) const {
+		if (vecDepth.empty()) {
+			return 1.0f;
+		}
+		int x = (int)floorf(VecsDotProduct(v, vRight) * fScale + fOffsetX);
+		int y = (int)floorf(VecsDotProduct(v, vUp) * fScale + fOffsetY);
+		if (x < 0 || x >= nSize || y < 0 || y >= nSize) {
+			return 1.0f;
+		}
+		// The texel's depth was taken at its centre, up to most of a texel away.
+		// How much deeper the surface can be there depends on how steeply it
+		// slopes away from the light
+		float fCos = (std::max)(-VecsDotProduct(vNormal, vForward), 0.1f);
+		float fTan = sqrtf(1.0f - (std::min)(fCos * fCos, 1.0f)) / fCos;
+		float fBias = (BIAS_TEXELS + BIAS_SLOPE * fTan) / fScale;
+		return VecsDotProduct(v, vForward) <= vecDepth[y * nSize + x] + fBias ? 1.0f : 0.0f;
+	}
+
+	int Size() const {
+		return nSize;
+	}
+
+	// Changes every Render(), so lighting worked out from an older map can tell
+	unsigned int Version() const {
+		return nVersion;
+	}
+
+private:
+	static const int BAND_ROWS = 16;
+	static constexpr float BIAS_TEXELS = 1.0f, BIAS_SLOPE = 1.0f;
+
+	int nSize = 0;
+	Vec3D vRight, vUp, vForward; // Light space axes. vForward points away from the light
+	float fScale = 1.0f, fOffsetX = 0.0f, fOffsetY = 0.0f;
+	unsigned int nVersion = 0;
+	std::vector<Vec3D> vecVerts; // World space while gathering, map space after
+	std::vector<int> vecTris;
+	std::vector<float> vecDepth;
+	std::vector<std::vector<int>> vecBands; // Triangles overlapping each band
+
+	void AddVertex(const Vec3D& v, const Mat4x4& m) {
+		vecVerts.push_back({
+			v.x * m.m[0][0] + v.y * m.m[1][0] + v.z * m.m[2][0] + m.m[3][0],
+			v.x * m.m[0][1] + v.y * m.m[1][1] + v.z * m.m[2][1] + m.m[3][1],
+			v.x * m.m[0][2] + v.y * m.m[1][2] + v.z * m.m[2][2] + m.m[3][2] });
+	}
+
+	// Texel centres inside the triangle keep the nearest depth. Barycentric
+	// weights step across each row, and the triangle's winding doesn't matter
+	void RasterizeBand(int nBand) {
+		int yBand = nBand * BAND_ROWS, yBandEnd = (std::min)(yBand + BAND_ROWS, nSize);
+		for (int t : vecBands[nBand]) {
+			const Vec3D& a = vecVerts[vecTris[t]];
+			const Vec3D& b = vecVerts[vecTris[t + 1]];
+			const Vec3D& c = vecVerts[vecTris[t + 2]];
+			float fArea = (b.x - a.x) * (c.y - a.y) - (b.y - a.y) * (c.x - a.x);
+			if (fArea == 0.0f) {
+				continue;
+			}
+			float fInvArea = 1.0f / fArea;
+
+			int xStart = (std::max)(0, (int)floorf((std::min)(a.x, (std::min)(b.x, c.x))));
+			int xEnd = (std::min)(nSize - 1, (int)floorf((std::max)(a.x, (std::max)(b.x, c.x))));
+			int yStart = (std::max)(yBand, (int)floorf((std::min)(a.y, (std::min)(b.y, c.y))));
+			int yEnd = (std::min)(yBandEnd - 1, (int)floorf((std::max)(a.y, (std::max)(b.y, c.y))));
+
+			// Weight of a at p is the area of (p, b, c) over the whole, and so on
+			float dw0 = (b.y - c.y) * fInvArea, dw1 = (c.y - a.y) * fInvArea;
+			for (int y = yStart; y <= yEnd; y++) {
+				float px = xStart + 0.5f, py = y + 0.5f;
+				float w0 = ((b.x - px) * (c.y - py) - (b.y - py) * (c.x - px)) * fInvArea;
+				float w1 = ((c.x - px) * (a.y - py) - (c.y - py) * (a.x - px)) * fInvArea;
+				float* pDepth = &vecDepth[y * nSize];
+				for (int x = xStart; x <= xEnd; x++) {
+					float w2 = 1.0f - w0 - w1;
+					if (w0 >= 0.0f && w1 >= 0.0f && w2 >= 0.0f) {
+						float z = w0 * a.z + w1 * b.z + w2 * c.z;
+						pDepth[x] = (std::min)(pDepth[x], z);
+					}
+					w0 += dw0;
+					w1 += dw1;
+				}
+			}
+		}
+	}
+};
+
+// Deferred shading's input, one entry per screen cell: the depth of the nearest
+// surface, and its normal and material packed into 32 bits. Kept as two flat
+// arrays so the lighting pass streams through each of them a row at a time
+struct GBuffer {
+	int nWidth = 0, nHeight = 0;
+	std::vector<float> vecDepth; // 1/z in view space, so larger is nearer. 0 where nothing was drawn
+	std::vector<uint32_t> vecSurface; // See PackSurface(). 0 where nothing was drawn
+
+	void Resize(int w, int h) {
+		if (w != nWidth || h != nHeight) {
+			nWidth = w;
+			nHeight = h;
+			vecDepth.assign((size_t)w * h, 0.0f);
+			vecSurface.assign((size_t)w * h, 0);
+		}
+	}
+
+	// x2 and y2 exclusive
+	void Clear(int x1, int y1, int x2, int y2) {
+		for (int y = y1; y < y2; y++) {
+			std::fill(vecDepth.begin() + y * nWidth + x1, vecDepth.begin() + y * nWidth + x2, 0.0f);
+			std::fill(vecSurface.begin() + y * nWidth + x1, vecSurface.begin() + y * nWidth + x2, 0);
+		}
+	}
+
+	// The unit normal's x, y and z as signed bytes, then the material ID
+	static uint32_t PackSurface(const Vec3D& vNormal, int nMaterial) {
+		auto Pack = [](float f) { return (uint32_t)(uint8_t)(int8_t)floorf(f * 127.0f + 0.5f); };
+		return Pack(vNormal.x) | Pack(vNormal.y) << 8 | Pack(vNormal.z) << 16 | (uint32_t)nMaterial << 24;
+	}
+
+	static int Material(uint32_t nSurface) {
+		return (int)(nSurface >> 24);
+	}
+
+	static Vec3D Normal(uint32_t nSurface) {
+		return { (int8_t)nSurface / 127.0f, (int8_t)(nSurface >> 8) / 127.0f, (int8_t)(nSurface >> 16) / 127.0f, 0.0f };
+	}
+};
+
+// Writes a triangle's depth and surface into the G-buffer wherever it's nearer
+// than what's there. 1/z is linear across the screen, so it's a plane: fDepth
+// at the centre of cell (0, 0), changing by fDepthDx and fDepthDy per cell
+struct GBufferPipeline {
+	GBuffer* pGBuffer;
+	float fDepth, fDepthDx, fDepthDy;
+	uint32_t nSurface;
+
+	void BeginSpan(float u, float v, float w, const float dx[3], const float dy[3], int nLength) {}
+
+	bool operator()(int x, int y, float u, float v, float w) {
+		int nIndex = y * pGBuffer->nWidth + x;
+		float z = fDepth + fDepthDx * (float)x + fDepthDy * (float)y;
+		if (z <= pGBuffer->vecDepth[nIndex]) {
+			return false;
+		}
+		pGBuffer->vecDepth[nIndex] = z;
+		pGBuffer->vecSurface[nIndex] = nSurface;
+		return true;
+	}
+};
+
+// Picks the resolution of the 3D pass, in eighths of the screen's, to bring
+// the measured frame time to fTargetMs. Frame times are smoothed, and after a
+// change the controller waits for SETTLE_FRAMES frames at the new resolution
+// before judging again, so a single slow frame changes nothing. Going down,
+// it assumes the cost follows the number of cells and jumps straight to the
+// scale that should fit. Going up, it takes one step at a time, and only when
+// the next step should still fit with room to spare, so it doesn't oscillate
+class ResolutionController {
+public:
+	static constexpr int SCALE_MIN = 3;
+	static constexpr int SCALE_MAX = 8;
+
+	float fTargetMs = 8.0f;
+
+	// Back to full resolution, with nothing measured
+	void Reset() {
+		nScale = SCALE_MAX;
+		nSamples = 0;
+		fAverageMs = 0.0f;
+	}
+
+	// Take the time of a frame drawn at Scale(). Returns whether Scale() changed
+	bool Update(float fMs) {
+		// The first frame at a scale starts the average afresh
+		fAverageMs = nSamples == 0 ? fMs : fAverageMs + (fMs - fAverageMs) * SMOOTHING;
+		nSamples++;
+		if (nSamples < SETTLE_FRAMES) {
+			return false;
+		}
+
+		int nNewScale = nScale;
+		if (fAverageMs > fTargetMs * 1.1f) {
+			int nFits = (int)((float)nScale * sqrtf(fTargetMs / fAverageMs));
+			nNewScale = (std::max)(SCALE_MIN, (std::min)(nScale - 1, nFits));
+		}
+		else if (nScale < SCALE_MAX) {
+			float fGrowth = (float)(nScale + 1) / (float)nScale;
+			if (fAverageMs * fGrowth * fGrowth < fTargetMs * 0.85f) {
+				nNewScale = nScale + 1;
+			}
+		}
+		if (nNewScale == nScale) {
+			return false;
+		}
+		nScale = nNewScale;
+		nSamples = 0;
+		return true;
+	}
 
-struct Mat4x4 {
-	float m[4][4] = { 0 };
+	int Scale() const {
+		return nScale;
+	}
+
+	// Smoothed, over the frames since the last change
+	float AverageMs() const {
+		return fAverageMs;
+	}
+
+private:
+	static const int SETTLE_FRAMES = 8;
+	static constexpr float SMOOTHING = 0.2f;
+
+	int nScale = SCALE_MAX;
+	int nSamples = 0;
+	float fAverageMs = 0.0f;
 };
 
 class GraphicsEngine3D :public olcConsoleGameEngine {
 private:
 	Mesh meshObject;
-	Mat4x4 matProjection;
-	float fTheta;
+	float fTheta = 0.0f;
 	Vec3D vCamera;
 	Vec3D vLookDir;
-	float fYaw;
+	float fYaw = 0.0f;
+
+	// Object transforms live in the scene graph. The model's node is only set
+	// when fTheta changes, and a viewport's matrices only rebuilt when its
+	// camera moves. If nothing that decides the picture has changed, last
+	// frame's raster queues are reused, and the screen is left as it is
+	SceneGraph scene;
+	int nObjectNode;
+	bool bTransformValid = false;
+	float fTransformTheta = 0.0f;
+	std::vector<std::shared_ptr<TerrainChunk>> vecDrawnChunks;
+	bool bQueueValid = false;
+	bool bScreenValid = false;
+
+	// Viewports, all following the camera. V cycles the layout: the whole
+	// screen, split with a rear view, or the whole screen with a map in the corner
+	std::vector<Viewport> vecViewports;
+	int nViewLayout = 0;
+
+	olcJobSystem jobs;
+	std::vector<RasterQueue> vecChunkQueues;
+
+	// Visible triangles of uncached meshes in world space, for all viewports at once
+	std::vector<Triangle> vecDecodedTris;
+	std::vector<Vec3D> vecDecodedNormals;
+	std::vector<Vec3D> vecDecodedShading; // The normals they're lit with
+	std::vector<int> vecDecodeTris;
+	std::vector<char> vecDecodeMark;
+
+	// Wireframe drawn from the mesh's unique edges, toggled with E
+	bool bUniqueEdges = true;
+	std::vector<Vec3D> vecWorldVerts;
+	std::vector<Vec3D> vecViewVerts;
+	std::vector<char> vecFrontFacing;
+
+	// Streamed terrain instead of the model, toggled with T
+	bool bTerrain = false;
+	ProceduralTerrain terrainSource;
+	std::unique_ptr<TerrainStreamer> terrain;
+	std::vector<std::shared_ptr<TerrainChunk>> vecVisibleChunks;
+
+	// Overdraw heatmap instead of the scene, toggled with O. P saves it
+	bool bShowOverdraw = false;
+
+	// Rings of copies of the model instead of the one, toggled with G. Each
+	// ring turns about the whole, and the copies are children of their ring
+	bool bSceneDemo = false;
+	int nSceneRoot;
+	std::vector<int> vecSceneRings;
+	std::vector<int> vecSceneInstances;
+	float fSceneTime = 0.0f;
+
+	// Shadows from the light, toggled with H. J cycles the map's size and K how
+	// many frames a moving scene waits between redraws of the map
+	ShadowMap shadowMap;
+	bool bShadows = false;
+	int nShadowSize = 512;
+	int nShadowInterval = 1;
+	int nShadowAge = 0;
+	bool bShadowDirty = true;
+
+	// Deferred shading, toggled with L. Triangles only fill the G-buffer, with
+	// no lighting, and then each cell on screen is lit once, whatever the
+	// depth of the scene behind it. That's cheap enough to look up shadows
+	// per cell rather than per triangle
+	bool bDeferred = false;
+	GBuffer gbuffer;
+
+	// What the lighting pass does with each material ID: light below fAmbient
+	// is raised to it, and fDiffuse scales the rest. Both match LightTriangle()
+	struct MaterialLighting {
+		float fAmbient;
+		float fDiffuse;
+	};
+	MaterialLighting materials[MATERIAL_COUNT] = { { 0.0f, 0.0f }, { 0.1f, 1.0f }, { 0.1f, 1.0f } };
+
+	// Adaptive resolution, toggled with R. The 3D pass renders into sprRender
+	// at the controller's resolution, and is stretched over the screen. Its
+	// decisions are appended to resolution.log
+	bool bAdaptiveResolution = false;
+	ResolutionController resolution;
+	olcSprite sprRender;
+	int nFrame = 0;
 
 	CHAR_INFO GetColour(float luminance) {
 		short bgColour, fgColour;
@@ -108,52 +1793,6 @@ private:
 		return c;
 	}
 
-	Vec3D VecsAdd(Vec3D& v1, Vec3D& v2) {
-		return { v1.x + v2.x, v1.y + v2.y, v1.z + v2.z };
-	}
-	Vec3D VecsSubtract(Vec3D& v1, Vec3D& v2) {
-		return { v1.x - v2.x, v1.y - v2.y, v1.z - v2.z };
-	}
-	Vec3D VecsMultiply(Vec3D& v, float k) {
-		return{ v.x * k, v.y * k, v.z * k };
-	}
-	Vec3D VecsDivide(Vec3D& v, float k) {
-		return{ v.x / k, v.y / k, v.z / k };
-	}
-
-	float VecsDotProduct(Vec3D& v1, Vec3D& v2) {
-		return v1.x * v2.x + v1.y * v2.y + v1.z * v2.z;
-	}
-	float VecLength(Vec3D& v) {
-		return sqrtf(VecsDotProduct(v, v));
-	}
-
-	Vec3D VecNormalise(Vec3D& v) {
-		float l = VecLength(v);
-		return { v.x / l, v.y / l, v.z / l };
-	}
-	Vec3D VecsCrossProduct(Vec3D& v1, Vec3D& v2) {
-		Vec3D v;
-		v.x = v1.y * v2.z - v1.z * v2.y;
-		v.y = v1.z * v2.x - v1.x * v2.z;
-		v.z = v1.x * v2.y - v1.y * v2.x;
-		return v;
-	}
-
-	Vec3D VecIntersectPlane(Vec3D& vPlanePoint, Vec3D& vPlaneNormal, Vec3D& vLineStart, Vec3D& vLineEnd, float& t) {
-		vPlaneNormal = VecNormalise(vPlaneNormal);
-
-		// Vector notation of line-plane intersection
-		Vec3D v = VecsSubtract(vPlanePoint, vLineStart);
-		float n = VecsDotProduct(v, vPlaneNormal);
-		Vec3D vLine = VecsSubtract(vLineEnd, vLineStart);
-		float d = VecsDotProduct(vLine, vPlaneNormal);
-		t = n / d; // Normalised distance along the line between two points where the intersection happened
-		Vec3D vLineToIntersect = VecsMultiply(vLine, t);
-
-		return VecsAdd(vLineStart, vLineToIntersect);
-	}
-
 	int TriangleClipAgainstPlane(Vec3D vPlanePoint, Vec3D vPlaneNormal, Triangle& triIn, Triangle& triOut1, Triangle& triOut2) {
 		vPlaneNormal = VecNormalise(vPlaneNormal);
 
@@ -258,124 +1897,10 @@ private:
 		}
 	}
 
-	Mat4x4 MatMakeIdentity() {
-		Mat4x4 matrix;
-		matrix.m[0][0] = 1.0f;
-		matrix.m[1][1] = 1.0f;
-		matrix.m[2][2] = 1.0f;
-		matrix.m[3][3] = 1.0f;
-		return matrix;
-	}
-	Mat4x4 MatMakeRotationX(float fAngleRad) {
-		Mat4x4 matrix;
-		matrix.m[0][0] = 1.0f;
-		matrix.m[1][1] = cosf(fAngleRad);
-		matrix.m[1][2] = sinf(fAngleRad);
-		matrix.m[2][1] = -sinf(fAngleRad);
-		matrix.m[2][2] = cosf(fAngleRad);
-		matrix.m[3][3] = 1.0f;
-		return matrix;
-	}
-	Mat4x4 MatMakeRotationY(float fAngleRad) {
-		Mat4x4 matrix;
-		matrix.m[0][0] = cosf(fAngleRad);
-		matrix.m[0][2] = sinf(fAngleRad);
-		matrix.m[2][0] = -sinf(fAngleRad);
-		matrix.m[1][1] = 1.0f;
-		matrix.m[2][2] = cosf(fAngleRad);
-		matrix.m[3][3] = 1.0f;
-		return matrix;
-	}
-	Mat4x4 MatMakeRotationZ(float fAngleRad) {
-		Mat4x4 matrix;
-		matrix.m[0][0] = cosf(fAngleRad);
-		matrix.m[0][1] = sinf(fAngleRad);
-		matrix.m[1][0] = -sinf(fAngleRad);
-		matrix.m[1][1] = cosf(fAngleRad);
-		matrix.m[2][2] = 1.0f;
-		matrix.m[3][3] = 1.0f;
-		return matrix;
-	}
-	Mat4x4 MatMakeProjection(float fFOVDeg, float fAspectRatio, float fNear, float fFar) {
-		float fFOVRad = 1.0f / tanf(fFOVDeg * 0.5f / 180.0f * 3.1415926f);
-		Mat4x4 matrix;
-		matrix.m[0][0] = fAspectRatio * fFOVRad;
-		matrix.m[1][1] = fFOVRad;
-		matrix.m[2][2] = fFar / (fFar - fNear);
-		matrix.m[3][2] = (-fFar * fNear) / (fFar - fNear);
-		matrix.m[2][3] = -1.0f;
-		matrix.m[3][3] = 0.0f;
-		return matrix;
-	}
-	Mat4x4 MatMakeTranslation(float x, float y, float z) {
-		Mat4x4 matrix;
-		matrix.m[0][0] = 1.0f;
-		matrix.m[1][1] = 1.0f;
-		matrix.m[2][2] = 1.0f;
-		matrix.m[3][3] = 1.0f;
-		matrix.m[3][0] = x;
-		matrix.m[3][1] = y;
-		matrix.m[3][2] = z;
-		return matrix;
-	}
-
-	Vec3D MultiplyMatVec(Mat4x4& m, Vec3D& vi) {
-		Vec3D vo;
-		vo.x = vi.x * m.m[0][0] + vi.y * m.m[1][0] + vi.z * m.m[2][0] + vi.w * m.m[3][0];
-		vo.y = vi.x * m.m[0][1] + vi.y * m.m[1][1] + vi.z * m.m[2][1] + vi.w * m.m[3][1];
-		vo.z = vi.x * m.m[0][2] + vi.y * m.m[1][2] + vi.z * m.m[2][2] + vi.w * m.m[3][2];
-		vo.w = vi.x * m.m[0][3] + vi.y * m.m[1][3] + vi.z * m.m[2][3] + vi.w * m.m[3][3];
-		return vo;
-	}
-	Mat4x4 MultiplyMatMat(Mat4x4& m1, Mat4x4& m2) {
-		Mat4x4 matrix;
-		for (int c = 0; c < 4; c++) {
-			for (int r = 0; r < 4; r++) {
-				matrix.m[r][c] = m1.m[r][0] * m2.m[0][c] + m1.m[r][1] * m2.m[1][c] + m1.m[r][2] * m2.m[2][c] + m1.m[r][3] * m2.m[3][c];
-			}
-		}
-		return matrix;
-	}
-
-	Mat4x4 MatPointAt(Vec3D& vPos, Vec3D& vTarget, Vec3D& vUp) {
-		// Calculate new forward direction
-		Vec3D vNewForward = VecsSubtract(vTarget, vPos);
-		vNewForward = VecNormalise(vNewForward);
-
-		// Create new up direction
-		// Calculate original up vector projected on new forward vector
-		Vec3D v = VecsMultiply(vNewForward, VecsDotProduct(vUp, vNewForward));
-		Vec3D vNewUp = VecsSubtract(vUp, v);
-		vNewUp = VecNormalise(vNewUp);
-
-		// Create new right direction
-		Vec3D vNewRight = VecsCrossProduct(vNewUp, vNewForward);
-		//vNewRight = VecNormalise(vNewRight);
-
-		// Construct dimensioning and translation matrix
-		Mat4x4 matrix;
-		matrix.m[0][0] = vNewRight.x;	  matrix.m[0][1] = vNewRight.y;	  matrix.m[0][2] = vNewRight.z;	  matrix.m[0][3] = 0.0f;
-		matrix.m[1][0] = vNewUp.x;		  matrix.m[1][1] = vNewUp.y;		  matrix.m[1][2] = vNewUp.z;		  matrix.m[1][3] = 0.0f;
-		matrix.m[2][0] = vNewForward.x;	matrix.m[2][1] = vNewForward.y;	matrix.m[2][2] = vNewForward.z;	matrix.m[2][3] = 0.0f;
-		matrix.m[3][0] = vPos.x;			  matrix.m[3][1] = vPos.y;			  matrix.m[3][2] = vPos.z;			  matrix.m[3][3] = 1.0f;
-		return matrix;
-	}
-	// We can get the "LookAt" matrix by inverting the "PointAt" matrix (only for rotation/translation matrices)
-	Mat4x4 MatQuickInverse(Mat4x4& m) {
-		Mat4x4 matrix;
-		matrix.m[0][0] = m.m[0][0]; matrix.m[0][1] = m.m[1][0]; matrix.m[0][2] = m.m[2][0]; matrix.m[0][3] = 0.0f;
-		matrix.m[1][0] = m.m[0][1]; matrix.m[1][1] = m.m[1][1]; matrix.m[1][2] = m.m[2][1]; matrix.m[1][3] = 0.0f;
-		matrix.m[2][0] = m.m[0][2]; matrix.m[2][1] = m.m[1][2]; matrix.m[2][2] = m.m[2][2]; matrix.m[2][3] = 0.0f;
-		matrix.m[3][0] = -(m.m[3][0] * matrix.m[0][0] + m.m[3][1] * matrix.m[1][0] + m.m[3][2] * matrix.m[2][0]);
-		matrix.m[3][1] = -(m.m[3][0] * matrix.m[0][1] + m.m[3][1] * matrix.m[1][1] + m.m[3][2] * matrix.m[2][1]);
-		matrix.m[3][2] = -(m.m[3][0] * matrix.m[0][2] + m.m[3][1] * matrix.m[1][2] + m.m[3][2] * matrix.m[2][2]);
-		matrix.m[3][3] = 1.0f;
-		return matrix;
-	}
-
 public:
 	GraphicsEngine3D() {
 		m_sAppName = L"3D Graphics Engine";
+		EnableDirectDraw();
 	};
 
 public:
@@ -407,13 +1932,732 @@ public:
 			{ 1.0f, 0.0f, 1.0f, 1.0f,    0.0f, 0.0f, 0.0f, 1.0f,    1.0f, 0.0f, 0.0f, 1.0f,    0.0f, 1.0f,    1.0f, 0.0f,    1.0f, 1.0f },
 		};
 
-		// Projection matrix
-		matProjection = MatMakeProjection(90.0f, (float)ScreenHeight() / (float)ScreenWidth(), 0.1f, 1000.0f);
+		meshObject.BuildEdges();
+		meshObject.BuildBVH(&jobs);
+
+		nObjectNode = scene.AddNode(-1, MatMakeIdentity());
+		BuildSceneDemo();
+
+		terrain.reset(new TerrainStreamer(&terrainSource));
+
+		return true;
+	}
+
+	// Point a viewport's camera and place it on the screen, rebuilding its view
+	// and projection matrices if either changed. Returns whether they did
+	bool UpdateViewport(Viewport& view, int x, int y, int w, int h, Vec3D& vEye, Vec3D& vTarget, Vec3D& vUp) {
+		if (view.x == x && view.y == y && view.w == w && view.h == h &&
+			std::memcmp(&view.vCamera, &vEye, sizeof(Vec3D)) == 0 &&
+			std::memcmp(&view.vTarget, &vTarget, sizeof(Vec3D)) == 0 &&
+			std::memcmp(&view.vUp, &vUp, sizeof(Vec3D)) == 0) {
+			return false;
+		}
+
+		view.x = x;
+		view.y = y;
+		view.w = w;
+		view.h = h;
+		view.vCamera = vEye;
+		view.vTarget = vTarget;
+		view.vUp = vUp;
+		// Make view matrix from camera
+		view.matCamera = MatPointAt(vEye, vTarget, vUp);
+		view.matView = MatQuickInverse(view.matCamera);
+		view.matProjection = MatMakeProjection(90.0f, (float)h / (float)w, 0.1f, 1000.0f);
+		return true;
+	}
+
+	// Lay out vecViewports for nViewLayout, over a render of nWidth x nHeight.
+	// Returns whether any of them changed
+	bool LayoutViewports(int nWidth, int nHeight) {
+		Vec3D vUp = { 0,1,0 };
+		Vec3D vTarget = VecsAdd(vCamera, vLookDir);
+
+		bool bChanged = false;
+		size_t nViews = nViewLayout == 0 ? 1 : 2;
+		if (vecViewports.size() != nViews) {
+			vecViewports.resize(nViews);
+			bChanged = true;
+		}
+
+		bChanged |= UpdateViewport(vecViewports[0], 0, 0, nViewLayout == 1 ? nWidth / 2 : nWidth, nHeight, vCamera, vTarget, vUp);
+		if (nViewLayout == 1) {
+			// Looking back the way we came
+			Vec3D vBehind = VecsSubtract(vCamera, vLookDir);
+			bChanged |= UpdateViewport(vecViewports[1], nWidth / 2, 0, nWidth - nWidth / 2, nHeight, vCamera, vBehind, vUp);
+		}
+		else if (nViewLayout == 2) {
+			// Looking straight down from above, forward at the top
+			Vec3D vHeight = { 0.0f, 40.0f, 0.0f };
+			Vec3D vAbove = VecsAdd(vCamera, vHeight);
+			bChanged |= UpdateViewport(vecViewports[1], nWidth - nWidth / 3, 0, nWidth / 3, nHeight / 3, vAbove, vCamera, vLookDir);
+		}
+		return bChanged;
+	}
+
+	// Outline the viewports drawn over the first
+	void DrawViewportFrames() {
+		for (size_t i = 1; i < vecViewports.size(); i++) {
+			Viewport& view = vecViewports[i];
+			int x1 = view.x, y1 = view.y, x2 = view.x + view.w - 1, y2 = view.y + view.h - 1;
+			DrawLine(x1, y1, x2, y1, PIXEL_SOLID, FG_DARK_GREY);
+			DrawLine(x1, y2, x2, y2, PIXEL_SOLID, FG_DARK_GREY);
+			DrawLine(x1, y1, x1, y2, PIXEL_SOLID, FG_DARK_GREY);
+			DrawLine(x2, y1, x2, y2, PIXEL_SOLID, FG_DARK_GREY);
+		}
+	}
+
+	// Model space to world space, and the face normal there
+	void TransformTriangle(Triangle& tri, Mat4x4& matTransformation, Triangle& triTransformed, Vec3D& normal) {
+		// Transformation (rotation + translation)
+		triTransformed.t[0] = MultiplyMatVec(matTransformation, tri.t[0]);
+		triTransformed.t[1] = MultiplyMatVec(matTransformation, tri.t[1]);
+		triTransformed.t[2] = MultiplyMatVec(matTransformation, tri.t[2]);
+		// Copy texture
+		triTransformed.tx[0] = tri.tx[0];
+		triTransformed.tx[1] = tri.tx[1];
+		triTransformed.tx[2] = tri.tx[2];
+
+		// Calculate cross products
+		Vec3D line1, line2;
+
+		line1 = VecsSubtract(triTransformed.t[1], triTransformed.t[0]);
+		line2 = VecsSubtract(triTransformed.t[2], triTransformed.t[0]);
+
+		normal = VecsCrossProduct(line1, line2);
+		normal = VecNormalise(normal);
+	}
+
+	Vec3D LightDirection() {
+		Vec3D lightDirection = { 0.0f, 1.0f, -1.0f }; // single direction light
+		return VecNormalise(lightDirection);
+	}
+
+	void LightTriangle(Triangle& triTransformed, Vec3D vShading) {
+		// Illumination
+		Vec3D lightDirection = LightDirection();
+
+		// How "aligned" are light direction and triangle surface normal?
+		float dp = max(0.1f, VecsDotProduct(lightDirection, vShading));
+
+		// Shading is per triangle, so shadows are too: the share of a few points
+		// across the triangle that the light reaches scales all but the ambient.
+		// Deferred shading looks them up per cell instead
+		if (bShadows && !bDeferred && dp > 0.1f) {
+			Vec3D vCentre = VecsAdd(triTransformed.t[0], triTransformed.t[1]);
+			vCentre = VecsAdd(vCentre, triTransformed.t[2]);
+			vCentre = VecsDivide(vCentre, 3.0f);
+			float fLit = shadowMap.Lit(vCentre, vShading);
+			for (int c = 0; c < 3; c++) {
+				Vec3D vToCorner = VecsSubtract(triTransformed.t[c], vCentre);
+				vToCorner = VecsMultiply(vToCorner, 0.5f);
+				Vec3D vSample = VecsAdd(vCentre, vToCorner);
+				fLit += shadowMap.Lit(vSample, vShading);
+			}
+			dp = 0.1f + (dp - 0.1f) * fLit * 0.25f;
+		}
+		// Extract colour and shading of grey combination (very console-specific!)
+		CHAR_INFO colourShading = GetColour(dp);
+		triTransformed.colour = colourShading.Attributes;
+		triTransformed.symbol = colourShading.Char.UnicodeChar;
+	}
+
+	// The camera dependent half: a lit world space triangle to the viewport's
+	// view space, clipped against the near plane, projected and queued. Only
+	// reads shared state, so chunks of the mesh can run on different threads
+	void ProjectWorldTriangle(Triangle& triTransformed, uint32_t nSurface, Viewport& view, RasterQueue& queueOut) {
+		Triangle triProjected, triViewed;
+
+		// Convert world space to view space before projection
+		triViewed.t[0] = MultiplyMatVec(view.matView, triTransformed.t[0]);
+		triViewed.t[1] = MultiplyMatVec(view.matView, triTransformed.t[1]);
+		triViewed.t[2] = MultiplyMatVec(view.matView, triTransformed.t[2]);
+		triViewed.colour = triTransformed.colour;
+		triViewed.symbol = triTransformed.symbol;
+		// Copy texture
+		triViewed.tx[0] = triTransformed.tx[0];
+		triViewed.tx[1] = triTransformed.tx[1];
+		triViewed.tx[2] = triTransformed.tx[2];
+
+		// Clip viewed triangle against near plane -> this forms 2 additional triangles
+		int nClippedTriangles = 0;
+		Triangle triClipped[2];
+		nClippedTriangles = TriangleClipAgainstPlane({ 0.0f, 0.0f, 0.1f }, { 0.0f, 0.0f, 1.0f }, triViewed, triClipped[0], triClipped[1]);
+
+		for (int n = 0; n < nClippedTriangles; n++) {
+			// Projection
+			triProjected.t[0] = MultiplyMatVec(view.matProjection, triClipped[n].t[0]);
+			triProjected.t[1] = MultiplyMatVec(view.matProjection, triClipped[n].t[1]);
+			triProjected.t[2] = MultiplyMatVec(view.matProjection, triClipped[n].t[2]);
+			triProjected.colour = triClipped[n].colour;
+			triProjected.symbol = triClipped[n].symbol;
+			triProjected.tx[0] = triClipped[n].tx[0];
+			triProjected.tx[1] = triClipped[n].tx[1];
+			triProjected.tx[2] = triClipped[n].tx[2];
+
+			// Scaling to view
+			triProjected.t[0] = VecsDivide(triProjected.t[0], triProjected.t[0].w);
+			triProjected.t[1] = VecsDivide(triProjected.t[1], triProjected.t[1].w);
+			triProjected.t[2] = VecsDivide(triProjected.t[2], triProjected.t[2].w);
+
+			//// X/Y are inverted so put them back
+			//triProjected.t[0].x *= -1.0f;
+			//triProjected.t[0].y *= -1.0f;
+			//triProjected.t[1].x *= -1.0f;
+			//triProjected.t[1].y *= -1.0f;
+			//triProjected.t[2].x *= -1.0f;
+			//triProjected.t[2].y *= -1.0f;
+
+			// Offset vertices to visible normalised view
+			Vec3D vOffsetView = { 1,1,0 };
+			triProjected.t[0] = VecsAdd(triProjected.t[0], vOffsetView);
+			triProjected.t[1] = VecsAdd(triProjected.t[1], vOffsetView);
+			triProjected.t[2] = VecsAdd(triProjected.t[2], vOffsetView);
+
+			// Scaling, and moving into the viewport
+			float fScaleX = 0.5f * (float)view.w, fScaleY = 0.5f * (float)view.h;
+			for (int i = 0; i < 3; i++) {
+				triProjected.t[i].x = triProjected.t[i].x * fScaleX + (float)view.x;
+				triProjected.t[i].y = triProjected.t[i].y * fScaleY + (float)view.y;
+			}
+
+			// Every piece sorts by the depth of the whole triangle
+			float fDepth = (triProjected.t[0].z + triProjected.t[1].z + triProjected.t[2].z) / 3.0f;
+
+			// After that z is only needed for the G-buffer, which takes 1/z in
+			// view space. It's linear across the screen, so clipping there keeps it
+			for (int i = 0; i < 3; i++) {
+				triProjected.t[i].z = 1.0f / triClipped[n].t[i].z;
+			}
+			ClipToGuardBand(triProjected, fDepth, nSurface, view, queueOut);
+		}
+	}
+
+	// Queue a projected triangle. The rasterizer clips to the viewport itself,
+	// exactly, so only triangles reaching so far outside it that their fixed
+	// point coordinates could overflow are clipped here, at a guard band whose
+	// edges are never seen
+	void ClipToGuardBand(Triangle& tri, float fDepth, uint32_t nSurface, Viewport& view, RasterQueue& queueOut) {
+		const float fGuardBand = 4096.0f;
+		float fLeft = (float)view.x - fGuardBand, fTop = (float)view.y - fGuardBand;
+		float fRight = (float)(view.x + view.w) + fGuardBand, fBottom = (float)(view.y + view.h) + fGuardBand;
+		bool bInside = true;
+		for (int i = 0; i < 3; i++) {
+			bInside = bInside && tri.t[i].x >= fLeft && tri.t[i].x <= fRight && tri.t[i].y >= fTop && tri.t[i].y <= fBottom;
+		}
+		if (bInside) {
+			queueOut.Push(tri, fDepth, nSurface);
+			return;
+		}
+
+		// Each plane at most doubles the pieces, so 16 is enough for all 4
+		Triangle triPieces[2][16];
+		int nPieces = 1;
+		triPieces[0][0] = tri;
+		for (int p = 0; p < 4; p++) {
+			Triangle* triIn = triPieces[p & 1];
+			Triangle* triOut = triPieces[(p + 1) & 1];
+			int nOut = 0;
+			for (int n = 0; n < nPieces; n++) {
+				// All triangles after a plane clip are guaranteed to lie on the inside of the plane
+				switch (p) {
+				case 0:
+					nOut += TriangleClipAgainstPlane({ 0.0f, fTop, 0.0f }, { 0.0f, 1.0f, 0.0f }, triIn[n], triOut[nOut], triOut[nOut + 1]);
+					break;
+				case 1:
+					nOut += TriangleClipAgainstPlane({ 0.0f, fBottom, 0.0f }, { 0.0f, -1.0f, 0.0f }, triIn[n], triOut[nOut], triOut[nOut + 1]);
+					break;
+				case 2:
+					nOut += TriangleClipAgainstPlane({ fLeft, 0.0f, 0.0f }, { 1.0f, 0.0f, 0.0f }, triIn[n], triOut[nOut], triOut[nOut + 1]);
+					break;
+				case 3:
+					nOut += TriangleClipAgainstPlane({ fRight, 0.0f, 0.0f }, { -1.0f, 0.0f, 0.0f }, triIn[n], triOut[nOut], triOut[nOut + 1]);
+					break;
+				}
+			}
+			nPieces = nOut;
+		}
+
+		for (int n = 0; n < nPieces; n++) {
+			queueOut.Push(triPieces[0][n], fDepth, nSurface);
+		}
+	}
+
+	// A viewport's frustum in a mesh's own space, for BVH queries. In view space
+	// a point is on screen when |x| * m[0][0] <= z and |y| * m[1][1] <= z, and
+	// it's between the clip planes. Planes move to model space through the
+	// model-to-view matrix
+	Frustum MakeFrustum(Mat4x4& matTransformation, Viewport& view, float fNear = 0.1f, float fFar = 1000.0f) {
+		float sx = view.matProjection.m[0][0], sy = view.matProjection.m[1][1];
+		float planes[6][4] = {
+			{ sx, 0.0f, 1.0f, 0.0f }, { -sx, 0.0f, 1.0f, 0.0f },
+			{ 0.0f, sy, 1.0f, 0.0f }, { 0.0f, -sy, 1.0f, 0.0f },
+			{ 0.0f, 0.0f, 1.0f, -fNear }, { 0.0f, 0.0f, -1.0f, fFar },
+		};
+
+		Mat4x4 matModelView = MultiplyMatMat(matTransformation, view.matView);
+		Frustum frustum;
+		for (int p = 0; p < 6; p++) {
+			for (int i = 0; i < 4; i++) {
+				frustum.planes[p][i] = matModelView.m[i][0] * planes[p][0] + matModelView.m[i][1] * planes[p][1] +
+					matModelView.m[i][2] * planes[p][2] + matModelView.m[i][3] * planes[p][3];
+			}
+		}
+		return frustum;
+	}
+
+	// Rebuild mesh.world unless it was built with this transform. Quantized
+	// meshes have no cache; they're decoded and transformed as they're drawn
+	void UpdateWorldCache(Mesh& mesh, Mat4x4& matTransformation) {
+		WorldCache& world = mesh.world;
+		unsigned int nShadowVersion = bShadows && !bDeferred ? shadowMap.Version() : 0;
+		if (world.bValid && std::memcmp(world.matTransformation.m, matTransformation.m, sizeof(matTransformation.m)) == 0) {
+			if (world.nShadowVersion == nShadowVersion) {
+				return;
+			}
+			// Only the light has changed
+			jobs.ParallelFor(mesh.tris.size(), 4096, [&](size_t nChunk, size_t nBegin, size_t nEnd) {
+				for (size_t i = nBegin; i < nEnd; i++) {
+					LightTriangle(world.tris[i], world.normals[i]);
+				}
+			});
+			world.nShadowVersion = nShadowVersion;
+			return;
+		}
+
+		world.tris.resize(mesh.tris.size());
+		world.normals.resize(mesh.tris.size());
+		jobs.ParallelFor(mesh.tris.size(), 4096, [&](size_t nChunk, size_t nBegin, size_t nEnd) {
+			for (size_t i = nBegin; i < nEnd; i++) {
+				TransformTriangle(mesh.tris[i], matTransformation, world.tris[i], world.normals[i]);
+				LightTriangle(world.tris[i], world.normals[i]);
+			}
+		});
+		world.verts.resize(mesh.verts.size());
+		jobs.ParallelFor(mesh.verts.size(), 4096, [&](size_t nChunk, size_t nBegin, size_t nEnd) {
+			for (size_t i = nBegin; i < nEnd; i++) {
+				world.verts[i] = MultiplyMatVec(matTransformation, mesh.verts[i]);
+			}
+		});
+		world.matTransformation = matTransformation;
+		world.nShadowVersion = nShadowVersion;
+		world.bValid = true;
+	}
+
+	// Everything that is drawn casts shadows, whatever the viewports can see.
+	// The casters' welded vertices are enough, and terrain chunks give their
+	// quantized ones, which are what's drawn
+	void RenderShadowMap() {
+		shadowMap.Begin(nShadowSize, LightDirection());
+		Mat4x4 matIdentity = MatMakeIdentity();
+		if (bTerrain) {
+			for (auto& chunk : vecVisibleChunks) {
+				shadowMap.AddMesh(chunk->mesh.quantized, matIdentity);
+			}
+		}
+		else if (bSceneDemo) {
+			for (int nNode : vecSceneInstances) {
+				shadowMap.AddMesh(meshObject.verts, meshObject.triVerts, scene.World(nNode));
+			}
+		}
+		else {
+			shadowMap.AddMesh(meshObject.verts, meshObject.triVerts, scene.World(nObjectNode));
+		}
+		shadowMap.Render(jobs);
+	}
+
+	// Fill the viewport's part of the G-buffer from its queue, which needn't be
+	// sorted. Nothing is lit here, so overdraw only costs depth tests
+	void DrawGBuffer(Viewport& view) {
+		gbuffer.Resize(ScreenWidth(), ScreenHeight());
+		gbuffer.Clear(view.x, view.y, view.x + view.w, view.y + view.h);
+		const float fOne = (float)(1 << SUBPIXEL_BITS);
+		for (auto& tri : view.queue.tris) {
+			ScreenTriangleAttributes& attributes = view.queue.attributes[tri.nAttributes];
+
+			// The plane through the corners, with x and y in cells
+			float x0 = (float)tri.x[0] / fOne, y0 = (float)tri.y[0] / fOne;
+			float dx1 = (float)(tri.x[1] - tri.x[0]) / fOne, dy1 = (float)(tri.y[1] - tri.y[0]) / fOne;
+			float dx2 = (float)(tri.x[2] - tri.x[0]) / fOne, dy2 = (float)(tri.y[2] - tri.y[0]) / fOne;
+			float fArea = dx1 * dy2 - dx2 * dy1;
+			if (fArea == 0.0f) {
+				continue;
+			}
+			float dw1 = attributes.w[1] - attributes.w[0], dw2 = attributes.w[2] - attributes.w[0];
+
+			GBufferPipeline pipeline;
+			pipeline.pGBuffer = &gbuffer;
+			pipeline.fDepthDx = (dw1 * dy2 - dw2 * dy1) / fArea;
+			pipeline.fDepthDy = (dx1 * dw2 - dx2 * dw1) / fArea;
+			pipeline.fDepth = attributes.w[0] + (0.5f - x0) * pipeline.fDepthDx + (0.5f - y0) * pipeline.fDepthDy;
+			pipeline.nSurface = attributes.nSurface;
+			FillTriangleSubpixel(tri.x[0], tri.y[0], tri.x[1], tri.y[1], tri.x[2], tri.y[2], pipeline);
+		}
+	}
+
+	// Light each of the viewport's cells once, from the G-buffer, a band of rows
+	// per job. Each row is first unpacked into flat arrays - how squarely each
+	// cell faces the light, and where it is in the world - by loops with no
+	// branches, which the compiler vectorizes. Only then are the cells built,
+	// one at a time
+	void LightGBuffer(Viewport& view) {
+		Vec3D vLight = LightDirection();
+		CHAR_INFO cellEmpty;
+		cellEmpty.Char.UnicodeChar = PIXEL_SOLID;
+		cellEmpty.Attributes = FG_BLACK;
+
+		// A cell's centre back to view space. The projection's w is -z, so
+		// x = -x_ndc * z / m[0][0], and likewise y
+		float fNdcX = 2.0f / (float)view.w, fNdcY = 2.0f / (float)view.h;
+		float fViewX = -1.0f / view.matProjection.m[0][0], fViewY = -1.0f / view.matProjection.m[1][1];
+
+		jobs.ParallelFor(view.h, 16, [&](size_t nChunk, size_t nBegin, size_t nEnd) {
+			// Local copies, which the row arrays can't alias
+			Mat4x4 m = view.matCamera;
+			Vec3D vL = vLight;
+			int nWidth = view.w;
+			std::vector<float> vecLight(view.w), vecX(view.w), vecY(view.w), vecZ(view.w);
+			for (size_t r = nBegin; r < nEnd; r++) {
+				int y = view.y + (int)r;
+				const float* pDepth = &gbuffer.vecDepth[y * gbuffer.nWidth + view.x];
+				const uint32_t* pSurface = &gbuffer.vecSurface[y * gbuffer.nWidth + view.x];
+
+				for (int i = 0; i < view.w; i++) {
+					float nx = (float)(int8_t)pSurface[i], ny = (float)(int8_t)(pSurface[i] >> 8), nz = (float)(int8_t)(pSurface[i] >> 16);
+					vecLight[i] = (nx * vL.x + ny * vL.y + nz * vL.z) * (1.0f / 127.0f);
+				}
+
+				if (bShadows) {
+					float fRowY = (((float)r + 0.5f) * fNdcY - 1.0f) * fViewY;
+					float* pX = vecX.data();
+					float* pY = vecY.data();
+					float* pZ = vecZ.data();
+					for (int i = 0; i < nWidth; i++) {
+						// Empty cells, with 0 depth, come out infinite, and are never read
+						float z = 1.0f / pDepth[i];
+						float xv = (((float)i + 0.5f) * fNdcX - 1.0f) * fViewX * z;
+						float yv = fRowY * z;
+						pX[i] = xv * m.m[0][0] + yv * m.m[1][0] + z * m.m[2][0] + m.m[3][0];
+						pY[i] = xv * m.m[0][1] + yv * m.m[1][1] + z * m.m[2][1] + m.m[3][1];
+						pZ[i] = xv * m.m[0][2] + yv * m.m[1][2] + z * m.m[2][2] + m.m[3][2];
+					}
+				}
+
+				CHAR_INFO* pCells = m_bufScreen + y * ScreenWidth() + view.x;
+				for (int i = 0; i < view.w; i++) {
+					int nMaterial = GBuffer::Material(pSurface[i]);
+					if (nMaterial == MATERIAL_NONE) {
+						pCells[i] = cellEmpty;
+						continue;
+					}
+					const MaterialLighting& material = materials[nMaterial];
+					float dp = (std::max)(material.fAmbient, material.fDiffuse * vecLight[i]);
+					if (bShadows && dp > material.fAmbient) {
+						Vec3D vPoint = { vecX[i], vecY[i], vecZ[i] };
+						dp = material.fAmbient + (dp - material.fAmbient) * shadowMap.Lit(vPoint, GBuffer::Normal(pSurface[i]));
+					}
+					pCells[i] = GetColour(dp);
+				}
+			}
+		});
+	}
+
+	// Without the world space cache, the triangles any viewport can see are
+	// transformed into a scratch one, each once however many viewports see it.
+	// Quantized meshes are decoded on the way: the dequantizing scale and
+	// offset go in front of the transform, and the stored vertex normals give
+	// smooth shading
+	void TransformVisibleTriangles(Mesh& mesh, Mat4x4& matTransformation, std::vector<Viewport>& views) {
+		QuantizedMesh& q = mesh.quantized;
+		Mat4x4 matDecode = MatMakeTranslation(q.vOrigin.x, q.vOrigin.y, q.vOrigin.z);
+		matDecode.m[0][0] = q.vScale.x;
+		matDecode.m[1][1] = q.vScale.y;
+		matDecode.m[2][2] = q.vScale.z;
+		Mat4x4 matDecodeTransformation = MultiplyMatMat(matDecode, matTransformation);
+
+		std::vector<int>* pDecode = &views[0].vecVisibleTris;
+		if (views.size() > 1) {
+			vecDecodeMark.assign(mesh.TriangleCount(), 0);
+			vecDecodeTris.clear();
+			for (auto& view : views) {
+				for (int i : view.vecVisibleTris) {
+					if (!vecDecodeMark[i]) {
+						vecDecodeMark[i] = 1;
+						vecDecodeTris.push_back(i);
+					}
+				}
+			}
+			pDecode = &vecDecodeTris;
+		}
+
+		vecDecodedTris.resize(mesh.TriangleCount());
+		vecDecodedNormals.resize(mesh.TriangleCount());
+		vecDecodedShading.resize(mesh.TriangleCount());
+		jobs.ParallelFor(pDecode->size(), 1024, [&](size_t nChunk, size_t nBegin, size_t nEnd) {
+			for (size_t i = nBegin; i < nEnd; i++) {
+				int n = (*pDecode)[i];
+				if (!mesh.tris.empty()) {
+					TransformTriangle(mesh.tris[n], matTransformation, vecDecodedTris[n], vecDecodedNormals[n]);
+					LightTriangle(vecDecodedTris[n], vecDecodedNormals[n]);
+					vecDecodedShading[n] = vecDecodedNormals[n];
+					continue;
+				}
+
+				Triangle tri = {};
+				Vec3D vNormal = { 0.0f, 0.0f, 0.0f, 0.0f };
+				for (int c = 0; c < 3; c++) {
+					const QuantizedVertex& v = q.verts[q.Index(n * 3 + c)];
+					tri.t[c] = { (float)v.pos[0], (float)v.pos[1], (float)v.pos[2] };
+					tri.tx[c] = q.UV(v);
+					Vec3D vCornerNormal = QuantizedMesh::DecodeNormal(v.normal);
+					vNormal = VecsAdd(vNormal, vCornerNormal);
+				}
+				vNormal.w = 0.0f;
+				vNormal = MultiplyMatVec(matTransformation, vNormal);
+				vNormal = VecNormalise(vNormal);
+				TransformTriangle(tri, matDecodeTransformation, vecDecodedTris[n], vecDecodedNormals[n]);
+				LightTriangle(vecDecodedTris[n], vNormal);
+				vecDecodedShading[n] = vNormal;
+			}
+		});
+	}
+
+	// Project a mesh's triangles, appending them to each viewport's queue. The
+	// world space triangles are shared, so after the first viewport each costs
+	// only its BVH query and the camera dependent half. Each chunk of a
+	// viewport's triangles appends to its own queue, and the queues are
+	// concatenated in chunk order, so the result is the same as doing it serially.
+	// Pass bInstanced for a mesh drawn under more than one transform a frame.
+	// Its one world space cache would be rebuilt for every copy, so instead
+	// only the triangles in view are transformed, as for quantized meshes
+	void ProjectMesh(Mesh& mesh, Mat4x4& matTransformation, std::vector<Viewport>& views, bool bInstanced = false) {
+		if (views.empty()) {
+			return;
+		}
+
+		// Only the triangles in the BVH nodes each frustum touches
+		for (auto& view : views) {
+			view.vecVisibleTris.clear();
+			mesh.bvh.QueryFrustum(MakeFrustum(matTransformation, view), [&](int i) { view.vecVisibleTris.push_back(i); });
+		}
+
+		std::vector<Triangle>* pWorldTris = &vecDecodedTris;
+		std::vector<Vec3D>* pWorldNormals = &vecDecodedNormals;
+		std::vector<Vec3D>* pShadingNormals = &vecDecodedShading;
+		if (!mesh.tris.empty() && !bInstanced) {
+			// From the world space cache, so only the camera dependent half is
+			// done every frame
+			UpdateWorldCache(mesh, matTransformation);
+			pWorldTris = &mesh.world.tris;
+			pWorldNormals = &mesh.world.normals;
+			pShadingNormals = &mesh.world.normals;
+		}
+		else {
+			TransformVisibleTriangles(mesh, matTransformation, views);
+		}
+
+		const size_t nGrain = 1024;
+		for (auto& view : views) {
+			vecChunkQueues.resize(olcJobSystem::ChunkCount(view.vecVisibleTris.size(), nGrain));
+			jobs.ParallelFor(view.vecVisibleTris.size(), nGrain, [&](size_t nChunk, size_t nBegin, size_t nEnd) {
+				RasterQueue& queueOut = vecChunkQueues[nChunk];
+				queueOut.Clear();
+				for (size_t i = nBegin; i < nEnd; i++) {
+					int n = view.vecVisibleTris[i];
+					Vec3D vCameraRays = VecsSubtract((*pWorldTris)[n].t[0], view.vCamera);
+					if (VecsDotProduct((*pWorldNormals)[n], vCameraRays) < 0.0f) {
+						uint32_t nSurface = GBuffer::PackSurface((*pShadingNormals)[n], mesh.nMaterial);
+						ProjectWorldTriangle((*pWorldTris)[n], nSurface, view, queueOut);
+					}
+				}
+			});
+
+			size_t nTriangles = view.queue.tris.size();
+			for (auto& queue : vecChunkQueues)
+				nTriangles += queue.tris.size();
+			view.queue.tris.reserve(nTriangles);
+			view.queue.attributes.reserve(nTriangles);
+			for (auto& queue : vecChunkQueues)
+				view.queue.Append(queue);
+		}
+	}
+
+	// A viewport's view space to screen space
+	Vec3D ProjectToScreen(Viewport& view, Vec3D& vView) {
+		Vec3D vProjected = MultiplyMatVec(view.matProjection, vView);
+		vProjected = VecsDivide(vProjected, vProjected.w);
+		Vec3D vOffsetView = { 1,1,0 };
+		vProjected = VecsAdd(vProjected, vOffsetView);
+		vProjected.x = vProjected.x * (0.5f * (float)view.w) + (float)view.x;
+		vProjected.y = vProjected.y * (0.5f * (float)view.h) + (float)view.y;
+		return vProjected;
+	}
+
+	// Draw the mesh as lines, once per unique edge instead of three lines per
+	// triangle, which draws every shared edge twice. An edge is drawn if either
+	// triangle beside it faces the camera. Vertices are transformed once each,
+	// edges are clipped against the near plane in view space, and DrawLine clips
+	// them to the clip rect, which the caller sets to the viewport. bInstanced
+	// is as for ProjectMesh
+	void DrawWireframe(Mesh& mesh, Mat4x4& matTransformation, Viewport& view, bool bInstanced = false) {
+		// World space vertices come from the cache if the mesh has one
+		size_t nVerts = mesh.verts.size();
+		vecViewVerts.resize(nVerts);
+		std::vector<Vec3D>* pWorldVerts = &vecWorldVerts;
+		if (!mesh.tris.empty() && !bInstanced) {
+			UpdateWorldCache(mesh, matTransformation);
+			pWorldVerts = &mesh.world.verts;
+			jobs.ParallelFor(nVerts, 4096, [&](size_t nChunk, size_t nBegin, size_t nEnd) {
+				for (size_t i = nBegin; i < nEnd; i++) {
+					vecViewVerts[i] = MultiplyMatVec(view.matView, (*pWorldVerts)[i]);
+				}
+			});
+		}
+		else {
+			vecWorldVerts.resize(nVerts);
+			jobs.ParallelFor(nVerts, 4096, [&](size_t nChunk, size_t nBegin, size_t nEnd) {
+				for (size_t i = nBegin; i < nEnd; i++) {
+					vecWorldVerts[i] = MultiplyMatVec(matTransformation, mesh.verts[i]);
+					vecViewVerts[i] = MultiplyMatVec(view.matView, vecWorldVerts[i]);
+				}
+			});
+		}
+
+		// Triangles outside the frustum count as facing away, so edges only they
+		// border are skipped
+		view.vecVisibleTris.clear();
+		mesh.bvh.QueryFrustum(MakeFrustum(matTransformation, view), [&](int i) { view.vecVisibleTris.push_back(i); });
+		vecFrontFacing.assign(mesh.TriangleCount(), 0);
+		jobs.ParallelFor(view.vecVisibleTris.size(), 4096, [&](size_t nChunk, size_t nBegin, size_t nEnd) {
+			for (size_t n = nBegin; n < nEnd; n++) {
+				size_t i = view.vecVisibleTris[n];
+				Vec3D& v0 = (*pWorldVerts)[mesh.triVerts[i * 3 + 0]];
+				Vec3D& v1 = (*pWorldVerts)[mesh.triVerts[i * 3 + 1]];
+				Vec3D& v2 = (*pWorldVerts)[mesh.triVerts[i * 3 + 2]];
+				Vec3D line1 = VecsSubtract(v1, v0);
+				Vec3D line2 = VecsSubtract(v2, v0);
+				Vec3D normal = VecsCrossProduct(line1, line2);
+				Vec3D vCameraRays = VecsSubtract(v0, view.vCamera);
+				vecFrontFacing[i] = VecsDotProduct(normal, vCameraRays) < 0.0f;
+			}
+		});
+
+		Vec3D vNearPoint = { 0.0f, 0.0f, 0.1f };
+		Vec3D vNearNormal = { 0.0f, 0.0f, 1.0f };
+		for (auto& edge : mesh.edges) {
+			if (!vecFrontFacing[edge.tri[0]] && (edge.tri[1] < 0 || !vecFrontFacing[edge.tri[1]])) {
+				continue;
+			}
+
+			Vec3D a = vecViewVerts[edge.v[0]];
+			Vec3D b = vecViewVerts[edge.v[1]];
+			if (a.z < vNearPoint.z && b.z < vNearPoint.z) {
+				continue;
+			}
+			if (a.z < vNearPoint.z || b.z < vNearPoint.z) {
+				float t;
+				Vec3D vIntersect = VecIntersectPlane(vNearPoint, vNearNormal, a, b, t);
+				(a.z < vNearPoint.z ? a : b) = vIntersect;
+			}
+
+			Vec3D pa = ProjectToScreen(view, a);
+			Vec3D pb = ProjectToScreen(view, b);
+			DrawLine((int)pa.x, (int)pa.y, (int)pb.x, (int)pb.y, PIXEL_SOLID, FG_WHITE);
+		}
+	}
+
+	void BuildSceneDemo() {
+		const int nRings = 16, nPerRing = 64;
+		nSceneRoot = scene.AddNode(-1, MatMakeTranslation(0.0f, 0.0f, 40.0f));
+		for (int r = 0; r < nRings; r++) {
+			int nRing = scene.AddNode(nSceneRoot, MatMakeIdentity());
+			vecSceneRings.push_back(nRing);
+			float fRadius = 6.0f + 1.5f * r;
+			for (int i = 0; i < nPerRing; i++) {
+				Mat4x4 matOffset = MatMakeTranslation(fRadius, 0.0f, 0.0f);
+				Mat4x4 matAround = MatMakeRotationY(6.2831853f * i / nPerRing);
+				vecSceneInstances.push_back(scene.AddNode(nRing, MultiplyMatMat(matOffset, matAround)));
+			}
+		}
+	}
+
+	// Only the root and the rings are set; the copies follow through the graph
+	void AnimateSceneDemo(float fElapsedTime) {
+		fSceneTime += fElapsedTime;
+		Mat4x4 matSpin = MatMakeRotationY(fSceneTime * 0.2f);
+		Mat4x4 matPlace = MatMakeTranslation(0.0f, 0.0f, 40.0f);
+		scene.SetLocal(nSceneRoot, MultiplyMatMat(matSpin, matPlace));
+		for (size_t r = 0; r < vecSceneRings.size(); r++) {
+			Mat4x4 matTilt = MatMakeRotationX(0.3f * sinf(fSceneTime + r * 0.4f));
+			Mat4x4 matTurn = MatMakeRotationY(fSceneTime * (r % 2 ? 0.5f : -0.5f));
+			scene.SetLocal(vecSceneRings[r], MultiplyMatMat(matTurn, matTilt));
+		}
+	}
+
+	// Replace the finished frame with how many times each cell of it was
+	// written, and the totals along the top
+	void ShowOverdraw() {
+		if (!bShowOverdraw) {
+			return;
+		}
+
+		const olcFillStats& stats = FillStats();
+		if (GetKey(L'P').bPressed) {
+			stats.SaveHeatmap(L"overdraw.bmp");
+		}
+
+		DrawFillHeatmap();
+		bScreenValid = false;
+		wchar_t s[160];
+		swprintf_s(s, 160, L"Overdraw %.2f, max %u - %llu shaded, %llu rejected - %llu triangles, max %u per tile",
+			stats.Overdraw(), stats.MaxWrites(), (unsigned long long)stats.nShaded, (unsigned long long)stats.nRejected,
+			(unsigned long long)stats.nTriangles, stats.MaxTileTriangles());
+		DrawString(0, 0, s, FG_WHITE);
+	}
+
+	// One line, with the frame number in front
+	void LogResolution(const char* sLine) {
+		FILE* f = nullptr;
+		_wfopen_s(&f, L"resolution.log", L"a");
+		if (f == nullptr) {
+			return;
+		}
+		std::fprintf(f, "frame %d: %s\n", nFrame, sLine);
+		std::fclose(f);
+	}
 
+	// The end of every frame that draws: the viewports' frames, the stretch
+	// onto the screen if the 3D pass rendered smaller, and the overlay. Then
+	// the resolution controller is told how long the frame took
+	bool EndFrame(std::chrono::steady_clock::time_point tpStart) {
+		ResetClipRect();
+		DrawViewportFrames();
+		if (GetDrawTarget() == &sprRender) {
+			SetDrawTarget(nullptr);
+			DrawSpriteOpaqueScaled(0, 0, ScreenWidth(), ScreenHeight(), &sprRender);
+		}
+		bScreenValid = true;
+		ShowOverdraw();
+
+		if (bAdaptiveResolution && !bShowOverdraw) {
+			float fMs = std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - tpStart).count();
+			int nOldScale = resolution.Scale();
+			if (resolution.Update(fMs)) {
+				int nScale = resolution.Scale(), nMax = ResolutionController::SCALE_MAX;
+				char sLine[160];
+				std::snprintf(sLine, sizeof(sLine), "%.2f ms against a %.2f ms target, scale %d/%d -> %d/%d, %dx%d",
+					resolution.AverageMs(), resolution.fTargetMs, nOldScale, nMax, nScale, nMax,
+					ScreenWidth() * nScale / nMax, ScreenHeight() * nScale / nMax);
+				LogResolution(sLine);
+			}
+		}
 		return true;
 	}
 
 	bool OnUserUpdate(float fElapsedTime) override {
+		auto tpStart = std::chrono::steady_clock::now();
+		nFrame++;
+
 		// Control camera using keyboard
 		if (GetKey(VK_UP).bHeld) {
 			vCamera.y += 8.0f * fElapsedTime;
@@ -443,193 +2687,263 @@ public:
 			fYaw += 2.0f * fElapsedTime;
 		}
 
-		Fill(0, 0, ScreenWidth(), ScreenHeight(), PIXEL_SOLID, FG_BLACK);
-
-		Mat4x4 matRotationZ, matRotationX, matRotation, matTranslation, matTransformation;
 		//fTheta += 1.0f * fElapsedTime;
 
-		// Object transformation: rotation 1st, translation 2nd
-		matRotationZ = MatMakeRotationZ(fTheta * 0.5f);
-		matRotationX = MatMakeRotationX(fTheta);
+		bool bSceneChanged = false;
+		if (!bTransformValid || fTheta != fTransformTheta) {
+			Mat4x4 matRotationZ, matRotationX, matTranslation, matTransformation;
 
-		matTranslation = MatMakeTranslation(0.0f, 0.0f, 5.0f);
+			// Object transformation: rotation 1st, translation 2nd
+			matRotationZ = MatMakeRotationZ(fTheta * 0.5f);
+			matRotationX = MatMakeRotationX(fTheta);
 
-		matTransformation = MatMakeIdentity();
-		matTransformation = MultiplyMatMat(matRotationZ, matRotationX);
-		matTransformation = MultiplyMatMat(matTransformation, matTranslation);
+			matTranslation = MatMakeTranslation(0.0f, 0.0f, 5.0f);
 
-		Vec3D vUp = { 0,1,0 };
-		Vec3D vTarget = { 0,0,1 };
+			matTransformation = MultiplyMatMat(matRotationZ, matRotationX);
+			matTransformation = MultiplyMatMat(matTransformation, matTranslation);
+			scene.SetLocal(nObjectNode, matTransformation);
+			fTransformTheta = fTheta;
+			bTransformValid = true;
+		}
+		if (GetKey(L'G').bPressed) {
+			bSceneDemo = !bSceneDemo;
+			bSceneChanged = true;
+			bShadowDirty = true;
+		}
+		if (bSceneDemo) {
+			AnimateSceneDemo(fElapsedTime);
+		}
+		if (scene.Update() > 0) {
+			bSceneChanged = true;
+			bShadowDirty = true;
+		}
+		Mat4x4 matTransformation = scene.World(nObjectNode);
+
+		Vec3D vForwardDir = { 0,0,1 };
 		Mat4x4 matCameratRotationY = MatMakeRotationY(fYaw);
 		// New look direction after rotating camera
-		vLookDir = MultiplyMatVec(matCameratRotationY, vTarget);
-		vTarget = VecsAdd(vCamera, vLookDir);
-		Mat4x4 matCamera = MatPointAt(vCamera, vTarget, vUp);
-		// Make view matrix from camera
-		Mat4x4 matView = MatQuickInverse(matCamera);
-
-		std::vector<Triangle> vecTrianglesToRaster;
-
-		// Draw triangles
-		for (auto tri : meshObject.tris) {
-			Triangle triProjected, triTransformed, triViewed;
-
-			// Transformation (rotation + translation)
-			triTransformed.t[0] = MultiplyMatVec(matTransformation, tri.t[0]);
-			triTransformed.t[1] = MultiplyMatVec(matTransformation, tri.t[1]);
-			triTransformed.t[2] = MultiplyMatVec(matTransformation, tri.t[2]);
-			// Copy texture
-			triTransformed.tx[0] = tri.tx[0];
-			triTransformed.tx[1] = tri.tx[1];
-			triTransformed.tx[2] = tri.tx[2];
-
-			// Calculate cross products
-			Vec3D normal, line1, line2;
-
-			line1 = VecsSubtract(triTransformed.t[1], triTransformed.t[0]);
-			line2 = VecsSubtract(triTransformed.t[2], triTransformed.t[0]);
-
-			normal = VecsCrossProduct(line1, line2);
-			normal = VecNormalise(normal);
-
-			// Projection from 3D to 2D
-			Vec3D vCameraRays = VecsSubtract(triTransformed.t[0], vCamera);
-
-			if (VecsDotProduct(normal, vCameraRays) < 0.0f) {
-				// Illumination
-				Vec3D lightDirection = { 0.0f, 1.0f, -1.0f }; // single direction light
-				lightDirection = VecNormalise(lightDirection);
-				
-				// How "aligned" are light direction and triangle surface normal?
-				float dp = max(0.1f, VecsDotProduct(lightDirection, normal));
-				// Extract colour and shading of grey combination (very console-specific!)
-				CHAR_INFO colourShading = GetColour(dp);
-				triTransformed.colour = colourShading.Attributes;
-				triTransformed.symbol = colourShading.Char.UnicodeChar;
-
-				// Convert world space to view space before projection
-				triViewed.t[0] = MultiplyMatVec(matView, triTransformed.t[0]);
-				triViewed.t[1] = MultiplyMatVec(matView, triTransformed.t[1]);
-				triViewed.t[2] = MultiplyMatVec(matView, triTransformed.t[2]);
-				triViewed.colour = triTransformed.colour;
-				triViewed.symbol = triTransformed.symbol;
-				// Copy texture
-				triViewed.tx[0] = triTransformed.tx[0];
-				triViewed.tx[1] = triTransformed.tx[1];
-				triViewed.tx[2] = triTransformed.tx[2];
-
-				// Clip viewed triangle against near plane -> this forms 2 additional triangles
-				int nClippedTriangles = 0;
-				Triangle triClipped[2];
-				nClippedTriangles = TriangleClipAgainstPlane({ 0.0f, 0.0f, 0.1f }, { 0.0f, 0.0f, 1.0f }, triViewed, triClipped[0], triClipped[1]);
-
-				for (int n = 0; n < nClippedTriangles; n++) {
-					// Projection
-					triProjected.t[0] = MultiplyMatVec(matProjection, triClipped[n].t[0]);
-					triProjected.t[1] = MultiplyMatVec(matProjection, triClipped[n].t[1]);
-					triProjected.t[2] = MultiplyMatVec(matProjection, triClipped[n].t[2]);
-					triProjected.colour = triClipped[n].colour;
-					triProjected.symbol = triClipped[n].symbol;
-					triProjected.tx[0] = triClipped[n].tx[0];
-					triProjected.tx[1] = triClipped[n].tx[1];
-					triProjected.tx[2] = triClipped[n].tx[2];
-
-					// Scaling to view
-					triProjected.t[0] = VecsDivide(triProjected.t[0], triProjected.t[0].w);
-					triProjected.t[1] = VecsDivide(triProjected.t[1], triProjected.t[1].w);
-					triProjected.t[2] = VecsDivide(triProjected.t[2], triProjected.t[2].w);
-
-					//// X/Y are inverted so put them back
-					//triProjected.t[0].x *= -1.0f;
-					//triProjected.t[0].y *= -1.0f;
-					//triProjected.t[1].x *= -1.0f;
-					//triProjected.t[1].y *= -1.0f;
-					//triProjected.t[2].x *= -1.0f;
-					//triProjected.t[2].y *= -1.0f;
-
-					// Offset vertices to visible normalised view
-					Vec3D vOffsetView = { 1,1,0 };
-					triProjected.t[0] = VecsAdd(triProjected.t[0], vOffsetView);
-					triProjected.t[1] = VecsAdd(triProjected.t[1], vOffsetView);
-					triProjected.t[2] = VecsAdd(triProjected.t[2], vOffsetView);
-
-					// Scaling
-					triProjected.t[0].x *= 0.5f * (float)ScreenWidth();
-					triProjected.t[0].y *= 0.5f * (float)ScreenHeight();
-					triProjected.t[1].x *= 0.5f * (float)ScreenWidth();
-					triProjected.t[1].y *= 0.5f * (float)ScreenHeight();
-					triProjected.t[2].x *= 0.5f * (float)ScreenWidth();
-					triProjected.t[2].y *= 0.5f * (float)ScreenHeight();
-
-					// Store triangles for sorting
-					vecTrianglesToRaster.push_back(triProjected);
-				}
-			}
-		}
-
-		// Sort triangles from back to front
-		sort(vecTrianglesToRaster.begin(), vecTrianglesToRaster.end(), [](Triangle& t1, Triangle& t2) {
-				float z1 = (t1.t[0].z + t1.t[1].z + t1.t[2].z) / 3.0f;
-				float z2 = (t2.t[0].z + t2.t[1].z + t2.t[2].z) / 3.0f;
-				return z1 > z2;
-			}
-		);
-
-		// Clear Screen
-		Fill(0, 0, ScreenWidth(), ScreenHeight(), PIXEL_SOLID, FG_BLACK);
-
-		for (auto& triToRaster : vecTrianglesToRaster) {
-			// Clip triangles against all 4 screen edges
-			Triangle triClipped[2];
-			std::list<Triangle> listTriangles;
-			listTriangles.push_back(triToRaster);
-			int nNewTriangles = 1;
-
-			for (int p = 0; p < 4; p++) {
-				int nTrisToAdd = 0;
-				while (nNewTriangles > 0) {
-					// Take triangle from front of queue
-					Triangle triTest = listTriangles.front();
-					listTriangles.pop_front();
-					nNewTriangles--;
-
-					// Clip it against a plane. All triangles after a plane clip are guaranteed to lie on the inside of the plane
-					switch (p) {
-					case 0:	
-						nTrisToAdd = TriangleClipAgainstPlane({ 0.0f, 0.0f, 0.0f }, { 0.0f, 1.0f, 0.0f }, triTest, triClipped[0], triClipped[1]);
-						break;
-					case 1:	
-						nTrisToAdd = TriangleClipAgainstPlane({ 0.0f, (float)ScreenHeight() - 1, 0.0f }, { 0.0f, -1.0f, 0.0f }, triTest, triClipped[0], triClipped[1]);
-						break;
-					case 2:	
-						nTrisToAdd = TriangleClipAgainstPlane({ 0.0f, 0.0f, 0.0f }, { 1.0f, 0.0f, 0.0f }, triTest, triClipped[0], triClipped[1]);
-						break;
-					case 3:	
-						nTrisToAdd = TriangleClipAgainstPlane({ (float)ScreenWidth() - 1, 0.0f, 0.0f }, { -1.0f, 0.0f, 0.0f }, triTest, triClipped[0], triClipped[1]);
-						break;
+		vLookDir = MultiplyMatVec(matCameratRotationY, vForwardDir);
+
+		if (GetKey(L'E').bPressed) {
+			bUniqueEdges = !bUniqueEdges;
+			bSceneChanged = true;
+		}
+		if (GetKey(L'T').bPressed) {
+			bTerrain = !bTerrain;
+			bSceneChanged = true;
+			bShadowDirty = true;
+		}
+		if (GetKey(L'O').bPressed) {
+			bShowOverdraw = !bShowOverdraw;
+			EnableFillStats(bShowOverdraw);
+			bSceneChanged = true;
+		}
+		if (GetKey(L'V').bPressed) {
+			nViewLayout = (nViewLayout + 1) % 3;
+		}
+		if (GetKey(L'H').bPressed) {
+			bShadows = !bShadows;
+			bSceneChanged = true;
+			bShadowDirty = true;
+		}
+		if (GetKey(L'J').bPressed) {
+			nShadowSize = nShadowSize >= 1024 ? 128 : nShadowSize * 2;
+			bShadowDirty = true;
+		}
+		if (GetKey(L'K').bPressed) {
+			nShadowInterval = nShadowInterval >= 8 ? 1 : nShadowInterval * 2;
+		}
+		if (GetKey(L'L').bPressed) {
+			bDeferred = !bDeferred;
+			bSceneChanged = true;
+		}
+		if (GetKey(L'R').bPressed) {
+			bAdaptiveResolution = !bAdaptiveResolution;
+			resolution.Reset();
+			LogResolution(bAdaptiveResolution ? "adaptive resolution on" : "adaptive resolution off");
+		}
+
+		// Either the terrain around the camera, which sits in world space, or the model, or rings of copies of it
+		Mat4x4 matIdentity = MatMakeIdentity();
+		if (bTerrain) {
+			terrain->Update(vCamera, vecVisibleChunks);
+
+			// Keep the camera above the ground: cast down from high above it onto
+			// whichever chunks are loaded
+			Vec3D vDown = { 0.0f, -1.0f, 0.0f };
+			Vec3D vAbove = { vCamera.x, 10000.0f, vCamera.z };
+			for (auto& chunk : vecVisibleChunks) {
+				float t;
+				if (chunk->mesh.bvh.Raycast(chunk->mesh.quantized, vAbove, vDown, t) >= 0) {
+					vCamera.y = (std::max)(vCamera.y, vAbove.y - t + 1.0f);
+				}
+			}
+
+			// Chunks finish streaming in whether the camera moves or not
+			if (vecVisibleChunks != vecDrawnChunks) {
+				vecDrawnChunks = vecVisibleChunks;
+				bSceneChanged = true;
+				bShadowDirty = true;
+			}
+		}
+
+		// The wireframe isn't lit. Anything else that moves redraws the map, but
+		// no more often than every nShadowInterval frames
+		nShadowAge++;
+		if (bShadows && !bUniqueEdges && bShadowDirty && nShadowAge >= nShadowInterval) {
+			RenderShadowMap();
+			nShadowAge = 0;
+			bShadowDirty = false;
+			bSceneChanged = true;
+		}
+
+		// The 3D pass renders at the controller's resolution. The heatmap counts
+		// screen cells, so it holds the full resolution while it's up
+		int nScale = bAdaptiveResolution && !bShowOverdraw ? resolution.Scale() : ResolutionController::SCALE_MAX;
+		int nRenderWidth = ScreenWidth() * nScale / ResolutionController::SCALE_MAX;
+		int nRenderHeight = ScreenHeight() * nScale / ResolutionController::SCALE_MAX;
+
+		// After the terrain has had its say about where the camera is
+		if (LayoutViewports(nRenderWidth, nRenderHeight)) {
+			bSceneChanged = true;
+		}
+
+		if (bSceneChanged) {
+			bQueueValid = false;
+			bScreenValid = false;
+		}
+		// The heatmap needs the frame drawn to count it
+		if (bScreenValid && !bShowOverdraw) {
+			return true;
+		}
+
+		if (nRenderWidth != ScreenWidth() || nRenderHeight != ScreenHeight()) {
+			if (sprRender.nWidth != nRenderWidth || sprRender.nHeight != nRenderHeight) {
+				sprRender = olcSprite(nRenderWidth, nRenderHeight);
+			}
+			SetDrawTarget(&sprRender);
+		}
+
+		// Terrain chunks only carry edges while they're drawn as lines
+		if (bTerrain) {
+			for (auto& chunk : vecVisibleChunks) {
+				if (bUniqueEdges && chunk->mesh.edges.empty()) {
+					chunk->mesh.BuildEdges();
+				}
+				else if (!bUniqueEdges && !chunk->mesh.edges.empty()) {
+					chunk->mesh.ClearEdges();
+				}
+			}
+		}
+
+		// Lines go straight to the screen, so the wireframe is drawn one viewport
+		// after another, each clipped to its own rectangle
+		if (bUniqueEdges) {
+			for (auto& view : vecViewports) {
+				SetClipRect(view.x, view.y, view.x + view.w, view.y + view.h);
+				Clear(PIXEL_SOLID, FG_BLACK);
+				if (bTerrain) {
+					for (auto& chunk : vecVisibleChunks) {
+						DrawWireframe(chunk->mesh, matIdentity, view);
+					}
+				}
+				else if (bSceneDemo) {
+					for (int nNode : vecSceneInstances) {
+						Mat4x4 matWorld = scene.World(nNode);
+						DrawWireframe(meshObject, matWorld, view, true);
 					}
+				}
+				else {
+					DrawWireframe(meshObject, matTransformation, view);
+				}
+			}
+			return EndFrame(tpStart);
+		}
 
-					// Add these new triangles to the back of the queue for subsequent clipping against next planes
-					for (int w = 0; w < nTrisToAdd; w++)
-						listTriangles.push_back(triClipped[w]);
+		// One pass over the geometry fills every viewport's queue
+		if (!bQueueValid) {
+			for (auto& view : vecViewports) {
+				view.queue.Clear();
+			}
+			if (bTerrain) {
+				for (auto& chunk : vecVisibleChunks) {
+					ProjectMesh(chunk->mesh, matIdentity, vecViewports);
+				}
+			}
+			else if (bSceneDemo) {
+				for (int nNode : vecSceneInstances) {
+					Mat4x4 matWorld = scene.World(nNode);
+					ProjectMesh(meshObject, matWorld, vecViewports, true);
 				}
-				nNewTriangles = listTriangles.size();
+			}
+			else {
+				ProjectMesh(meshObject, matTransformation, vecViewports);
 			}
 
-			for (auto& tri : listTriangles) {
-				//FillTriangle(tri.t[0].x, tri.t[0].y, tri.t[1].x, tri.t[1].y, tri.t[2].x, tri.t[2].y, tri.symbol, tri.colour);
-				DrawTriangle(tri.t[0].x, tri.t[0].y, tri.t[1].x, tri.t[1].y, tri.t[2].x, tri.t[2].y, PIXEL_SOLID, FG_WHITE);
+			// Sort triangles from back to front. The G-buffer has a depth test instead
+			if (!bDeferred) {
+				for (auto& view : vecViewports) {
+					sort(view.queue.tris.begin(), view.queue.tris.end(), [](const ScreenTriangle& t1, const ScreenTriangle& t2) {
+							return t1.fDepth > t2.fDepth;
+						}
+					);
+				}
 			}
+			bQueueValid = true;
 		}
 
-		return true;
+		for (auto& view : vecViewports) {
+			SetClipRect(view.x, view.y, view.x + view.w, view.y + view.h);
+			if (bDeferred) {
+				DrawGBuffer(view);
+				LightGBuffer(view);
+				continue;
+			}
+
+			// Clear Screen
+			Clear(PIXEL_SOLID, FG_BLACK);
+
+			for (auto& tri : view.queue.tris) {
+				ScreenTriangleAttributes& attributes = view.queue.attributes[tri.nAttributes];
+				FillTriangleSubpixel(tri.x[0], tri.y[0], tri.x[1], tri.y[1], tri.x[2], tri.y[2], attributes.symbol, attributes.colour);
+			}
+		}
+		return EndFrame(tpStart);
 	}
 };
 
 //
 
-int main() {
+// Usage:
+//   GraphicsEngine3D                         play
+//   GraphicsEngine3D --record path.rec       play, recording input at a fixed 60Hz step
+//   GraphicsEngine3D --replay path.rec [out.csv]
+//                                            replay headless, writing per-frame timings
+//                                            and framebuffer hashes
+int wmain(int argc, wchar_t* argv[]) {
 	GraphicsEngine3D demo;
+
+	if (argc >= 3 && std::wstring(argv[1]) == L"--replay") {
+		std::vector<olcConsoleGameEngine::sReplayFrame> vecFrames;
+		if (!demo.RunReplay(argv[2], vecFrames)) {
+			std::wcerr << L"Couldn't replay " << argv[2] << std::endl;
+			return 1;
+		}
+
+		double fTotal = 0.0;
+		for (auto &f : vecFrames)
+			fTotal += f.fFrameTime;
+		std::wcout << vecFrames.size() << L" frames, " << fTotal * 1000.0 / std::max<size_t>(vecFrames.size(), 1)
+			<< L" ms/frame, last hash " << std::hex << (vecFrames.empty() ? 0 : vecFrames.back().nHash) << std::endl;
+
+		if (argc >= 4)
+			olcConsoleGameEngine::SaveReplayReport(argv[3], vecFrames);
+		return 0;
+	}
+
+	if (argc >= 3 && std::wstring(argv[1]) == L"--record")
+		demo.EnableInputRecording(argv[2], 1.0f / 60.0f);
+
 	if (demo.ConstructConsole(256, 240, 4, 4)) {
 		demo.Start();
 	}
@@ -131,12 +131,24 @@ Character Set -> Use Unicode. Thanks! - Javidx9
 #include <windows.h>
 
 #include <iostream>
+#include <cstdint>
+#include <climits>
 #include <chrono>
 #include <vector>
 #include <list>
+#include <deque>
 #include <thread>
 #include <atomic>
 #include <condition_variable>
+#include <algorithm>
+#include <memory>
+#include <unordered_map>
+#include <mutex>
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__SSE2__)
+#include <emmintrin.h>
+#define OLC_CGE_SSE2
+#endif
 
 enum COLOUR
 {
@@ -201,24 +213,127 @@ public:
 			Create(8, 8);
 	}
 
+	olcSprite(const olcSprite& other)
+	{
+		Create(other.nWidth, other.nHeight);
+		if (m_Cells != nullptr)
+			std::memcpy(m_Cells, other.m_Cells, sizeof(CHAR_INFO) * nWidth * nHeight);
+		m_vecMips = other.m_vecMips;
+	}
+
+	olcSprite(olcSprite&& other) noexcept
+	{
+		Swap(other);
+	}
+
+	olcSprite& operator=(olcSprite other) noexcept
+	{
+		// Copy-and-swap, so this covers both copy and move assignment
+		Swap(other);
+		return *this;
+	}
+
+	~olcSprite()
+	{
+		Destroy();
+	}
+
 	int nWidth = 0;
 	int nHeight = 0;
 
 private:
-	short* m_Glyphs = nullptr;
-	short* m_Colours = nullptr;
+	friend class olcConsoleGameEngine; // SetDrawTarget() draws straight into m_Cells
+
+	// Glyphs and colours live together in one aligned block laid out exactly
+	// like the screen buffer, so a sprite row can be copied straight into it
+	CHAR_INFO* m_Cells = nullptr;
 
-	void Create(int w, int h)
+	// Returns false, leaving the sprite as it was, if w x h cells can't be
+	// allocated. A size of zero just empties it
+	bool Create(int w, int h)
 	{
+		if (w <= 0 || h <= 0)
+		{
+			Destroy();
+			return true;
+		}
+		if (!ValidSize(w, h))
+			return false;
+
+		CHAR_INFO* pCells = (CHAR_INFO*)_aligned_malloc(sizeof(CHAR_INFO) * w * h, 16);
+		if (pCells == nullptr)
+			return false;
+
+		Destroy();
 		nWidth = w;
 		nHeight = h;
-		m_Glyphs = new short[w * h];
-		m_Colours = new short[w * h];
+		m_Cells = pCells;
 		for (int i = 0; i < w * h; i++)
 		{
-			m_Glyphs[i] = L' ';
-			m_Colours[i] = FG_BLACK;
+			m_Cells[i].Char.UnicodeChar = L' ';
+			m_Cells[i].Attributes = FG_BLACK;
+		}
+		return true;
+	}
+
+	// Whether w x h cells can be indexed with an int
+	static bool ValidSize(int w, int h)
+	{
+		return w > 0 && h > 0 && (long long)w * h <= INT_MAX / (long long)sizeof(CHAR_INFO);
+	}
+
+	void Destroy()
+	{
+		m_vecMips.clear();
+		_aligned_free(m_Cells);
+		m_Cells = nullptr;
+		nWidth = 0;
+		nHeight = 0;
+	}
+
+	void Swap(olcSprite& other) noexcept
+	{
+		std::swap(nWidth, other.nWidth);
+		std::swap(nHeight, other.nHeight);
+		std::swap(m_Cells, other.m_Cells);
+		m_vecMips.swap(other.m_vecMips);
+	}
+
+	// A mip level is stored in 8x8 tiles, row-major across the level, with the
+	// 64 cells inside each tile in Morton (Z) order. Neighbouring texels in both
+	// x and y then tend to share a cache line, which matters when a triangle
+	// walks across the texture at an angle.
+	struct sMipLevel
+	{
+		int nWidth = 0;
+		int nHeight = 0;
+		int nTilesX = 0;
+		std::vector<CHAR_INFO> vecCells;
+
+		static int Morton8(int x, int y)
+		{
+			// Interleave the low 3 bits of x and y
+			x = (x | (x << 2)) & 0x33; x = (x | (x << 1)) & 0x55;
+			y = (y | (y << 2)) & 0x33; y = (y | (y << 1)) & 0x55;
+			return x | (y << 1);
+		}
+
+		int Index(int x, int y) const
+		{
+			return (((y >> 3) * nTilesX + (x >> 3)) << 6) + Morton8(x & 7, y & 7);
 		}
+	};
+	std::vector<sMipLevel> m_vecMips;
+
+	void BuildMipLevel(sMipLevel& level, int w, int h)
+	{
+		level.nWidth = w;
+		level.nHeight = h;
+		level.nTilesX = (w + 7) >> 3;
+		CHAR_INFO blank;
+		blank.Char.UnicodeChar = L' ';
+		blank.Attributes = FG_BLACK;
+		level.vecCells.assign((size_t)level.nTilesX * ((h + 7) >> 3) * 64, blank);
 	}
 
 public:
@@ -227,7 +342,10 @@ public:
 		if (x < 0 || x >= nWidth || y < 0 || y >= nHeight)
 			return;
 		else
-			m_Glyphs[y * nWidth + x] = c;
+		{
+			m_Cells[y * nWidth + x].Char.UnicodeChar = c;
+			m_vecMips.clear();
+		}
 	}
 
 	void SetColour(int x, int y, short c)
@@ -235,7 +353,10 @@ public:
 		if (x < 0 || x >= nWidth || y < 0 || y >= nHeight)
 			return;
 		else
-			m_Colours[y * nWidth + x] = c;
+		{
+			m_Cells[y * nWidth + x].Attributes = c;
+			m_vecMips.clear();
+		}
 	}
 
 	short GetGlyph(int x, int y)
@@ -243,7 +364,7 @@ public:
 		if (x < 0 || x >= nWidth || y < 0 || y >= nHeight)
 			return L' ';
 		else
-			return m_Glyphs[y * nWidth + x];
+			return m_Cells[y * nWidth + x].Char.UnicodeChar;
 	}
 
 	short GetColour(int x, int y)
@@ -251,29 +372,143 @@ public:
 		if (x < 0 || x >= nWidth || y < 0 || y >= nHeight)
 			return FG_BLACK;
 		else
-			return m_Colours[y * nWidth + x];
+			return m_Cells[y * nWidth + x].Attributes;
+	}
+
+	// Unchecked access to a whole row, used by the engine's sprite blitters
+	const CHAR_INFO* GetRow(int y) const
+	{
+		return m_Cells + y * nWidth;
 	}
 
 	short SampleGlyph(float x, float y)
 	{
-		int sx = (int)(x * (float)nWidth);
-		int sy = (int)(y * (float)nHeight - 1.0f);
-		if (sx < 0 || sx >= nWidth || sy < 0 || sy >= nHeight)
-			return L' ';
-		else
-			return m_Glyphs[sy * nWidth + sx];
+		return Sample(x, y).Char.UnicodeChar;
 	}
 
 	short SampleColour(float x, float y)
+	{
+		return Sample(x, y).Attributes;
+	}
+
+	// Glyph and colour in one lookup
+	CHAR_INFO Sample(float x, float y)
 	{
 		int sx = (int)(x * (float)nWidth);
 		int sy = (int)(y * (float)nHeight - 1.0f);
 		if (sx < 0 || sx >= nWidth || sy < 0 || sy >= nHeight)
-			return FG_BLACK;
+		{
+			CHAR_INFO blank;
+			blank.Char.UnicodeChar = L' ';
+			blank.Attributes = FG_BLACK;
+			return blank;
+		}
+		else
+			return m_Cells[sy * nWidth + sx];
+	}
+
+	// Build the mip chain used by SampleLevel(). Glyphs and colours can't be
+	// averaged, so each texel of a smaller level takes the most common cell of
+	// the 2x2 block beneath it. Editing the sprite discards the chain, so call
+	// this again once you're done drawing into a texture.
+	void GenerateMipmaps()
+	{
+		m_vecMips.clear();
+		if (m_Cells == nullptr)
+			return;
+
+		m_vecMips.emplace_back();
+		BuildMipLevel(m_vecMips[0], nWidth, nHeight);
+		for (int y = 0; y < nHeight; y++)
+			for (int x = 0; x < nWidth; x++)
+				m_vecMips[0].vecCells[m_vecMips[0].Index(x, y)] = m_Cells[y * nWidth + x];
+
+		auto same = [](const CHAR_INFO& a, const CHAR_INFO& b)
+			{
+				return a.Char.UnicodeChar == b.Char.UnicodeChar && a.Attributes == b.Attributes;
+			};
+
+		while (m_vecMips.back().nWidth > 1 || m_vecMips.back().nHeight > 1)
+		{
+			m_vecMips.emplace_back();
+			const sMipLevel& src = m_vecMips[m_vecMips.size() - 2];
+			sMipLevel& dst = m_vecMips.back();
+			BuildMipLevel(dst, (src.nWidth + 1) / 2, (src.nHeight + 1) / 2);
+
+			for (int y = 0; y < dst.nHeight; y++)
+			{
+				for (int x = 0; x < dst.nWidth; x++)
+				{
+					int x0 = x * 2, x1 = (std::min)(x * 2 + 1, src.nWidth - 1);
+					int y0 = y * 2, y1 = (std::min)(y * 2 + 1, src.nHeight - 1);
+					CHAR_INFO block[4] = {
+						src.vecCells[src.Index(x0, y0)], src.vecCells[src.Index(x1, y0)],
+						src.vecCells[src.Index(x0, y1)], src.vecCells[src.Index(x1, y1)] };
+
+					int nBest = 0, nBestCount = 0;
+					for (int i = 0; i < 4; i++)
+					{
+						int nCount = 0;
+						for (int j = 0; j < 4; j++)
+							if (same(block[i], block[j])) nCount++;
+						if (nCount > nBestCount) { nBest = i; nBestCount = nCount; }
+					}
+					dst.vecCells[dst.Index(x, y)] = block[nBest];
+				}
+			}
+		}
+	}
+
+	// Bytes held by this sprite, including its mip chain
+	size_t MemoryUsage() const
+	{
+		size_t nBytes = sizeof(CHAR_INFO) * nWidth * nHeight;
+		for (auto& level : m_vecMips)
+			nBytes += sizeof(CHAR_INFO) * level.vecCells.size();
+		return nBytes;
+	}
+
+	int MipLevels() const
+	{
+		return (int)m_vecMips.size();
+	}
+
+	// Pick the level whose texels are closest to one per screen cell, given the
+	// texture footprint of one cell measured in level 0 texels
+	int MipLevelFor(float fTexelsPerCell) const
+	{
+		int nLevel = 0;
+		while (fTexelsPerCell >= 2.0f && nLevel + 1 < (int)m_vecMips.size())
+		{
+			fTexelsPerCell *= 0.5f;
+			nLevel++;
+		}
+		return nLevel;
+	}
+
+	// As Sample(), but reading the given mip level. Falls back to Sample()
+	// if no mip chain has been generated
+	CHAR_INFO SampleLevel(float x, float y, int nLevel)
+	{
+		if (m_vecMips.empty())
+			return Sample(x, y);
+
+		const sMipLevel& level = m_vecMips[nLevel];
+		int sx = (int)(x * (float)level.nWidth);
+		int sy = (int)(y * (float)level.nHeight - 1.0f);
+		if (sx < 0 || sx >= level.nWidth || sy < 0 || sy >= level.nHeight)
+		{
+			CHAR_INFO blank;
+			blank.Char.UnicodeChar = L' ';
+			blank.Attributes = FG_BLACK;
+			return blank;
+		}
 		else
-			return m_Colours[sy * nWidth + sx];
+			return level.vecCells[level.Index(sx, sy)];
 	}
 
+	// The file format stores all colours followed by all glyphs, so convert
+	// to and from the packed layout a row at a time
 	bool Save(std::wstring sFile)
 	{
 		FILE* f = nullptr;
@@ -283,8 +518,20 @@ public:
 
 		fwrite(&nWidth, sizeof(int), 1, f);
 		fwrite(&nHeight, sizeof(int), 1, f);
-		fwrite(m_Colours, sizeof(short), nWidth * nHeight, f);
-		fwrite(m_Glyphs, sizeof(short), nWidth * nHeight, f);
+
+		std::vector<short> vecRow(nWidth);
+		for (int y = 0; y < nHeight; y++)
+		{
+			for (int x = 0; x < nWidth; x++)
+				vecRow[x] = m_Cells[y * nWidth + x].Attributes;
+			fwrite(vecRow.data(), sizeof(short), nWidth, f);
+		}
+		for (int y = 0; y < nHeight; y++)
+		{
+			for (int x = 0; x < nWidth; x++)
+				vecRow[x] = m_Cells[y * nWidth + x].Char.UnicodeChar;
+			fwrite(vecRow.data(), sizeof(short), nWidth, f);
+		}
 
 		fclose(f);
 
@@ -293,173 +540,1773 @@ public:
 
 	bool Load(std::wstring sFile)
 	{
-		delete[] m_Glyphs;
-		delete[] m_Colours;
-		nWidth = 0;
-		nHeight = 0;
-
 		FILE* f = nullptr;
 		_wfopen_s(&f, sFile.c_str(), L"rb");
 		if (f == nullptr)
 			return false;
 
-		std::fread(&nWidth, sizeof(int), 1, f);
-		std::fread(&nHeight, sizeof(int), 1, f);
+		// Read the whole file before touching the sprite, so a short or
+		// corrupt one leaves it as it was
+		int w = 0, h = 0;
+		bool bValid = std::fread(&w, sizeof(int), 1, f) == 1 && std::fread(&h, sizeof(int), 1, f) == 1 && ValidSize(w, h);
+		if (bValid)
+		{
+			// Don't believe a header asking for more cells than the file holds
+			long nHeaderEnd = std::ftell(f);
+			std::fseek(f, 0, SEEK_END);
+			bValid = (long long)(std::ftell(f) - nHeaderEnd) >= (long long)w * h * 2 * (long long)sizeof(short);
+			std::fseek(f, nHeaderEnd, SEEK_SET);
+		}
 
-		Create(nWidth, nHeight);
+		size_t nCells = bValid ? (size_t)w * h : 0;
+		std::vector<short> vecColours(nCells), vecGlyphs(nCells);
+		if (bValid)
+			bValid = std::fread(vecColours.data(), sizeof(short), nCells, f) == nCells &&
+				std::fread(vecGlyphs.data(), sizeof(short), nCells, f) == nCells;
+		std::fclose(f);
+		if (!bValid)
+			return false;
 
-		std::fread(m_Colours, sizeof(short), nWidth * nHeight, f);
-		std::fread(m_Glyphs, sizeof(short), nWidth * nHeight, f);
+		// Reuse the existing block if the size hasn't changed
+		if ((w != nWidth || h != nHeight || m_Cells == nullptr) && !Create(w, h))
+			return false;
 
-		std::fclose(f);
+		for (size_t i = 0; i < nCells; i++)
+		{
+			m_Cells[i].Attributes = vecColours[i];
+			m_Cells[i].Char.UnicodeChar = vecGlyphs[i];
+		}
+		m_vecMips.clear();
 		return true;
 	}
 };
 
-class olcConsoleGameEngine
+// Sprite Cache ===============================================================
+//
+// Loading a sprite by filename hits the disk every time, so the same texture
+// used by many objects ends up in memory many times over. olcSpriteCache hands
+// out shared sprites keyed by filename, and keeps the total size of the sprites
+// it holds under a byte budget by dropping the least recently used ones.
+//
+//		olcSpriteCache cache(16 * 1024 * 1024);
+//		std::shared_ptr<olcSprite> tex = cache.Get(L"brick.spr");
+//
+// Evicting a sprite only releases the cache's reference - anyone still holding
+// the shared_ptr keeps a valid sprite, it just no longer counts against the
+// budget. The most recently requested sprite is never evicted, even if it is
+// bigger than the whole budget on its own.
+
+class olcSpriteCache
 {
 public:
-	olcConsoleGameEngine()
+	olcSpriteCache(size_t nBudgetBytes = 64 * 1024 * 1024)
 	{
-		m_nScreenWidth = 80;
-		m_nScreenHeight = 30;
+		m_nBudget = nBudgetBytes;
+	}
 
-		m_hConsole = GetStdHandle(STD_OUTPUT_HANDLE);
-		m_hConsoleIn = GetStdHandle(STD_INPUT_HANDLE);
+	// Returns the cached sprite for this file, loading it on a miss. Returns
+	// nullptr if the file can't be loaded; failures are not cached. The file
+	// is read without holding the lock, so other threads' hits don't wait on
+	// it. If two threads miss on the same file, both load it and the first to
+	// finish is the one cached and returned to both
+	std::shared_ptr<olcSprite> Get(const std::wstring& sFile)
+	{
+		{
+			std::unique_lock<std::mutex> lm(m_mux);
+			auto it = m_mapEntries.find(sFile);
+			if (it != m_mapEntries.end())
+			{
+				m_nHits++;
+				m_listLRU.splice(m_listLRU.begin(), m_listLRU, it->second.itLRU);
+				return it->second.sprite;
+			}
+			m_nMisses++;
+		}
 
-		std::memset(m_keyNewState, 0, 256 * sizeof(short));
-		std::memset(m_keyOldState, 0, 256 * sizeof(short));
-		std::memset(m_keys, 0, 256 * sizeof(sKeyState));
-		m_mousePosX = 0;
-		m_mousePosY = 0;
+		auto sprite = std::make_shared<olcSprite>();
+		if (!sprite->Load(sFile))
+			return nullptr;
 
-		m_bEnableSound = false;
+		std::unique_lock<std::mutex> lm(m_mux);
+		auto it = m_mapEntries.find(sFile);
+		if (it != m_mapEntries.end())
+		{
+			m_listLRU.splice(m_listLRU.begin(), m_listLRU, it->second.itLRU);
+			return it->second.sprite;
+		}
 
-		m_sAppName = L"Default";
+		Insert(sFile, sprite);
+		return sprite;
 	}
 
-	void EnableSound()
+	// Put an already built sprite (e.g. a procedural texture) in the cache.
+	// Putting nullptr just evicts whatever was there
+	void Put(const std::wstring& sKey, std::shared_ptr<olcSprite> sprite)
 	{
-		m_bEnableSound = true;
+		std::unique_lock<std::mutex> lm(m_mux);
+		Remove(sKey);
+		if (sprite != nullptr)
+			Insert(sKey, sprite);
 	}
 
-	int ConstructConsole(int width, int height, int fontw, int fonth)
+	// Re-measure a sprite that was edited (or had mipmaps generated) after
+	// it was cached
+	void Refresh(const std::wstring& sKey)
 	{
-		if (m_hConsole == INVALID_HANDLE_VALUE)
-			return Error(L"Bad Handle");
-
-		m_nScreenWidth = width;
-		m_nScreenHeight = height;
-
-		// Update 13/09/2017 - It seems that the console behaves differently on some systems
-		// and I'm unsure why this is. It could be to do with windows default settings, or
-		// screen resolutions, or system languages. Unfortunately, MSDN does not offer much
-		// by way of useful information, and so the resulting sequence is the reult of experiment
-		// that seems to work in multiple cases.
-		//
-		// The problem seems to be that the SetConsoleXXX functions are somewhat circular and 
-		// fail depending on the state of the current console properties, i.e. you can't set
-		// the buffer size until you set the screen size, but you can't change the screen size
-		// until the buffer size is correct. This coupled with a precise ordering of calls
-		// makes this procedure seem a little mystical :-P. Thanks to wowLinh for helping - Jx9
-
-		// Change console visual size to a minimum so ScreenBuffer can shrink
-		// below the actual visual size
-		m_rectWindow = { 0, 0, 1, 1 };
-		SetConsoleWindowInfo(m_hConsole, TRUE, &m_rectWindow);
-
-		// Set the size of the screen buffer
-		COORD coord = { (short)m_nScreenWidth, (short)m_nScreenHeight };
-		if (!SetConsoleScreenBufferSize(m_hConsole, coord))
-			Error(L"SetConsoleScreenBufferSize");
-
-		// Assign screen buffer to the console
-		if (!SetConsoleActiveScreenBuffer(m_hConsole))
-			return Error(L"SetConsoleActiveScreenBuffer");
+		std::unique_lock<std::mutex> lm(m_mux);
+		auto it = m_mapEntries.find(sKey);
+		if (it == m_mapEntries.end())
+			return;
 
-		// Set the font size now that the screen buffer has been assigned to the console
-		CONSOLE_FONT_INFOEX cfi;
-		cfi.cbSize = sizeof(cfi);
-		cfi.nFont = 0;
-		cfi.dwFontSize.X = fontw;
-		cfi.dwFontSize.Y = fonth;
-		cfi.FontFamily = FF_DONTCARE;
-		cfi.FontWeight = FW_NORMAL;
+		m_nBytes -= it->second.nBytes;
+		it->second.nBytes = it->second.sprite->MemoryUsage();
+		m_nBytes += it->second.nBytes;
+		Trim();
+	}
 
-		/*	DWORD version = GetVersion();
-			DWORD major = (DWORD)(LOBYTE(LOWORD(version)));
-			DWORD minor = (DWORD)(HIBYTE(LOWORD(version)));*/
+	void Evict(const std::wstring& sKey)
+	{
+		std::unique_lock<std::mutex> lm(m_mux);
+		Remove(sKey);
+	}
 
-			//if ((major > 6) || ((major == 6) && (minor >= 2) && (minor < 4)))		
-			//	wcscpy_s(cfi.FaceName, L"Raster"); // Windows 8 :(
-			//else
-			//	wcscpy_s(cfi.FaceName, L"Lucida Console"); // Everything else :P
+	void Clear()
+	{
+		std::unique_lock<std::mutex> lm(m_mux);
+		m_mapEntries.clear();
+		m_listLRU.clear();
+		m_nBytes = 0;
+	}
 
-			//wcscpy_s(cfi.FaceName, L"Liberation Mono");
-		wcscpy_s(cfi.FaceName, L"Consolas");
-		if (!SetCurrentConsoleFontEx(m_hConsole, false, &cfi))
-			return Error(L"SetCurrentConsoleFontEx");
+	void SetBudget(size_t nBudgetBytes)
+	{
+		std::unique_lock<std::mutex> lm(m_mux);
+		m_nBudget = nBudgetBytes;
+		Trim();
+	}
 
-		// Get screen buffer info and check the maximum allowed window size. Return
-		// error if exceeded, so user knows their dimensions/fontsize are too large
-		CONSOLE_SCREEN_BUFFER_INFO csbi;
-		if (!GetConsoleScreenBufferInfo(m_hConsole, &csbi))
-			return Error(L"GetConsoleScreenBufferInfo");
-		if (m_nScreenHeight > csbi.dwMaximumWindowSize.Y)
-			return Error(L"Screen Height / Font Height Too Big");
-		if (m_nScreenWidth > csbi.dwMaximumWindowSize.X)
-			return Error(L"Screen Width / Font Width Too Big");
+	size_t Budget() const { std::unique_lock<std::mutex> lm(m_mux); return m_nBudget; }
+	size_t Bytes() const { std::unique_lock<std::mutex> lm(m_mux); return m_nBytes; }
+	size_t Count() const { std::unique_lock<std::mutex> lm(m_mux); return m_mapEntries.size(); }
+	size_t Hits() const { std::unique_lock<std::mutex> lm(m_mux); return m_nHits; }
+	size_t Misses() const { std::unique_lock<std::mutex> lm(m_mux); return m_nMisses; }
+	size_t Evictions() const { std::unique_lock<std::mutex> lm(m_mux); return m_nEvictions; }
 
-		// Set Physical Console Window Size
-		m_rectWindow = { 0, 0, (short)(m_nScreenWidth - 1), (short)(m_nScreenHeight - 1) };
-		if (!SetConsoleWindowInfo(m_hConsole, TRUE, &m_rectWindow))
-			return Error(L"SetConsoleWindowInfo");
+private:
+	struct sEntry
+	{
+		std::shared_ptr<olcSprite> sprite;
+		std::list<std::wstring>::iterator itLRU;
+		size_t nBytes = 0;
+	};
 
-		// Set flags to allow mouse input		
-		if (!SetConsoleMode(m_hConsoleIn, ENABLE_EXTENDED_FLAGS | ENABLE_WINDOW_INPUT | ENABLE_MOUSE_INPUT))
-			return Error(L"SetConsoleMode");
+	void Insert(const std::wstring& sKey, std::shared_ptr<olcSprite> sprite)
+	{
+		m_listLRU.push_front(sKey);
+		sEntry& e = m_mapEntries[sKey];
+		e.sprite = sprite;
+		e.itLRU = m_listLRU.begin();
+		e.nBytes = sprite->MemoryUsage();
+		m_nBytes += e.nBytes;
+		Trim();
+	}
 
-		// Allocate memory for screen buffer
-		m_bufScreen = new CHAR_INFO[m_nScreenWidth * m_nScreenHeight];
-		memset(m_bufScreen, 0, sizeof(CHAR_INFO) * m_nScreenWidth * m_nScreenHeight);
+	void Remove(const std::wstring& sKey)
+	{
+		auto it = m_mapEntries.find(sKey);
+		if (it == m_mapEntries.end())
+			return;
 
-		SetConsoleCtrlHandler((PHANDLER_ROUTINE)CloseHandler, TRUE);
-		return 1;
+		m_nBytes -= it->second.nBytes;
+		m_listLRU.erase(it->second.itLRU);
+		m_mapEntries.erase(it);
 	}
 
-	virtual void Draw(int x, int y, short c = 0x2588, short col = 0x000F)
+	// Drop least recently used sprites until we fit, but always keep the newest
+	void Trim()
 	{
-		if (x >= 0 && x < m_nScreenWidth && y >= 0 && y < m_nScreenHeight)
+		while (m_nBytes > m_nBudget && m_listLRU.size() > 1)
 		{
-			m_bufScreen[y * m_nScreenWidth + x].Char.UnicodeChar = c;
-			m_bufScreen[y * m_nScreenWidth + x].Attributes = col;
+			Remove(m_listLRU.back());
+			m_nEvictions++;
 		}
 	}
 
-	void Fill(int x1, int y1, int x2, int y2, short c = 0x2588, short col = 0x000F)
+	std::unordered_map<std::wstring, sEntry> m_mapEntries;
+	std::list<std::wstring> m_listLRU; // front is most recently used
+	mutable std::mutex m_mux;
+	size_t m_nBudget = 0;
+	size_t m_nBytes = 0;
+	size_t m_nHits = 0;
+	size_t m_nMisses = 0;
+	size_t m_nEvictions = 0;
+};
+
+// Lock-free Queue ============================================================
+//
+// Fixed capacity ring buffer for exactly one producer thread and one consumer
+// thread. Neither side ever blocks or allocates; TryPush() fails if the ring
+// is full and TryPop() fails if it is empty. N must be a power of two.
+
+template<typename T, size_t N>
+class olcSPSCQueue
+{
+	static_assert((N & (N - 1)) == 0, "olcSPSCQueue capacity must be a power of two");
+
+public:
+	bool TryPush(const T& item)
 	{
-		Clip(x1, y1);
-		Clip(x2, y2);
-		for (int x = x1; x < x2; x++)
-			for (int y = y1; y < y2; y++)
-				Draw(x, y, c, col);
+		size_t nTail = m_nTail.load(std::memory_order_relaxed);
+		if (nTail - m_nHead.load(std::memory_order_acquire) == N)
+			return false;
+
+		m_items[nTail & (N - 1)] = item;
+		m_nTail.store(nTail + 1, std::memory_order_release);
+		return true;
 	}
 
-	void DrawString(int x, int y, std::wstring c, short col = 0x000F)
+	bool TryPop(T& item)
 	{
-		for (size_t i = 0; i < c.size(); i++)
-		{
-			m_bufScreen[y * m_nScreenWidth + x + i].Char.UnicodeChar = c[i];
-			m_bufScreen[y * m_nScreenWidth + x + i].Attributes = col;
-		}
+		size_t nHead = m_nHead.load(std::memory_order_relaxed);
+		if (nHead == m_nTail.load(std::memory_order_acquire))
+			return false;
+
+		item = m_items[nHead & (N - 1)];
+		m_nHead.store(nHead + 1, std::memory_order_release);
+		return true;
 	}
 
-	void DrawStringAlpha(int x, int y, std::wstring c, short col = 0x000F)
-	{
-		for (size_t i = 0; i < c.size(); i++)
-		{
-			if (c[i] != L' ')
-			{
+private:
+	T m_items[N];
+	// Padded apart so producer and consumer don't fight over one cache line
+	std::atomic<size_t> m_nHead{ 0 };
+	char m_pad[64];
+	std::atomic<size_t> m_nTail{ 0 };
+};
+
+// Audio Sinks ================================================================
+//
+// The audio thread mixes a block at a time and hands each finished block of
+// 16-bit interleaved samples to a sink. By default that's the sound card via
+// waveOut, but the same block loop can feed a WAV file or nothing at all, which
+// lets the mixer run headless and faster than real time - see
+// olcConsoleGameEngine::RenderAudioOffline().
+
+class olcAudioSink
+{
+public:
+	virtual ~olcAudioSink() {}
+
+	virtual bool Open(unsigned int nSampleRate, unsigned int nChannels, unsigned int nBlocks, unsigned int nBlockSamples) = 0;
+
+	// Deliver one block. Real devices may wait here until they have room.
+	// Returning false stops the audio thread
+	virtual bool Submit(const short* pBlock, unsigned int nSamples) = 0;
+
+	// Called from another thread to wake up a Submit() that is waiting
+	virtual void Interrupt() {}
+
+	virtual void Close() {}
+};
+
+// Plays blocks on the default sound card
+class olcWaveOutSink : public olcAudioSink
+{
+public:
+	~olcWaveOutSink()
+	{
+		Close();
+	}
+
+	bool Open(unsigned int nSampleRate, unsigned int nChannels, unsigned int nBlocks, unsigned int nBlockSamples) override
+	{
+		m_nBlockCount = nBlocks;
+		m_nBlockSamples = nBlockSamples;
+		m_nBlockFree = m_nBlockCount;
+		m_nBlockCurrent = 0;
+		m_bInterrupted = false;
+
+		// Device is available
+		WAVEFORMATEX waveFormat;
+		waveFormat.wFormatTag = WAVE_FORMAT_PCM;
+		waveFormat.nSamplesPerSec = nSampleRate;
+		waveFormat.wBitsPerSample = sizeof(short) * 8;
+		waveFormat.nChannels = nChannels;
+		waveFormat.nBlockAlign = (waveFormat.wBitsPerSample / 8) * waveFormat.nChannels;
+		waveFormat.nAvgBytesPerSec = waveFormat.nSamplesPerSec * waveFormat.nBlockAlign;
+		waveFormat.cbSize = 0;
+
+		// Open Device if valid
+		if (waveOutOpen(&m_hwDevice, WAVE_MAPPER, &waveFormat, (DWORD_PTR)waveOutProcWrap, (DWORD_PTR)this, CALLBACK_FUNCTION) != S_OK)
+		{
+			m_hwDevice = nullptr;
+			return false;
+		}
+
+		// Allocate Wave|Block Memory and link headers to it
+		m_vecBlockMemory.assign(m_nBlockCount * m_nBlockSamples, 0);
+		m_vecWaveHeaders.resize(m_nBlockCount);
+		ZeroMemory(m_vecWaveHeaders.data(), sizeof(WAVEHDR) * m_nBlockCount);
+		for (unsigned int n = 0; n < m_nBlockCount; n++)
+		{
+			m_vecWaveHeaders[n].dwBufferLength = m_nBlockSamples * sizeof(short);
+			m_vecWaveHeaders[n].lpData = (LPSTR)(m_vecBlockMemory.data() + (n * m_nBlockSamples));
+		}
+		return true;
+	}
+
+	bool Submit(const short* pBlock, unsigned int nSamples) override
+	{
+		// Wait for block to become available
+		if (m_nBlockFree == 0)
+		{
+			std::unique_lock<std::mutex> lm(m_muxBlockNotZero);
+			while (m_nBlockFree == 0 && !m_bInterrupted) // sometimes, Windows signals incorrectly
+				m_cvBlockNotZero.wait(lm);
+		}
+		if (m_bInterrupted)
+			return false;
+
+		// Block is here, so use it
+		m_nBlockFree--;
+		WAVEHDR& header = m_vecWaveHeaders[m_nBlockCurrent];
+
+		// Prepare block for processing
+		if (header.dwFlags & WHDR_PREPARED)
+			waveOutUnprepareHeader(m_hwDevice, &header, sizeof(WAVEHDR));
+		std::memcpy(header.lpData, pBlock, sizeof(short) * (std::min)(nSamples, m_nBlockSamples));
+
+		// Send block to sound device
+		waveOutPrepareHeader(m_hwDevice, &header, sizeof(WAVEHDR));
+		waveOutWrite(m_hwDevice, &header, sizeof(WAVEHDR));
+		m_nBlockCurrent++;
+		m_nBlockCurrent %= m_nBlockCount;
+		return true;
+	}
+
+	void Interrupt() override
+	{
+		std::unique_lock<std::mutex> lm(m_muxBlockNotZero);
+		m_bInterrupted = true;
+		m_cvBlockNotZero.notify_all();
+	}
+
+	void Close() override
+	{
+		if (m_hwDevice == nullptr)
+			return;
+
+		waveOutReset(m_hwDevice);
+		for (auto& header : m_vecWaveHeaders)
+			if (header.dwFlags & WHDR_PREPARED)
+				waveOutUnprepareHeader(m_hwDevice, &header, sizeof(WAVEHDR));
+		waveOutClose(m_hwDevice);
+		m_hwDevice = nullptr;
+	}
+
+private:
+	// Handler for soundcard request for more data
+	void waveOutProc(HWAVEOUT hWaveOut, UINT uMsg, DWORD_PTR dwParam1, DWORD_PTR dwParam2)
+	{
+		if (uMsg != WOM_DONE) return;
+		m_nBlockFree++;
+		std::unique_lock<std::mutex> lm(m_muxBlockNotZero);
+		m_cvBlockNotZero.notify_one();
+	}
+
+	// Static wrapper for sound card handler
+	static void CALLBACK waveOutProcWrap(HWAVEOUT hWaveOut, UINT uMsg, DWORD_PTR dwInstance, DWORD_PTR dwParam1, DWORD_PTR dwParam2)
+	{
+		((olcWaveOutSink*)dwInstance)->waveOutProc(hWaveOut, uMsg, dwParam1, dwParam2);
+	}
+
+	unsigned int m_nBlockCount = 0;
+	unsigned int m_nBlockSamples = 0;
+	unsigned int m_nBlockCurrent = 0;
+	std::vector<short> m_vecBlockMemory;
+	std::vector<WAVEHDR> m_vecWaveHeaders;
+	HWAVEOUT m_hwDevice = nullptr;
+
+	std::atomic<unsigned int> m_nBlockFree{ 0 };
+	std::condition_variable m_cvBlockNotZero;
+	std::mutex m_muxBlockNotZero;
+	std::atomic<bool> m_bInterrupted{ false }; // Set under m_muxBlockNotZero, read outside it by Submit()
+};
+
+// Discards blocks, but keeps a running FNV-1a hash of everything it was given
+// so mixer output can be compared between runs without writing a file
+class olcNullAudioSink : public olcAudioSink
+{
+public:
+	bool Open(unsigned int nSampleRate, unsigned int nChannels, unsigned int nBlocks, unsigned int nBlockSamples) override
+	{
+		m_nHash = 14695981039346656037ull;
+		m_nSamples = 0;
+		return true;
+	}
+
+	bool Submit(const short* pBlock, unsigned int nSamples) override
+	{
+		const unsigned char* p = (const unsigned char*)pBlock;
+		for (size_t i = 0; i < nSamples * sizeof(short); i++)
+			m_nHash = (m_nHash ^ p[i]) * 1099511628211ull;
+		m_nSamples += nSamples;
+		return true;
+	}
+
+	unsigned long long Hash() const { return m_nHash; }
+	unsigned long long Samples() const { return m_nSamples; }
+
+private:
+	unsigned long long m_nHash = 14695981039346656037ull;
+	unsigned long long m_nSamples = 0;
+};
+
+// Writes blocks to a 16-bit PCM WAVE file
+class olcWavFileSink : public olcAudioSink
+{
+public:
+	olcWavFileSink(std::wstring sFile)
+	{
+		m_sFile = sFile;
+	}
+
+	~olcWavFileSink()
+	{
+		Close();
+	}
+
+	bool Open(unsigned int nSampleRate, unsigned int nChannels, unsigned int nBlocks, unsigned int nBlockSamples) override
+	{
+		_wfopen_s(&m_pFile, m_sFile.c_str(), L"wb");
+		if (m_pFile == nullptr)
+			return false;
+
+		// Sizes are patched in Close() once we know them
+		WAVEFORMATEX waveFormat;
+		waveFormat.wFormatTag = WAVE_FORMAT_PCM;
+		waveFormat.nSamplesPerSec = nSampleRate;
+		waveFormat.wBitsPerSample = sizeof(short) * 8;
+		waveFormat.nChannels = nChannels;
+		waveFormat.nBlockAlign = (waveFormat.wBitsPerSample / 8) * waveFormat.nChannels;
+		waveFormat.nAvgBytesPerSec = waveFormat.nSamplesPerSec * waveFormat.nBlockAlign;
+
+		DWORD nSize = 0, nFormatSize = 16; // PCM fmt chunk has no cbSize
+		std::fwrite("RIFF", 1, 4, m_pFile);
+		std::fwrite(&nSize, sizeof(DWORD), 1, m_pFile);
+		std::fwrite("WAVEfmt ", 1, 8, m_pFile);
+		std::fwrite(&nFormatSize, sizeof(DWORD), 1, m_pFile);
+		std::fwrite(&waveFormat, nFormatSize, 1, m_pFile);
+		std::fwrite("data", 1, 4, m_pFile);
+		std::fwrite(&nSize, sizeof(DWORD), 1, m_pFile);
+		m_nDataBytes = 0;
+		return true;
+	}
+
+	bool Submit(const short* pBlock, unsigned int nSamples) override
+	{
+		if (m_pFile == nullptr)
+			return false;
+		m_nDataBytes += (DWORD)(std::fwrite(pBlock, sizeof(short), nSamples, m_pFile) * sizeof(short));
+		return true;
+	}
+
+	void Close() override
+	{
+		if (m_pFile == nullptr)
+			return;
+
+		DWORD nRiffSize = m_nDataBytes + 36;
+		std::fseek(m_pFile, 4, SEEK_SET);
+		std::fwrite(&nRiffSize, sizeof(DWORD), 1, m_pFile);
+		std::fseek(m_pFile, 40, SEEK_SET);
+		std::fwrite(&m_nDataBytes, sizeof(DWORD), 1, m_pFile);
+		std::fclose(m_pFile);
+		m_pFile = nullptr;
+	}
+
+private:
+	std::wstring m_sFile;
+	FILE* m_pFile = nullptr;
+	DWORD m_nDataBytes = 0;
+};
+
+// ANSI Presenter =============================================================
+//
+// Encodes the screen buffer as ANSI/VT escape sequences with 24-bit colour, so
+// the game can be played in any modern terminal, including over SSH. Two rows
+// of the screen buffer share one terminal cell by drawing an upper half block
+// with the top pixel as foreground and the bottom pixel as background. Shade
+// glyphs are blended towards the background colour, since a half block can't
+// show them.
+//
+// Each frame only the terminal cells that changed since the previous frame are
+// sent. Colour codes are only emitted when they change, runs of identical cells
+// are sent once and repeated (REP), and the cursor is moved relatively along a
+// row and absolutely between rows. The whole frame goes out in one write from a
+// buffer sized up front for the worst case.
+
+class olcAnsiPresenter
+{
+public:
+	olcAnsiPresenter()
+	{
+		// Legacy console palette
+		static const uint32_t palette[16] =
+		{
+			0x000000, 0x000080, 0x008000, 0x008080, 0x800000, 0x800080, 0x808000, 0xC0C0C0,
+			0x808080, 0x0000FF, 0x00FF00, 0x00FFFF, 0xFF0000, 0xFF00FF, 0xFFFF00, 0xFFFFFF,
+		};
+
+		// Precompute the colour of every attribute for each kind of glyph
+		static const int coverage[SHADE_COUNT] = { 0, 64, 128, 192, 256 };
+		for (int a = 0; a < 256; a++)
+			for (int s = 0; s < SHADE_COUNT; s++)
+			{
+				uint32_t fg = palette[a & 0x0F], bg = palette[a >> 4], rgb = 0;
+				for (int shift = 0; shift < 24; shift += 8)
+				{
+					uint32_t f = (fg >> shift) & 0xFF, b = (bg >> shift) & 0xFF;
+					rgb |= ((f * coverage[s] + b * (256 - coverage[s])) >> 8) << shift;
+				}
+				m_nColour[a][s] = rgb;
+			}
+	}
+
+	// Size the presenter for a screen buffer. Everything it needs per frame is
+	// allocated here
+	void Resize(int nWidth, int nHeight)
+	{
+		m_nWidth = nWidth;
+		m_nHeight = nHeight;
+		m_nRows = (nHeight + 1) / 2;
+		m_vecCells.assign(m_nWidth * m_nRows, 0);
+		m_vecPrevious.assign(m_nWidth * m_nRows, 0);
+
+		// Worst case per cell is a cursor move, both colours and a 3 byte glyph
+		m_vecOutput.resize(m_nWidth * m_nRows * 64 + 64);
+		Invalidate();
+	}
+
+	// Redraw everything next frame, e.g. after the terminal was cleared
+	void Invalidate()
+	{
+		m_bInvalid = true;
+	}
+
+	// REP isn't understood by every terminal; turn it off if runs show up as
+	// single cells followed by garbage
+	void SetRunLength(bool bEnable)
+	{
+		m_bRunLength = bEnable;
+	}
+
+	// Encode a frame and write it to hOut in a single call
+	bool Present(HANDLE hOut, const CHAR_INFO* pBuffer)
+	{
+		unsigned int nBytes = Encode(pBuffer);
+		DWORD nWritten = 0;
+		return nBytes == 0 || (WriteFile(hOut, m_vecOutput.data(), nBytes, &nWritten, nullptr) && nWritten == nBytes);
+	}
+
+	// Encode a frame into the output buffer and return its length
+	unsigned int Encode(const CHAR_INFO* pBuffer)
+	{
+		auto tp1 = std::chrono::steady_clock::now();
+
+		// Resolve each terminal cell to its pair of colours
+		for (int row = 0; row < m_nRows; row++)
+		{
+			const CHAR_INFO* pTop = pBuffer + (row * 2) * m_nWidth;
+			const CHAR_INFO* pBottom = (row * 2 + 1 < m_nHeight) ? pTop + m_nWidth : pTop;
+			uint64_t* pCell = m_vecCells.data() + row * m_nWidth;
+			for (int x = 0; x < m_nWidth; x++)
+				pCell[x] = ((uint64_t)CellColour(pTop[x]) << 32) | CellColour(pBottom[x]);
+		}
+
+		char* p = m_vecOutput.data();
+		if (m_bInvalid)
+		{
+			// Hide the cursor, reset colours and clear the screen. The colour state
+			// is unknown until we set it, which no real colour can match
+			p = Put(p, "\x1b[?25l\x1b[0m\x1b[2J");
+			m_nFg = m_nBg = UNKNOWN;
+		}
+
+		for (int row = 0; row < m_nRows; row++)
+		{
+			const uint64_t* pCell = m_vecCells.data() + row * m_nWidth;
+			const uint64_t* pPrev = m_vecPrevious.data() + row * m_nWidth;
+			int nCursor = -1; // column the cursor is known to be at on this row
+
+			for (int x = 0; x < m_nWidth;)
+			{
+				if (!m_bInvalid && pCell[x] == pPrev[x])
+				{
+					x++;
+					continue;
+				}
+
+				// Get the cursor here
+				if (nCursor < 0)
+				{
+					p = Put(p, "\x1b[");
+					p = PutNumber(p, row + 1);
+					*p++ = ';';
+					p = PutNumber(p, x + 1);
+					*p++ = 'H';
+				}
+				else if (nCursor < x)
+				{
+					p = Put(p, "\x1b[");
+					p = PutNumber(p, x - nCursor);
+					*p++ = 'C';
+				}
+
+				// Find how far this cell repeats. Unchanged cells are cheaper to
+				// repeat over than to skip, so they join the run
+				int nRun = 1;
+				if (m_bRunLength)
+					while (x + nRun < m_nWidth && pCell[x + nRun] == pCell[x])
+						nRun++;
+
+				p = PutCell(p, pCell[x]);
+				if (nRun > 1)
+				{
+					p = Put(p, "\x1b[");
+					p = PutNumber(p, nRun - 1);
+					*p++ = 'b';
+				}
+
+				x += nRun;
+
+				// Writing the last column leaves the cursor in a pending wrap state
+				// that terminals disagree about, so forget where it is
+				nCursor = (x < m_nWidth) ? x : -1;
+			}
+		}
+
+		m_vecPrevious.swap(m_vecCells);
+		m_bInvalid = false;
+
+		m_nLastBytes = (unsigned int)(p - m_vecOutput.data());
+		m_fLastEncodeTime = std::chrono::duration<float>(std::chrono::steady_clock::now() - tp1).count();
+		m_nFrames++;
+		m_nTotalBytes += m_nLastBytes;
+		m_fTotalEncodeTime += m_fLastEncodeTime;
+		return m_nLastBytes;
+	}
+
+	// Restore the terminal to a usable state
+	bool Restore(HANDLE hOut)
+	{
+		const char* s = "\x1b[0m\x1b[2J\x1b[H\x1b[?25h";
+		DWORD nWritten = 0;
+		Invalidate();
+		return WriteFile(hOut, s, (DWORD)strlen(s), &nWritten, nullptr) != 0;
+	}
+
+	const char* Output() const { return m_vecOutput.data(); }
+
+	// Per-frame statistics, to judge whether a link can keep up
+	unsigned int LastBytes() const { return m_nLastBytes; }
+	float LastEncodeTime() const { return m_fLastEncodeTime; }
+	unsigned long long Frames() const { return m_nFrames; }
+	unsigned long long TotalBytes() const { return m_nTotalBytes; }
+	double TotalEncodeTime() const { return m_fTotalEncodeTime; }
+
+private:
+	enum { SHADE_NONE, SHADE_QUARTER, SHADE_HALF, SHADE_THREEQUARTERS, SHADE_SOLID, SHADE_COUNT };
+	static const uint32_t UNKNOWN = 0xFFFFFFFF;
+
+	uint32_t CellColour(const CHAR_INFO& c) const
+	{
+		int s;
+		switch (c.Char.UnicodeChar)
+		{
+		case 0: case L' ': s = SHADE_NONE; break;
+		case PIXEL_QUARTER: s = SHADE_QUARTER; break;
+		case PIXEL_HALF: s = SHADE_HALF; break;
+		case PIXEL_THREEQUARTERS: s = SHADE_THREEQUARTERS; break;
+		default: s = SHADE_SOLID; break; // Solid blocks, and text, which can't be shown
+		}
+		return m_nColour[c.Attributes & 0xFF][s];
+	}
+
+	// Emit the cell with whichever glyph needs the fewest colour changes
+	char* PutCell(char* p, uint64_t nCell)
+	{
+		uint32_t nTop = (uint32_t)(nCell >> 32), nBottom = (uint32_t)nCell;
+
+		if (nTop == nBottom)
+		{
+			if (nTop == m_nBg)
+				*p++ = ' ';
+			else if (nTop == m_nFg)
+				p = Put(p, "\xe2\x96\x88"); // Full block
+			else
+			{
+				p = PutColours(p, m_nFg, nTop);
+				*p++ = ' ';
+			}
+			return p;
+		}
+
+		// Upper half block, or lower half block with the colours swapped
+		int nUpperChanges = (nTop != m_nFg) + (nBottom != m_nBg);
+		int nLowerChanges = (nBottom != m_nFg) + (nTop != m_nBg);
+		if (nUpperChanges <= nLowerChanges)
+		{
+			p = PutColours(p, nTop, nBottom);
+			return Put(p, "\xe2\x96\x80");
+		}
+		else
+		{
+			p = PutColours(p, nBottom, nTop);
+			return Put(p, "\xe2\x96\x84");
+		}
+	}
+
+	char* PutColours(char* p, uint32_t nFg, uint32_t nBg)
+	{
+		bool bFg = nFg != m_nFg, bBg = nBg != m_nBg;
+		if (!bFg && !bBg)
+			return p;
+
+		p = Put(p, "\x1b[");
+		if (bFg)
+			p = PutRGB(Put(p, "38;2;"), nFg);
+		if (bFg && bBg)
+			*p++ = ';';
+		if (bBg)
+			p = PutRGB(Put(p, "48;2;"), nBg);
+		*p++ = 'm';
+
+		m_nFg = nFg;
+		m_nBg = nBg;
+		return p;
+	}
+
+	static char* PutRGB(char* p, uint32_t rgb)
+	{
+		p = PutNumber(p, (rgb >> 16) & 0xFF);
+		*p++ = ';';
+		p = PutNumber(p, (rgb >> 8) & 0xFF);
+		*p++ = ';';
+		return PutNumber(p, rgb & 0xFF);
+	}
+
+	static char* PutNumber(char* p, unsigned int n)
+	{
+		char digits[10];
+		int i = 0;
+		do { digits[i++] = (char)('0' + n % 10); n /= 10; } while (n);
+		while (i)
+			*p++ = digits[--i];
+		return p;
+	}
+
+	static char* Put(char* p, const char* s)
+	{
+		while (*s)
+			*p++ = *s++;
+		return p;
+	}
+
+	int m_nWidth = 0;
+	int m_nHeight = 0;
+	int m_nRows = 0;
+	uint32_t m_nColour[256][SHADE_COUNT];
+	std::vector<uint64_t> m_vecCells;
+	std::vector<uint64_t> m_vecPrevious;
+	std::vector<char> m_vecOutput;
+	bool m_bInvalid = true;
+	bool m_bRunLength = true;
+	uint32_t m_nFg = UNKNOWN;
+	uint32_t m_nBg = UNKNOWN;
+
+	unsigned int m_nLastBytes = 0;
+	float m_fLastEncodeTime = 0.0f;
+	unsigned long long m_nFrames = 0;
+	unsigned long long m_nTotalBytes = 0;
+	double m_fTotalEncodeTime = 0.0;
+};
+
+// Input Recording ============================================================
+//
+// Records everything the game thread feeds a frame - the elapsed time, held
+// keys, mouse buttons, mouse position and focus - so a session can be replayed
+// exactly, without a console and as fast as the machine will go. See
+// olcConsoleGameEngine::EnableInputRecording() and RunReplay().
+//
+// File layout: "OLCI", version, screen width and height (4 bytes each), then a
+// record per frame. Each record is a flags byte, the elapsed time as a float,
+// and then only the parts of the input that changed since the previous frame:
+// 32 bytes of key bits, a byte of mouse buttons, two shorts of mouse position.
+// A frame where nothing changed costs 5 bytes.
+
+class olcInputRecording
+{
+public:
+	struct sInputFrame
+	{
+		float fElapsedTime = 0.0f;
+		uint8_t nKeys[32] = { 0 }; // One bit per virtual key, set while held
+		uint8_t nMouse = 0;        // One bit per mouse button
+		short nMouseX = 0;
+		short nMouseY = 0;
+		bool bFocus = true;
+
+		bool Key(int i) const { return (nKeys[i >> 3] >> (i & 7)) & 1; }
+		void SetKey(int i, bool b) { if (b) nKeys[i >> 3] |= 1 << (i & 7); else nKeys[i >> 3] &= ~(1 << (i & 7)); }
+	};
+
+	~olcInputRecording()
+	{
+		Close();
+	}
+
+	bool OpenWrite(const std::wstring& sFile, int width, int height)
+	{
+		Close();
+		_wfopen_s(&m_pFile, sFile.c_str(), L"wb");
+		if (m_pFile == nullptr)
+			return false;
+
+		int32_t header[3] = { VERSION, width, height };
+		std::fwrite("OLCI", 1, 4, m_pFile);
+		std::fwrite(header, sizeof(int32_t), 3, m_pFile);
+		m_last = sInputFrame();
+		nWidth = width;
+		nHeight = height;
+		return true;
+	}
+
+	bool OpenRead(const std::wstring& sFile)
+	{
+		Close();
+		_wfopen_s(&m_pFile, sFile.c_str(), L"rb");
+		if (m_pFile == nullptr)
+			return false;
+
+		char magic[4];
+		int32_t header[3];
+		if (std::fread(magic, 1, 4, m_pFile) != 4 || std::memcmp(magic, "OLCI", 4) != 0 ||
+			std::fread(header, sizeof(int32_t), 3, m_pFile) != 3 || header[0] != VERSION)
+		{
+			Close();
+			return false;
+		}
+
+		nWidth = header[1];
+		nHeight = header[2];
+		m_last = sInputFrame();
+		return true;
+	}
+
+	void Write(const sInputFrame& frame)
+	{
+		uint8_t nFlags = frame.bFocus ? FOCUS : 0;
+		if (std::memcmp(frame.nKeys, m_last.nKeys, sizeof(frame.nKeys)) != 0) nFlags |= KEYS;
+		if (frame.nMouse != m_last.nMouse) nFlags |= MOUSE;
+		if (frame.nMouseX != m_last.nMouseX || frame.nMouseY != m_last.nMouseY) nFlags |= MOUSE_POS;
+
+		std::fwrite(&nFlags, 1, 1, m_pFile);
+		std::fwrite(&frame.fElapsedTime, sizeof(float), 1, m_pFile);
+		if (nFlags & KEYS) std::fwrite(frame.nKeys, 1, sizeof(frame.nKeys), m_pFile);
+		if (nFlags & MOUSE) std::fwrite(&frame.nMouse, 1, 1, m_pFile);
+		if (nFlags & MOUSE_POS) { std::fwrite(&frame.nMouseX, sizeof(short), 1, m_pFile); std::fwrite(&frame.nMouseY, sizeof(short), 1, m_pFile); }
+		m_last = frame;
+	}
+
+	// Returns false at the end of the recording
+	bool Read(sInputFrame& frame)
+	{
+		uint8_t nFlags;
+		if (m_pFile == nullptr || std::fread(&nFlags, 1, 1, m_pFile) != 1)
+			return false;
+
+		bool bOk = std::fread(&m_last.fElapsedTime, sizeof(float), 1, m_pFile) == 1;
+		if (nFlags & KEYS) bOk &= std::fread(m_last.nKeys, 1, sizeof(m_last.nKeys), m_pFile) == sizeof(m_last.nKeys);
+		if (nFlags & MOUSE) bOk &= std::fread(&m_last.nMouse, 1, 1, m_pFile) == 1;
+		if (nFlags & MOUSE_POS) bOk &= std::fread(&m_last.nMouseX, sizeof(short), 1, m_pFile) == 1 && std::fread(&m_last.nMouseY, sizeof(short), 1, m_pFile) == 1;
+		m_last.bFocus = (nFlags & FOCUS) != 0;
+		frame = m_last;
+		return bOk;
+	}
+
+	void Close()
+	{
+		if (m_pFile != nullptr)
+			std::fclose(m_pFile);
+		m_pFile = nullptr;
+	}
+
+	bool IsOpen() const { return m_pFile != nullptr; }
+
+	// Screen size the recording was made at
+	int nWidth = 0;
+	int nHeight = 0;
+
+private:
+	static const int32_t VERSION = 1;
+	enum { KEYS = 1, MOUSE = 2, MOUSE_POS = 4, FOCUS = 8 };
+
+	FILE* m_pFile = nullptr;
+	sInputFrame m_last;
+};
+
+// Job System =================================================================
+//
+// A small work-stealing thread pool. Each thread, including the one that calls
+// ParallelFor(), owns a queue of jobs. A thread works from the back of its own
+// queue, and when that runs dry it steals from the front of the others', so
+// uneven chunks even themselves out. The calling thread helps until its loop
+// is done, so ParallelFor() can also be called from inside a job.
+//
+// ParallelFor() hands each chunk an index. Give every chunk its own output
+// buffer and concatenate them in chunk order afterwards: no locks are needed
+// while writing, and the result comes out in the same order as a serial loop
+// no matter which thread ran what.
+
+class olcJobSystem
+{
+public:
+	// nWorkers extra threads are started; by default one per core, less the
+	// calling thread
+	olcJobSystem(unsigned int nWorkers = (std::max)(1u, std::thread::hardware_concurrency()) - 1)
+	{
+		m_vecQueues.resize(nWorkers + 1);
+		for (auto& q : m_vecQueues)
+			q.reset(new sQueue());
+		for (unsigned int i = 1; i <= nWorkers; i++)
+			m_vecWorkers.push_back(std::thread(&olcJobSystem::WorkerThread, this, i));
+	}
+
+	~olcJobSystem()
+	{
+		{
+			std::unique_lock<std::mutex> lm(m_muxWake);
+			m_bRunning = false;
+			m_cvWake.notify_all();
+		}
+		for (auto& t : m_vecWorkers)
+			t.join();
+	}
+
+	olcJobSystem(const olcJobSystem&) = delete;
+	olcJobSystem& operator=(const olcJobSystem&) = delete;
+
+	// Threads that run jobs, including the caller
+	unsigned int ThreadCount() const { return (unsigned int)m_vecQueues.size(); }
+
+	static size_t ChunkCount(size_t nCount, size_t nGrain)
+	{
+		return (nCount + nGrain - 1) / nGrain;
+	}
+
+	// Call func(nChunk, nBegin, nEnd) for each run of up to nGrain items in
+	// [0, nCount), spread over the pool, and return when all of them are done.
+	// Chunk n covers [n * nGrain, (n + 1) * nGrain)
+	template<typename F>
+	void ParallelFor(size_t nCount, size_t nGrain, F&& func)
+	{
+		size_t nChunks = ChunkCount(nCount, nGrain);
+		if (nChunks <= 1 || m_vecQueues.size() == 1)
+		{
+			for (size_t c = 0; c < nChunks; c++)
+				func(c, c * nGrain, (std::min)(nCount, (c + 1) * nGrain));
+			return;
+		}
+
+		sLoop<F> loop(func, nCount, nGrain, nChunks);
+
+		// Deal the chunks out round-robin, starting with our own queue
+		unsigned int nSelf = ThreadIndex();
+		m_nQueued += (int)nChunks;
+		for (size_t c = 0; c < nChunks; c++)
+		{
+			sQueue& q = *m_vecQueues[(nSelf + c) % m_vecQueues.size()];
+			std::unique_lock<std::mutex> lm(q.mux);
+			q.jobs.push_back({ &sLoop<F>::Run, &loop, c });
+		}
+		{
+			std::unique_lock<std::mutex> lm(m_muxWake);
+			m_cvWake.notify_all();
+		}
+
+		// Help out until our loop is finished
+		while (loop.nRemaining > 0)
+		{
+			sJob job;
+			if (TryGetJob(nSelf, job))
+				job.pRun(job.pLoop, job.nChunk);
+			else
+				std::this_thread::yield();
+		}
+	}
+
+private:
+	struct sJob
+	{
+		void(*pRun)(void*, size_t);
+		void* pLoop;
+		size_t nChunk;
+	};
+
+	struct sQueue
+	{
+		std::mutex mux;
+		std::deque<sJob> jobs;
+	};
+
+	template<typename F>
+	struct sLoop
+	{
+		sLoop(F& f, size_t count, size_t grain, size_t chunks) : func(f), nCount(count), nGrain(grain), nRemaining(chunks) {}
+
+		static void Run(void* p, size_t nChunk)
+		{
+			sLoop& loop = *(sLoop*)p;
+			loop.func(nChunk, nChunk * loop.nGrain, (std::min)(loop.nCount, (nChunk + 1) * loop.nGrain));
+			loop.nRemaining--;
+		}
+
+		F& func;
+		size_t nCount;
+		size_t nGrain;
+		std::atomic<size_t> nRemaining;
+	};
+
+	struct sThreadSlot
+	{
+		const olcJobSystem* pPool;
+		unsigned int nIndex;
+	};
+
+	static sThreadSlot& ThreadSlot()
+	{
+		thread_local sThreadSlot slot = { nullptr, 0 };
+		return slot;
+	}
+
+	// Which queue belongs to the current thread. Threads outside the pool
+	// share queue 0
+	unsigned int ThreadIndex() const
+	{
+		return ThreadSlot().pPool == this ? ThreadSlot().nIndex : 0;
+	}
+
+	bool TryGetJob(unsigned int nSelf, sJob& job)
+	{
+		if (m_nQueued <= 0)
+			return false;
+
+		// Newest job from our own queue, it's the most likely to be in cache
+		{
+			sQueue& q = *m_vecQueues[nSelf];
+			std::unique_lock<std::mutex> lm(q.mux);
+			if (!q.jobs.empty())
+			{
+				job = q.jobs.back();
+				q.jobs.pop_back();
+				m_nQueued--;
+				return true;
+			}
+		}
+
+		// Otherwise steal the oldest job from someone else
+		for (size_t i = 1; i < m_vecQueues.size(); i++)
+		{
+			sQueue& q = *m_vecQueues[(nSelf + i) % m_vecQueues.size()];
+			std::unique_lock<std::mutex> lm(q.mux);
+			if (!q.jobs.empty())
+			{
+				job = q.jobs.front();
+				q.jobs.pop_front();
+				m_nQueued--;
+				return true;
+			}
+		}
+		return false;
+	}
+
+	void WorkerThread(unsigned int nIndex)
+	{
+		ThreadSlot() = { this, nIndex };
+		while (m_bRunning)
+		{
+			sJob job;
+			if (TryGetJob(nIndex, job))
+			{
+				job.pRun(job.pLoop, job.nChunk);
+				continue;
+			}
+
+			std::unique_lock<std::mutex> lm(m_muxWake);
+			m_cvWake.wait(lm, [&] { return !m_bRunning || m_nQueued > 0; });
+		}
+	}
+
+	std::vector<std::unique_ptr<sQueue>> m_vecQueues;
+	std::vector<std::thread> m_vecWorkers;
+	std::atomic<int> m_nQueued{ 0 };
+	std::atomic<bool> m_bRunning{ true };
+	std::condition_variable m_cvWake;
+	std::mutex m_muxWake;
+};
+
+// Pixel Pipelines ============================================================
+//
+// The raster primitives are templates over a "pipeline" - any object with
+//
+//		void operator()(int x, int y, float u, float v, float w)
+//
+// which is called once per covered cell. x and y are always on screen when the
+// rasterizer calls it, so pipelines write without checking. The engine's own
+// pipelines return bool instead, true if the cell was written, so that
+// EnableFillStats() can count what they reject. u, v and w are the
+// perspective-divided texture coordinates and 1/z interpolated across
+// triangles (zero for lines and circles). Triangles also call
+//
+//		void BeginSpan(float u, float v, float w, const float dx[3], const float dy[3], int nLength)
+//
+// before each scanline, with the (u, v, w) at its first cell, their steps per
+// cell in x and per row in y, and the span length. Texture sources use this to
+// pick a mip level once per span instead of once per cell.
+//
+// olcPixelPipeline builds a pipeline from four small stages, each chosen at
+// compile time, so every combination inlines into a single tight loop:
+//
+//		Depth  - olcDepthOff, olcDepthTest
+//		Source - olcSourceSolid, olcSourceTexture
+//		Blend  - olcBlendOpaque, olcBlendAlpha (space glyphs are see-through)
+//		Mask   - olcWriteAll, olcWriteGlyph, olcWriteColour
+
+struct olcDepthOff
+{
+	bool Test(int nIndex, float w) { return true; }
+};
+
+// Depth buffer holds 1/z, so larger is nearer. Passing pixels update it
+struct olcDepthTest
+{
+	float* pDepthBuffer;
+
+	bool Test(int nIndex, float w)
+	{
+		if (w <= pDepthBuffer[nIndex])
+			return false;
+		pDepthBuffer[nIndex] = w;
+		return true;
+	}
+};
+
+struct olcSourceSolid
+{
+	CHAR_INFO cell;
+
+	void BeginSpan(float u, float v, float w, const float dx[3], const float dy[3], int nLength) {}
+	CHAR_INFO Cell(float u, float v, float w) { return cell; }
+};
+
+// Samples a sprite, using its mip chain if GenerateMipmaps() has been called
+struct olcSourceTexture
+{
+	olcSprite* sprite;
+	int nLevel = 0;
+
+	void BeginSpan(float u, float v, float w, const float dx[3], const float dy[3], int nLength)
+	{
+		if (sprite->MipLevels() == 0)
+			return;
+
+		// Measure the texture footprint of one cell at the middle of the span,
+		// from the change in (u/w, v/w) to the next cell across and down
+		float fMid = 0.5f * (float)nLength;
+		u += dx[0] * fMid; v += dx[1] * fMid; w += dx[2] * fMid;
+		float s = u / w, t = v / w;
+		float sdx = (u + dx[0]) / (w + dx[2]) - s, tdx = (v + dx[1]) / (w + dx[2]) - t;
+		float sdy = (u + dy[0]) / (w + dy[2]) - s, tdy = (v + dy[1]) / (w + dy[2]) - t;
+		float fW = (float)sprite->nWidth, fH = (float)sprite->nHeight;
+		float fLenX = sqrtf(sdx * sdx * fW * fW + tdx * tdx * fH * fH);
+		float fLenY = sqrtf(sdy * sdy * fW * fW + tdy * tdy * fH * fH);
+		nLevel = sprite->MipLevelFor((std::max)(fLenX, fLenY));
+	}
+
+	CHAR_INFO Cell(float u, float v, float w) { return sprite->SampleLevel(u / w, v / w, nLevel); }
+};
+
+struct olcBlendOpaque
+{
+	bool Keep(const CHAR_INFO& src) { return true; }
+};
+
+struct olcBlendAlpha
+{
+	bool Keep(const CHAR_INFO& src) { return src.Char.UnicodeChar != L' '; }
+};
+
+struct olcWriteAll
+{
+	void Write(CHAR_INFO& dst, const CHAR_INFO& src) { dst = src; }
+};
+
+struct olcWriteGlyph
+{
+	void Write(CHAR_INFO& dst, const CHAR_INFO& src) { dst.Char.UnicodeChar = src.Char.UnicodeChar; }
+};
+
+struct olcWriteColour
+{
+	void Write(CHAR_INFO& dst, const CHAR_INFO& src) { dst.Attributes = src.Attributes; }
+};
+
+template<class Depth, class Source, class Blend = olcBlendOpaque, class Mask = olcWriteAll>
+struct olcPixelPipeline
+{
+	CHAR_INFO* pBuffer;
+	int nWidth;
+	Depth depth;
+	Source source;
+	Blend blend;
+	Mask mask;
+
+	void BeginSpan(float u, float v, float w, const float dx[3], const float dy[3], int nLength)
+	{
+		source.BeginSpan(u, v, w, dx, dy, nLength);
+	}
+
+	bool operator()(int x, int y, float u, float v, float w)
+	{
+		int nIndex = y * nWidth + x;
+		if (!depth.Test(nIndex, w))
+			return false;
+
+		CHAR_INFO src = source.Cell(u, v, w);
+		if (!blend.Keep(src))
+			return false;
+
+		mask.Write(pBuffer[nIndex], src);
+		return true;
+	}
+};
+
+template<class Depth, class Source, class Blend = olcBlendOpaque, class Mask = olcWriteAll>
+olcPixelPipeline<Depth, Source, Blend, Mask> olcMakePipeline(CHAR_INFO* pBuffer, int nWidth, Depth depth, Source source, Blend blend = Blend(), Mask mask = Mask())
+{
+	return { pBuffer, nWidth, depth, source, blend, mask };
+}
+
+// Fill Rate Statistics =======================================================
+//
+// Collected per frame while olcConsoleGameEngine::EnableFillStats() is on. Each
+// cell a primitive reaches is either shaded (written) or rejected (it failed
+// the depth test or was see-through). Shaded cells are also counted per cell,
+// so anything above 1 is overdraw, and can be drawn or saved as a heatmap.
+// Triangles are counted per tile of nTileSize x nTileSize cells their bounding
+// box touches. Clear() isn't counted, nor are Draw() and DrawString() called
+// directly.
+
+class olcFillStats
+{
+public:
+	int nWidth = 0;
+	int nHeight = 0;
+	int nTileSize = 8;
+	int nTilesX = 0;
+	int nTilesY = 0;
+	std::vector<uint32_t> vecWrites;		// Per cell
+	std::vector<uint32_t> vecTileTriangles;	// Per tile
+	uint64_t nShaded = 0;
+	uint64_t nRejected = 0;
+	uint64_t nTriangles = 0;
+
+	// Start a frame: zero everything, resizing to the screen if it changed
+	void Begin(int w, int h, int nTile)
+	{
+		if (w != nWidth || h != nHeight || nTile != nTileSize)
+		{
+			nWidth = w;
+			nHeight = h;
+			nTileSize = nTile;
+			nTilesX = (w + nTile - 1) / nTile;
+			nTilesY = (h + nTile - 1) / nTile;
+			vecWrites.assign(w * h, 0);
+			vecTileTriangles.assign(nTilesX * nTilesY, 0);
+		}
+		else
+		{
+			std::fill(vecWrites.begin(), vecWrites.end(), 0);
+			std::fill(vecTileTriangles.begin(), vecTileTriangles.end(), 0);
+		}
+		nShaded = nRejected = nTriangles = 0;
+	}
+
+	void Shade(int x, int y)
+	{
+		vecWrites[y * nWidth + x]++;
+		nShaded++;
+	}
+
+	void Reject()
+	{
+		nRejected++;
+	}
+
+	// A run of cells written in one go, x2 exclusive and already clipped
+	void ShadeSpan(int x1, int x2, int y)
+	{
+		for (int x = x1; x < x2; x++)
+			vecWrites[y * nWidth + x]++;
+		nShaded += x2 - x1;
+	}
+
+	// A triangle's bounding box, in cells
+	void AddTriangle(int x1, int y1, int x2, int y2)
+	{
+		nTriangles++;
+		int tx1 = (std::max)(x1, 0) / nTileSize, ty1 = (std::max)(y1, 0) / nTileSize;
+		int tx2 = (std::min)(x2, nWidth - 1), ty2 = (std::min)(y2, nHeight - 1);
+		if (tx2 < 0 || ty2 < 0)
+			return;
+		tx2 /= nTileSize;
+		ty2 /= nTileSize;
+		for (int ty = ty1; ty <= ty2; ty++)
+			for (int tx = tx1; tx <= tx2; tx++)
+				vecTileTriangles[ty * nTilesX + tx]++;
+	}
+
+	uint32_t CellsCovered() const
+	{
+		return (uint32_t)std::count_if(vecWrites.begin(), vecWrites.end(), [](uint32_t n) { return n > 0; });
+	}
+
+	uint32_t MaxWrites() const
+	{
+		return vecWrites.empty() ? 0 : *std::max_element(vecWrites.begin(), vecWrites.end());
+	}
+
+	uint32_t MaxTileTriangles() const
+	{
+		return vecTileTriangles.empty() ? 0 : *std::max_element(vecTileTriangles.begin(), vecTileTriangles.end());
+	}
+
+	// Average writes per covered cell, 1.0 means no overdraw
+	float Overdraw() const
+	{
+		uint32_t nCovered = CellsCovered();
+		return nCovered > 0 ? (float)nShaded / (float)nCovered : 0.0f;
+	}
+
+	// The heatmap runs black (never written), blue (once), green, yellow, red,
+	// then white for HEAT_LEVELS - 1 writes or more
+	static const int HEAT_LEVELS = 7;
+
+	static short HeatColour(uint32_t nWrites)
+	{
+		static const short colours[HEAT_LEVELS] = { FG_BLACK, FG_DARK_BLUE, FG_DARK_GREEN, FG_GREEN, FG_YELLOW, FG_RED, FG_WHITE };
+		return colours[(std::min)(nWrites, (uint32_t)HEAT_LEVELS - 1)];
+	}
+
+	// As a 24-bit BMP, one pixel per cell
+	bool SaveHeatmap(const std::wstring& sFile) const
+	{
+		static const unsigned char rgb[HEAT_LEVELS][3] = {
+			{ 0, 0, 0 }, { 0, 0, 160 }, { 0, 128, 0 }, { 0, 230, 0 }, { 240, 230, 0 }, { 230, 0, 0 }, { 255, 255, 255 } };
+
+		FILE* f = nullptr;
+		_wfopen_s(&f, sFile.c_str(), L"wb");
+		if (f == nullptr)
+			return false;
+
+		// Rows are stored bottom up, padded to 4 bytes
+		uint32_t nRowBytes = (nWidth * 3 + 3) & ~3u;
+		uint32_t nImageBytes = nRowBytes * nHeight;
+		auto Put16 = [&](uint16_t n) { unsigned char b[2] = { (unsigned char)n, (unsigned char)(n >> 8) }; std::fwrite(b, 1, 2, f); };
+		auto Put32 = [&](uint32_t n) { Put16((uint16_t)n); Put16((uint16_t)(n >> 16)); };
+
+		std::fwrite("BM", 1, 2, f);
+		Put32(54 + nImageBytes); Put32(0); Put32(54);
+		Put32(40); Put32(nWidth); Put32(nHeight); Put16(1); Put16(24);
+		Put32(0); Put32(nImageBytes); Put32(2835); Put32(2835); Put32(0); Put32(0);
+
+		std::vector<unsigned char> vecRow(nRowBytes, 0);
+		for (int y = nHeight - 1; y >= 0; y--)
+		{
+			for (int x = 0; x < nWidth; x++)
+			{
+				const unsigned char* c = rgb[(std::min)(vecWrites[y * nWidth + x], (uint32_t)HEAT_LEVELS - 1)];
+				vecRow[x * 3 + 0] = c[2];
+				vecRow[x * 3 + 1] = c[1];
+				vecRow[x * 3 + 2] = c[0];
+			}
+			std::fwrite(vecRow.data(), 1, nRowBytes, f);
+		}
+
+		std::fclose(f);
+		return true;
+	}
+};
+
+// Wraps one of the engine's pipelines to count into olcFillStats
+template<class Pipeline>
+struct olcFillStatsPipeline
+{
+	Pipeline& pipeline;
+	olcFillStats& stats;
+
+	void BeginSpan(float u, float v, float w, const float dx[3], const float dy[3], int nLength)
+	{
+		pipeline.BeginSpan(u, v, w, dx, dy, nLength);
+	}
+
+	bool operator()(int x, int y, float u, float v, float w)
+	{
+		if (!pipeline(x, y, u, v, w))
+		{
+			stats.Reject();
+			return false;
+		}
+		stats.Shade(x, y);
+		return true;
+	}
+};
+
+class olcConsoleGameEngine
+{
+public:
+	olcConsoleGameEngine()
+	{
+		m_nScreenWidth = 80;
+		m_nScreenHeight = 30;
+		ResetClipRect();
+
+		m_hConsole = GetStdHandle(STD_OUTPUT_HANDLE);
+		m_hConsoleIn = GetStdHandle(STD_INPUT_HANDLE);
+
+		std::memset(m_keyNewState, 0, 256 * sizeof(short));
+		std::memset(m_keyOldState, 0, 256 * sizeof(short));
+		std::memset(m_keys, 0, 256 * sizeof(sKeyState));
+		m_mousePosX = 0;
+		m_mousePosY = 0;
+
+		m_bEnableSound = false;
+
+		m_sAppName = L"Default";
+	}
+
+	void EnableSound()
+	{
+		m_bEnableSound = true;
+	}
+
+	// Present frames as ANSI escape sequences written to standard output instead
+	// of through the console API, so the game runs in a VT terminal or over SSH.
+	// Call in your constructor
+	void EnableAnsiOutput()
+	{
+		m_bAnsiOutput = true;
+	}
+
+	// Record the input of every frame to sFile, for RunReplay(). If fFixedTimeStep
+	// is non-zero, frames are updated with that instead of the wall clock, so the
+	// recording doesn't depend on how fast this machine happened to run it.
+	// Call in your constructor
+	void EnableInputRecording(const std::wstring& sFile, float fFixedTimeStep = 0.0f)
+	{
+		m_sInputRecordingFile = sFile;
+		m_fFixedTimeStep = fFixedTimeStep;
+	}
+
+	// By default every drawing routine writes through the virtual Draw(), one
+	// cell at a time, so an override sees everything. If you don't override
+	// Draw(), call this in your constructor and they write to the screen buffer
+	// directly through inlined pixel pipelines instead, which is much faster.
+	void EnableDirectDraw()
+	{
+		m_bDrawHook = false;
+	}
+
+	// Go back to writing through Draw(), for a subclass whose base class
+	// called EnableDirectDraw()
+	void EnableDrawHook()
+	{
+		m_bDrawHook = true;
+	}
+
+	// Count every cell the drawing routines shade or reject, and the triangles
+	// drawn per tile, into FillStats(). They're zeroed at the start of each
+	// frame. Counting costs a little per cell, so leave it off unless looking.
+	void EnableFillStats(bool bEnable = true, int nTileSize = 8)
+	{
+		m_bFillStats = bEnable;
+		m_nFillStatsTileSize = nTileSize;
+		if (bEnable && m_bufScreen != nullptr)
+			m_fillStats.Begin(m_nScreenWidth, m_nScreenHeight, nTileSize);
+	}
+
+	const olcFillStats& FillStats() const
+	{
+		return m_fillStats;
+	}
+
+	// Confine drawing to the cells from (x1, y1) up to but not including
+	// (x2, y2), for viewports. Everything but DrawString() and
+	// DrawFillHeatmap() clips to it, Clear() included
+	void SetClipRect(int x1, int y1, int x2, int y2)
+	{
+		m_nClipLeft = (std::max)(x1, 0);
+		m_nClipTop = (std::max)(y1, 0);
+		m_nClipRight = (std::max)(m_nClipLeft, (std::min)(x2, m_nScreenWidth));
+		m_nClipBottom = (std::max)(m_nClipTop, (std::min)(y2, m_nScreenHeight));
+	}
+
+	void ResetClipRect()
+	{
+		SetClipRect(0, 0, m_nScreenWidth, m_nScreenHeight);
+	}
+
+	// Send all drawing to a sprite instead of the screen, until
+	// SetDrawTarget(nullptr). Meanwhile ScreenWidth() and ScreenHeight() are the
+	// sprite's, the clip rect covers it, and EnableFillStats() counts nothing.
+	// The screen is made the target again at the end of every frame
+	void SetDrawTarget(olcSprite* target)
+	{
+		if (target == m_pDrawTarget)
+			return;
+
+		if (m_pDrawTarget == nullptr)
+		{
+			m_bufDisplay = m_bufScreen;
+			m_nDisplayWidth = m_nScreenWidth;
+			m_nDisplayHeight = m_nScreenHeight;
+			m_bDisplayFillStats = m_bFillStats;
+		}
+
+		if (target != nullptr)
+		{
+			m_bufScreen = target->m_Cells;
+			m_nScreenWidth = target->nWidth;
+			m_nScreenHeight = target->nHeight;
+			m_bFillStats = false;
+			target->m_vecMips.clear();
+		}
+		else
+		{
+			m_bufScreen = m_bufDisplay;
+			m_nScreenWidth = m_nDisplayWidth;
+			m_nScreenHeight = m_nDisplayHeight;
+			m_bFillStats = m_bDisplayFillStats;
+		}
+		m_pDrawTarget = target;
+		ResetClipRect();
+	}
+
+	olcSprite* GetDrawTarget() const
+	{
+		return m_pDrawTarget;
+	}
+
+	// Replace the screen with the heatmap of this frame's writes so far
+	void DrawFillHeatmap()
+	{
+		if (m_fillStats.vecWrites.size() != (size_t)(m_nScreenWidth * m_nScreenHeight))
+			return;
+		for (int i = 0; i < m_nScreenWidth * m_nScreenHeight; i++)
+			m_bufScreen[i] = MakeCell(PIXEL_SOLID, olcFillStats::HeatColour(m_fillStats.vecWrites[i]));
+	}
+
+	int ConstructConsole(int width, int height, int fontw, int fonth)
+	{
+		if (m_hConsole == INVALID_HANDLE_VALUE)
+			return Error(L"Bad Handle");
+
+		m_nScreenWidth = width;
+		m_nScreenHeight = height;
+		ResetClipRect();
+
+		// Update 13/09/2017 - It seems that the console behaves differently on some systems
+		// and I'm unsure why this is. It could be to do with windows default settings, or
+		// screen resolutions, or system languages. Unfortunately, MSDN does not offer much
+		// by way of useful information, and so the resulting sequence is the reult of experiment
+		// that seems to work in multiple cases.
+		//
+		// The problem seems to be that the SetConsoleXXX functions are somewhat circular and 
+		// fail depending on the state of the current console properties, i.e. you can't set
+		// the buffer size until you set the screen size, but you can't change the screen size
+		// until the buffer size is correct. This coupled with a precise ordering of calls
+		// makes this procedure seem a little mystical :-P. Thanks to wowLinh for helping - Jx9
+
+		// Change console visual size to a minimum so ScreenBuffer can shrink
+		// below the actual visual size
+		m_rectWindow = { 0, 0, 1, 1 };
+		SetConsoleWindowInfo(m_hConsole, TRUE, &m_rectWindow);
+
+		// Set the size of the screen buffer
+		COORD coord = { (short)m_nScreenWidth, (short)m_nScreenHeight };
+		if (!SetConsoleScreenBufferSize(m_hConsole, coord))
+			Error(L"SetConsoleScreenBufferSize");
+
+		// Assign screen buffer to the console
+		if (!SetConsoleActiveScreenBuffer(m_hConsole))
+			return Error(L"SetConsoleActiveScreenBuffer");
+
+		// Set the font size now that the screen buffer has been assigned to the console
+		CONSOLE_FONT_INFOEX cfi;
+		cfi.cbSize = sizeof(cfi);
+		cfi.nFont = 0;
+		cfi.dwFontSize.X = fontw;
+		cfi.dwFontSize.Y = fonth;
+		cfi.FontFamily = FF_DONTCARE;
+		cfi.FontWeight = FW_NORMAL;
+
+		/*	DWORD version = GetVersion();
+			DWORD major = (DWORD)(LOBYTE(LOWORD(version)));
+			DWORD minor = (DWORD)(HIBYTE(LOWORD(version)));*/
+
+			//if ((major > 6) || ((major == 6) && (minor >= 2) && (minor < 4)))		
+			//	wcscpy_s(cfi.FaceName, L"Raster"); // Windows 8 :(
+			//else
+			//	wcscpy_s(cfi.FaceName, L"Lucida Console"); // Everything else :P
+
+			//wcscpy_s(cfi.FaceName, L"Liberation Mono");
+		wcscpy_s(cfi.FaceName, L"Consolas");
+		if (!SetCurrentConsoleFontEx(m_hConsole, false, &cfi))
+			return Error(L"SetCurrentConsoleFontEx");
+
+		// Get screen buffer info and check the maximum allowed window size. Return
+		// error if exceeded, so user knows their dimensions/fontsize are too large
+		CONSOLE_SCREEN_BUFFER_INFO csbi;
+		if (!GetConsoleScreenBufferInfo(m_hConsole, &csbi))
+			return Error(L"GetConsoleScreenBufferInfo");
+		if (m_nScreenHeight > csbi.dwMaximumWindowSize.Y)
+			return Error(L"Screen Height / Font Height Too Big");
+		if (m_nScreenWidth > csbi.dwMaximumWindowSize.X)
+			return Error(L"Screen Width / Font Width Too Big");
+
+		// Set Physical Console Window Size
+		m_rectWindow = { 0, 0, (short)(m_nScreenWidth - 1), (short)(m_nScreenHeight - 1) };
+		if (!SetConsoleWindowInfo(m_hConsole, TRUE, &m_rectWindow))
+			return Error(L"SetConsoleWindowInfo");
+
+		// Let the console interpret escape sequences
+		if (m_bAnsiOutput)
+		{
+			DWORD nMode = 0;
+			GetConsoleMode(m_hConsole, &nMode);
+			SetConsoleMode(m_hConsole, nMode | ENABLE_PROCESSED_OUTPUT | ENABLE_VIRTUAL_TERMINAL_PROCESSING);
+			m_ansiPresenter.Resize(m_nScreenWidth, m_nScreenHeight);
+		}
+
+		// Set flags to allow mouse input		
+		if (!SetConsoleMode(m_hConsoleIn, ENABLE_EXTENDED_FLAGS | ENABLE_WINDOW_INPUT | ENABLE_MOUSE_INPUT))
+			return Error(L"SetConsoleMode");
+
+		// Allocate memory for screen buffer
+		m_bufScreen = new CHAR_INFO[m_nScreenWidth * m_nScreenHeight];
+		memset(m_bufScreen, 0, sizeof(CHAR_INFO) * m_nScreenWidth * m_nScreenHeight);
+
+		SetConsoleCtrlHandler((PHANDLER_ROUTINE)CloseHandler, TRUE);
+		return 1;
+	}
+
+	virtual void Draw(int x, int y, short c = 0x2588, short col = 0x000F)
+	{
+		if (x >= m_nClipLeft && x < m_nClipRight && y >= m_nClipTop && y < m_nClipBottom)
+		{
+			m_bufScreen[y * m_nScreenWidth + x].Char.UnicodeChar = c;
+			m_bufScreen[y * m_nScreenWidth + x].Attributes = col;
+		}
+	}
+
+	void Fill(int x1, int y1, int x2, int y2, short c = 0x2588, short col = 0x000F)
+	{
+		if (m_bDrawHook)
+		{
+			Clip(x1, y1);
+			Clip(x2, y2);
+			for (int y = y1; y < y2; y++)
+			{
+				for (int x = x1; x < x2; x++)
+					Draw(x, y, c, col);
+				if (m_bFillStats && x1 < x2)
+					m_fillStats.ShadeSpan(x1, x2, y);
+			}
+		}
+		else
+			FillRect(x1, y1, x2, y2, c, col);
+	}
+
+	// Bulk framebuffer writes. These walk m_bufScreen row by row and write whole
+	// runs of cells at once, so unlike Draw() they are not virtual and do no
+	// per-cell bounds checks, and they always write directly, even without
+	// EnableDirectDraw(). Coordinates are clipped once per call, and x2/y2 are
+	// exclusive just like Fill().
+	void FillSpan(int x1, int x2, int y, short c = 0x2588, short col = 0x000F)
+	{
+		if (y < m_nClipTop || y >= m_nClipBottom)
+			return;
+		if (x1 < m_nClipLeft) x1 = m_nClipLeft;
+		if (x2 > m_nClipRight) x2 = m_nClipRight;
+		if (x1 >= x2)
+			return;
+
+		FillCells(m_bufScreen + y * m_nScreenWidth + x1, x2 - x1, MakeCell(c, col));
+		if (m_bFillStats)
+			m_fillStats.ShadeSpan(x1, x2, y);
+	}
+
+	void FillRect(int x1, int y1, int x2, int y2, short c = 0x2588, short col = 0x000F)
+	{
+		Clip(x1, y1);
+		Clip(x2, y2);
+		if (x1 >= x2 || y1 >= y2)
+			return;
+
+		CHAR_INFO cell = MakeCell(c, col);
+		if (m_bFillStats)
+			for (int y = y1; y < y2; y++)
+				m_fillStats.ShadeSpan(x1, x2, y);
+
+		// Full width rectangles are one contiguous run in a row-major buffer
+		if (x1 == 0 && x2 == m_nScreenWidth)
+		{
+			FillCells(m_bufScreen + y1 * m_nScreenWidth, (y2 - y1) * m_nScreenWidth, cell);
+			return;
+		}
+
+		for (int y = y1; y < y2; y++)
+			FillCells(m_bufScreen + y * m_nScreenWidth + x1, x2 - x1, cell);
+	}
+
+	void Clear(short c = L' ', short col = 0x0000)
+	{
+		if (m_nClipLeft == 0 && m_nClipRight == m_nScreenWidth)
+		{
+			FillCells(m_bufScreen + m_nClipTop * m_nScreenWidth, (m_nClipBottom - m_nClipTop) * m_nScreenWidth, MakeCell(c, col));
+			return;
+		}
+
+		for (int y = m_nClipTop; y < m_nClipBottom; y++)
+			FillCells(m_bufScreen + y * m_nScreenWidth + m_nClipLeft, m_nClipRight - m_nClipLeft, MakeCell(c, col));
+	}
+
+	void DrawString(int x, int y, std::wstring c, short col = 0x000F)
+	{
+		for (size_t i = 0; i < c.size(); i++)
+		{
+			m_bufScreen[y * m_nScreenWidth + x + i].Char.UnicodeChar = c[i];
+			m_bufScreen[y * m_nScreenWidth + x + i].Attributes = col;
+		}
+	}
+
+	void DrawStringAlpha(int x, int y, std::wstring c, short col = 0x000F)
+	{
+		for (size_t i = 0; i < c.size(); i++)
+		{
+			if (c[i] != L' ')
+			{
 				m_bufScreen[y * m_nScreenWidth + x + i].Char.UnicodeChar = c[i];
 				m_bufScreen[y * m_nScreenWidth + x + i].Attributes = col;
 			}
@@ -468,84 +2315,273 @@ public:
 
 	void Clip(int& x, int& y)
 	{
-		if (x < 0) x = 0;
-		if (x >= m_nScreenWidth) x = m_nScreenWidth;
-		if (y < 0) y = 0;
-		if (y >= m_nScreenHeight) y = m_nScreenHeight;
+		if (x < m_nClipLeft) x = m_nClipLeft;
+		if (x >= m_nClipRight) x = m_nClipRight;
+		if (y < m_nClipTop) y = m_nClipTop;
+		if (y >= m_nClipBottom) y = m_nClipBottom;
 	}
 
 	void DrawLine(int x1, int y1, int x2, int y2, short c = 0x2588, short col = 0x000F)
 	{
-		int x, y, dx, dy, dx1, dy1, px, py, xe, ye, i;
-		dx = x2 - x1; dy = y2 - y1;
-		dx1 = abs(dx); dy1 = abs(dy);
-		px = 2 * dy1 - dx1;	py = 2 * dx1 - dy1;
+		auto line = [&](auto& pipeline) { RasterLine(x1, y1, x2, y2, pipeline); };
+		if (m_bDrawHook)
+		{
+			sDrawHook hook = { this, c, col };
+			Rasterize(hook, line);
+		}
+		else
+		{
+			auto pipeline = SolidPipeline(c, col);
+			Rasterize(pipeline, line);
+		}
+	}
+
+	void DrawTriangle(int x1, int y1, int x2, int y2, int x3, int y3, short c = 0x2588, short col = 0x000F)
+	{
+		DrawLine(x1, y1, x2, y2, c, col);
+		DrawLine(x2, y2, x3, y3, c, col);
+		DrawLine(x3, y3, x1, y1, c, col);
+	}
+
+	void FillTriangle(int x1, int y1, int x2, int y2, int x3, int y3, short c = 0x2588, short col = 0x000F)
+	{
+		if (m_bFillStats)
+			CountTriangle(x1, y1, x2, y2, x3, y3);
+
+		auto triangle = [&](auto& pipeline) { RasterFillTriangle(x1, y1, x2, y2, x3, y3, pipeline); };
+		if (m_bDrawHook)
+		{
+			sDrawHook hook = { this, c, col };
+			Rasterize(hook, triangle);
+		}
+		else
+		{
+			auto pipeline = SolidPipeline(c, col);
+			Rasterize(pipeline, triangle);
+		}
+	}
+
+	// As FillTriangle, but the corners are in 28.4 fixed point (pixels << SUBPIXEL_BITS)
+	// and triangles that share an edge never both fill a cell on it, nor leave a gap
+	static const int SUBPIXEL_BITS = 4;
+
+	void FillTriangleSubpixel(int x1, int y1, int x2, int y2, int x3, int y3, short c = 0x2588, short col = 0x000F)
+	{
+		if (m_bFillStats)
+			CountTriangle(x1 >> SUBPIXEL_BITS, y1 >> SUBPIXEL_BITS, x2 >> SUBPIXEL_BITS, y2 >> SUBPIXEL_BITS, x3 >> SUBPIXEL_BITS, y3 >> SUBPIXEL_BITS);
+
+		auto triangle = [&](auto& pipeline) { RasterFillTriangleSubpixel(x1, y1, x2, y2, x3, y3, pipeline); };
+		if (m_bDrawHook)
+		{
+			sDrawHook hook = { this, c, col };
+			Rasterize(hook, triangle);
+		}
+		else
+		{
+			auto pipeline = SolidPipeline(c, col);
+			Rasterize(pipeline, triangle);
+		}
+	}
+
+	// As above, but every covered cell goes to your own pipeline (see
+	// olcPixelPipeline), counted by EnableFillStats() like the engine's own
+	template<class Pipeline>
+	void FillTriangleSubpixel(int x1, int y1, int x2, int y2, int x3, int y3, Pipeline& pipeline)
+	{
+		if (m_bFillStats)
+			CountTriangle(x1 >> SUBPIXEL_BITS, y1 >> SUBPIXEL_BITS, x2 >> SUBPIXEL_BITS, y2 >> SUBPIXEL_BITS, x3 >> SUBPIXEL_BITS, y3 >> SUBPIXEL_BITS);
+
+		auto triangle = [&](auto& p) { RasterFillTriangleSubpixel(x1, y1, x2, y2, x3, y3, p); };
+		Rasterize(pipeline, triangle);
+	}
+
+	// Perspective correct textured triangle. u, v are texture coordinates already
+	// divided by w, and w is 1/z (see RasterTriangle). If a depth buffer of
+	// ScreenWidth() * ScreenHeight() floats is supplied it is tested and updated.
+	void DrawTexturedTriangle(int x1, int y1, float u1, float v1, float w1,
+		int x2, int y2, float u2, float v2, float w2,
+		int x3, int y3, float u3, float v3, float w3,
+		olcSprite* tex, float* pDepthBuffer = nullptr)
+	{
+		if (tex == nullptr)
+			return;
+
+		if (m_bFillStats)
+			CountTriangle(x1, y1, x2, y2, x3, y3);
+
+		auto triangle = [&](auto& pipeline) { RasterTriangle(x1, y1, u1, v1, w1, x2, y2, u2, v2, w2, x3, y3, u3, v3, w3, pipeline); };
+		olcSourceTexture source = { tex };
+		if (pDepthBuffer != nullptr)
+		{
+			olcDepthTest depth = { pDepthBuffer };
+			auto pipeline = olcMakePipeline(m_bufScreen, m_nScreenWidth, depth, source);
+			Rasterize(pipeline, triangle);
+		}
+		else
+		{
+			auto pipeline = olcMakePipeline(m_bufScreen, m_nScreenWidth, olcDepthOff(), source);
+			Rasterize(pipeline, triangle);
+		}
+	}
+
+	void DrawCircle(int xc, int yc, int r, short c = 0x2588, short col = 0x000F)
+	{
+		auto circle = [&](auto& pipeline) { RasterCircle(xc, yc, r, pipeline); };
+		if (m_bDrawHook)
+		{
+			sDrawHook hook = { this, c, col };
+			Rasterize(hook, circle);
+		}
+		else
+		{
+			auto pipeline = SolidPipeline(c, col);
+			Rasterize(pipeline, circle);
+		}
+	}
+
+	void FillCircle(int xc, int yc, int r, short c = 0x2588, short col = 0x000F)
+	{
+		auto circle = [&](auto& pipeline) { RasterFillCircle(xc, yc, r, pipeline); };
+		if (m_bDrawHook)
+		{
+			sDrawHook hook = { this, c, col };
+			Rasterize(hook, circle);
+		}
+		else
+		{
+			auto pipeline = SolidPipeline(c, col);
+			Rasterize(pipeline, circle);
+		}
+	}
+
+	// Raster Primitives ======================================================
+	//
+	// These are the compile-time specialised versions of the Draw/Fill routines
+	// above, templated on a pixel pipeline (see olcPixelPipeline). They clip to
+	// the clip rect themselves, so the pipeline is only invoked for visible cells.
+
+	template<class Pipeline>
+	void RasterSpan(int x1, int x2, int y, Pipeline& pipeline)
+	{
+		if (y < m_nClipTop || y >= m_nClipBottom)
+			return;
+		if (x1 < m_nClipLeft) x1 = m_nClipLeft;
+		if (x2 >= m_nClipRight) x2 = m_nClipRight - 1;
+		for (int x = x1; x <= x2; x++)
+			pipeline(x, y, 0.0f, 0.0f, 0.0f);
+	}
+
+	template<class Pipeline>
+	void RasterPixel(int x, int y, Pipeline& pipeline)
+	{
+		if (x >= m_nClipLeft && x < m_nClipRight && y >= m_nClipTop && y < m_nClipBottom)
+			pipeline(x, y, 0.0f, 0.0f, 0.0f);
+	}
+
+	// Bresenham, clipped to the screen before the first pixel so the loop writes
+	// without checking. Outcodes (Cohen-Sutherland) accept lines that are wholly
+	// on screen and reject those wholly off one side. Anything else is clipped
+	// parametrically (Liang-Barsky), but in terms of the line's own steps rather
+	// than its endpoints, so a clipped line lights exactly the pixels the
+	// unclipped one would have.
+	template<class Pipeline>
+	void RasterLine(int x1, int y1, int x2, int y2, Pipeline& pipeline)
+	{
+		int nCode1 = OutCode(x1, y1), nCode2 = OutCode(x2, y2);
+		if ((nCode1 & nCode2) != 0)
+			return;
+
+		int dx = x2 - x1, dy = y2 - y1;
+		int dx1 = abs(dx), dy1 = abs(dy);
+		int nStep = ((dx < 0 && dy < 0) || (dx > 0 && dy > 0)) ? 1 : -1;
+		bool bClip = (nCode1 | nCode2) != 0;
+
+		// Always walk the major axis upwards. The two cases break ties differently
 		if (dy1 <= dx1)
 		{
 			if (dx >= 0)
-			{
-				x = x1; y = y1; xe = x2;
-			}
+				RasterLineSteps<false>(x1, y1, nStep, dx1, dy1, dx1, bClip, pipeline);
 			else
-			{
-				x = x2; y = y2; xe = x1;
-			}
-
-			Draw(x, y, c, col);
-
-			for (i = 0; x < xe; i++)
-			{
-				x = x + 1;
-				if (px < 0)
-					px = px + 2 * dy1;
-				else
-				{
-					if ((dx < 0 && dy < 0) || (dx > 0 && dy > 0)) y = y + 1; else y = y - 1;
-					px = px + 2 * (dy1 - dx1);
-				}
-				Draw(x, y, c, col);
-			}
+				RasterLineSteps<false>(x2, y2, nStep, dx1, dy1, dx1, bClip, pipeline);
 		}
 		else
 		{
 			if (dy >= 0)
+				RasterLineSteps<true>(y1, x1, nStep, dy1, dx1, dy1 - 1, bClip, pipeline);
+			else
+				RasterLineSteps<true>(y2, x2, nStep, dy1, dx1, dy1 - 1, bClip, pipeline);
+		}
+	}
+
+	int OutCode(int x, int y)
+	{
+		return (x < m_nClipLeft ? 1 : 0) | (x >= m_nClipRight ? 2 : 0) | (y < m_nClipTop ? 4 : 0) | (y >= m_nClipBottom ? 8 : 0);
+	}
+
+	static long long FloorDiv(long long a, long long b) { return a >= 0 ? a / b : -((-a + b - 1) / b); }
+	static long long CeilDiv(long long a, long long b) { return -FloorDiv(-a, b); }
+
+	// Walk dMajor steps along the major axis from (nMajor, nMinor), moving nStep
+	// on the minor axis whenever the error term says so. After k steps the minor
+	// axis has moved floor((2 * dMinor * k + nBias) / (2 * dMajor)), where nBias
+	// encodes the tie rule, which lets us jump straight to the first visible step
+	template<bool bYMajor, class Pipeline>
+	void RasterLineSteps(int nMajor, int nMinor, int nStep, int dMajor, int dMinor, int nBias, bool bClip, Pipeline& pipeline)
+	{
+		long long k0 = 0, k1 = dMajor;
+		if (bClip)
+		{
+			int nMajorMin = bYMajor ? m_nClipTop : m_nClipLeft, nMajorMax = bYMajor ? m_nClipBottom - 1 : m_nClipRight - 1;
+			int nMinorMin = bYMajor ? m_nClipLeft : m_nClipTop, nMinorMax = bYMajor ? m_nClipRight - 1 : m_nClipBottom - 1;
+
+			k0 = (std::max)(k0, (long long)(nMajorMin - nMajor));
+			k1 = (std::min)(k1, (long long)(nMajorMax - nMajor));
+
+			// Range of minor steps that stay on screen
+			long long m0 = nStep > 0 ? nMinorMin - nMinor : nMinor - nMinorMax;
+			long long m1 = nStep > 0 ? nMinorMax - nMinor : nMinor - nMinorMin;
+			if (dMinor == 0)
 			{
-				x = x1; y = y1; ye = y2;
+				if (m0 > 0 || m1 < 0)
+					return;
 			}
 			else
 			{
-				x = x2; y = y2; ye = y1;
+				if (m0 > 0)
+					k0 = (std::max)(k0, CeilDiv(2LL * dMajor * m0 - nBias, 2LL * dMinor));
+				k1 = (std::min)(k1, FloorDiv(2LL * dMajor * (m1 + 1) - 1 - nBias, 2LL * dMinor));
 			}
+			if (k0 > k1)
+				return;
+		}
 
-			Draw(x, y, c, col);
+		long long m = dMajor > 0 ? FloorDiv(2LL * dMinor * k0 + nBias, 2LL * dMajor) : 0;
+		long long p = 2LL * dMinor * (k0 + 1) - dMajor - 2LL * dMajor * m;
+		int a = nMajor + (int)k0, b = nMinor + nStep * (int)m;
+		for (long long k = k0; k <= k1; k++)
+		{
+			if (bYMajor)
+				pipeline(b, a, 0.0f, 0.0f, 0.0f);
+			else
+				pipeline(a, b, 0.0f, 0.0f, 0.0f);
 
-			for (i = 0; y < ye; i++)
+			a++;
+			if (p < 0 || (bYMajor && p == 0))
+				p += 2 * dMinor;
+			else
 			{
-				y = y + 1;
-				if (py <= 0)
-					py = py + 2 * dx1;
-				else
-				{
-					if ((dx < 0 && dy < 0) || (dx > 0 && dy > 0)) x = x + 1; else x = x - 1;
-					py = py + 2 * (dx1 - dy1);
-				}
-				Draw(x, y, c, col);
+				b += nStep;
+				p += 2 * (dMinor - dMajor);
 			}
 		}
 	}
 
-	void DrawTriangle(int x1, int y1, int x2, int y2, int x3, int y3, short c = 0x2588, short col = 0x000F)
-	{
-		DrawLine(x1, y1, x2, y2, c, col);
-		DrawLine(x2, y2, x3, y3, c, col);
-		DrawLine(x3, y3, x1, y1, c, col);
-	}
-
 	// https://www.avrfreaks.net/sites/default/files/triangles.c
-	void FillTriangle(int x1, int y1, int x2, int y2, int x3, int y3, short c = 0x2588, short col = 0x000F)
+	template<class Pipeline>
+	void RasterFillTriangle(int x1, int y1, int x2, int y2, int x3, int y3, Pipeline& pipeline)
 	{
 		auto SWAP = [](int& x, int& y) { int t = x; x = y; y = t; };
-		auto drawline = [&](int sx, int ex, int ny) { for (int i = sx; i <= ex; i++) Draw(i, ny, c, col); };
+		auto drawline = [&](int sx, int ex, int ny) { RasterSpan(sx, ex, ny, pipeline); };
 
 		int t1x, t2x, y, minx, maxx, t1xp, t2xp;
 		bool changed1 = false;
@@ -679,7 +2715,8 @@ public:
 		}
 	}
 
-	void DrawCircle(int xc, int yc, int r, short c = 0x2588, short col = 0x000F)
+	template<class Pipeline>
+	void RasterCircle(int xc, int yc, int r, Pipeline& pipeline)
 	{
 		int x = 0;
 		int y = r;
@@ -688,20 +2725,21 @@ public:
 
 		while (y >= x) // only formulate 1/8 of circle
 		{
-			Draw(xc - x, yc - y, c, col);//upper left left
-			Draw(xc - y, yc - x, c, col);//upper upper left
-			Draw(xc + y, yc - x, c, col);//upper upper right
-			Draw(xc + x, yc - y, c, col);//upper right right
-			Draw(xc - x, yc + y, c, col);//lower left left
-			Draw(xc - y, yc + x, c, col);//lower lower left
-			Draw(xc + y, yc + x, c, col);//lower lower right
-			Draw(xc + x, yc + y, c, col);//lower right right
+			RasterPixel(xc - x, yc - y, pipeline);//upper left left
+			RasterPixel(xc - y, yc - x, pipeline);//upper upper left
+			RasterPixel(xc + y, yc - x, pipeline);//upper upper right
+			RasterPixel(xc + x, yc - y, pipeline);//upper right right
+			RasterPixel(xc - x, yc + y, pipeline);//lower left left
+			RasterPixel(xc - y, yc + x, pipeline);//lower lower left
+			RasterPixel(xc + y, yc + x, pipeline);//lower lower right
+			RasterPixel(xc + x, yc + y, pipeline);//lower right right
 			if (p < 0) p += 4 * x++ + 6;
 			else p += 4 * (x++ - y--) + 10;
 		}
 	}
 
-	void FillCircle(int xc, int yc, int r, short c = 0x2588, short col = 0x000F)
+	template<class Pipeline>
+	void RasterFillCircle(int xc, int yc, int r, Pipeline& pipeline)
 	{
 		// Taken from wikipedia
 		int x = 0;
@@ -709,51 +2747,282 @@ public:
 		int p = 3 - 2 * r;
 		if (!r) return;
 
-		auto drawline = [&](int sx, int ex, int ny)
-			{
-				for (int i = sx; i <= ex; i++)
-					Draw(i, ny, c, col);
-			};
-
 		while (y >= x)
 		{
 			// Modified to draw scan-lines instead of edges
-			drawline(xc - x, xc + x, yc - y);
-			drawline(xc - y, xc + y, yc - x);
-			drawline(xc - x, xc + x, yc + y);
-			drawline(xc - y, xc + y, yc + x);
+			RasterSpan(xc - x, xc + x, yc - y, pipeline);
+			RasterSpan(xc - y, xc + y, yc - x, pipeline);
+			RasterSpan(xc - x, xc + x, yc + y, pipeline);
+			RasterSpan(xc - y, xc + y, yc + x, pipeline);
 			if (p < 0) p += 4 * x++ + 6;
 			else p += 4 * (x++ - y--) + 10;
 		}
-	};
+	}
+
+	// A cell is filled when its centre is inside all three edges, evaluated in
+	// integers so the result doesn't depend on the compiler's floating point.
+	// Centres exactly on an edge go by the top-left rule: they belong to the
+	// triangle the edge is a top (horizontal, inside below) or left edge of.
+	// Each edge is solved for the range of cells it allows on a row, so there is
+	// no per-cell test.
+	template<class Pipeline>
+	void RasterFillTriangleSubpixel(int x1, int y1, int x2, int y2, int x3, int y3, Pipeline& pipeline)
+	{
+		// Wind the corners so the inside is where every edge function is positive
+		long long nArea = (long long)(x2 - x1) * (y3 - y1) - (long long)(y2 - y1) * (x3 - x1);
+		if (nArea == 0)
+			return;
+		if (nArea < 0)
+		{
+			std::swap(x2, x3);
+			std::swap(y2, y3);
+		}
+
+		const int nOne = 1 << SUBPIXEL_BITS, nHalf = nOne / 2;
+
+		// Rows whose centres lie within the triangle's extent
+		int yMin = (std::min)(y1, (std::min)(y2, y3)), yMax = (std::max)(y1, (std::max)(y2, y3));
+		int yStart = (int)(std::max)((long long)m_nClipTop, CeilDiv(yMin - nHalf, nOne));
+		int yEnd = (int)(std::min)((long long)m_nClipBottom - 1, FloorDiv(yMax - nHalf, nOne));
+
+		// Edge a->b: E(x, y) = (bx - ax)(y - ay) - (by - ay)(x - ax) = A x + B y + C.
+		// Cells exactly on the edge (E == 0) are only inside a top or left edge,
+		// so the others are biased by -1 and everything tests E >= 0
+		struct sEdge { long long A, B, C; };
+		auto MakeEdge = [](int ax, int ay, int bx, int by)
+		{
+			sEdge e;
+			e.A = -(long long)(by - ay);
+			e.B = (long long)(bx - ax);
+			e.C = (long long)(by - ay) * ax - (long long)(bx - ax) * ay;
+			bool bTopLeft = (by == ay && bx > ax) || by < ay;
+			if (!bTopLeft)
+				e.C -= 1;
+			return e;
+		};
+		sEdge edges[3] = { MakeEdge(x1, y1, x2, y2), MakeEdge(x2, y2, x3, y3), MakeEdge(x3, y3, x1, y1) };
+
+		for (int y = yStart; y <= yEnd; y++)
+		{
+			long long yc = (long long)y * nOne + nHalf;
+			long long xLeft = m_nClipLeft, xRight = m_nClipRight - 1;
+			for (auto& e : edges)
+			{
+				// A (x * nOne + nHalf) + n >= 0, for cell x
+				long long n = e.B * yc + e.C;
+				if (e.A > 0)
+					xLeft = (std::max)(xLeft, CeilDiv(-n - e.A * nHalf, e.A * nOne));
+				else if (e.A < 0)
+					xRight = (std::min)(xRight, FloorDiv(n + e.A * nHalf, -e.A * nOne));
+				else if (n < 0)
+					xRight = -1;
+			}
+			if (xLeft <= xRight)
+				RasterSpan((int)xLeft, (int)xRight, y, pipeline);
+		}
+	}
+
+	// Scanline triangle interpolating (u, v, w) along edges and across spans.
+	// For perspective correct texturing pass u/z, v/z and 1/z; the pipeline
+	// divides by w again when it samples.
+	template<class Pipeline>
+	void RasterTriangle(int x1, int y1, float u1, float v1, float w1,
+		int x2, int y2, float u2, float v2, float w2,
+		int x3, int y3, float u3, float v3, float w3,
+		Pipeline& pipeline)
+	{
+		// Sort vertices by y
+		if (y2 < y1) { std::swap(y1, y2); std::swap(x1, x2); std::swap(u1, u2); std::swap(v1, v2); std::swap(w1, w2); }
+		if (y3 < y1) { std::swap(y1, y3); std::swap(x1, x3); std::swap(u1, u3); std::swap(v1, v3); std::swap(w1, w3); }
+		if (y3 < y2) { std::swap(y2, y3); std::swap(x2, x3); std::swap(u2, u3); std::swap(v2, v3); std::swap(w2, w3); }
+
+		// Long edge, top to bottom
+		float fLongDy = (float)(y3 - y1);
+		float dbx_step = 0.0f, du2_step = 0.0f, dv2_step = 0.0f, dw2_step = 0.0f;
+		if (y3 != y1)
+		{
+			dbx_step = (float)(x3 - x1) / fLongDy;
+			du2_step = (u3 - u1) / fLongDy;
+			dv2_step = (v3 - v1) / fLongDy;
+			dw2_step = (w3 - w1) / fLongDy;
+		}
+
+		// (u, v, w) are planes over the screen, so their change per row at a
+		// fixed x is the same everywhere. The edges' own steps also move across
+		// in x, so they can't stand in for it on slanted edges
+		float dy[3] = { 0.0f, 0.0f, 0.0f };
+		float fDet = (float)(x2 - x1) * (float)(y3 - y1) - (float)(x3 - x1) * (float)(y2 - y1);
+		if (fDet != 0.0f)
+		{
+			float fInvDet = 1.0f / fDet;
+			dy[0] = ((u3 - u1) * (float)(x2 - x1) - (u2 - u1) * (float)(x3 - x1)) * fInvDet;
+			dy[1] = ((v3 - v1) * (float)(x2 - x1) - (v2 - v1) * (float)(x3 - x1)) * fInvDet;
+			dy[2] = ((w3 - w1) * (float)(x2 - x1) - (w2 - w1) * (float)(x3 - x1)) * fInvDet;
+		}
+
+		auto halfTriangle = [&](int xa, int ya, float ua, float va, float wa,
+			int xb, int yb, float ub, float vb, float wb)
+			{
+				if (ya == yb)
+					return;
+
+				float fDy = (float)(yb - ya);
+				float dax_step = (float)(xb - xa) / fDy;
+				float du1_step = (ub - ua) / fDy;
+				float dv1_step = (vb - va) / fDy;
+				float dw1_step = (wb - wa) / fDy;
+
+				int yStart = (std::max)(ya, m_nClipTop);
+				int yEnd = (std::min)(yb, m_nClipBottom - 1);
+				for (int i = yStart; i <= yEnd; i++)
+				{
+					float fa = (float)(i - ya);
+					float fb = (float)(i - y1);
+					int ax = xa + (int)(fa * dax_step);
+					int bx = x1 + (int)(fb * dbx_step);
+					float su = ua + fa * du1_step, sv = va + fa * dv1_step, sw = wa + fa * dw1_step;
+					float eu = u1 + fb * du2_step, ev = v1 + fb * dv2_step, ew = w1 + fb * dw2_step;
+
+					if (ax > bx)
+					{
+						std::swap(ax, bx);
+						std::swap(su, eu); std::swap(sv, ev); std::swap(sw, ew);
+					}
+					if (ax == bx)
+						continue;
+
+					// Interpolate across the span, starting at the first visible cell
+					float tstep = 1.0f / (float)(bx - ax);
+					float fu = (eu - su) * tstep, fv = (ev - sv) * tstep, fw = (ew - sw) * tstep;
+					int xStart = (std::max)(ax, m_nClipLeft);
+					int xEnd = (std::min)(bx, m_nClipRight);
+					float t = (float)(xStart - ax);
+					float u = su + t * fu, v = sv + t * fv, w = sw + t * fw;
+					if (xStart >= xEnd)
+						continue;
+
+					const float dx[3] = { fu, fv, fw };
+					pipeline.BeginSpan(u, v, w, dx, dy, xEnd - xStart);
+					for (int j = xStart; j < xEnd; j++)
+					{
+						pipeline(j, i, u, v, w);
+						u += fu; v += fv; w += fw;
+					}
+				}
+			};
+
+		halfTriangle(x1, y1, u1, v1, w1, x2, y2, u2, v2, w2);
+		halfTriangle(x2, y2, u2, v2, w2, x3, y3, u3, v3, w3);
+	}
+
+	void DrawSprite(int x, int y, olcSprite* sprite)
+	{
+		if (sprite == nullptr)
+			return;
+
+		DrawPartialSprite(x, y, sprite, 0, 0, sprite->nWidth, sprite->nHeight);
+	}
+
+	void DrawPartialSprite(int x, int y, olcSprite* sprite, int ox, int oy, int w, int h)
+	{
+		if (sprite == nullptr)
+			return;
+
+		if (!ClipBlit(x, y, sprite, ox, oy, w, h))
+			return;
+
+		if (m_bFillStats)
+		{
+			for (int j = 0; j < h; j++)
+				for (int i = 0; i < w; i++)
+				{
+					if (sprite->GetGlyph(ox + i, oy + j) != L' ')
+						m_fillStats.Shade(x + i, y + j);
+					else
+						m_fillStats.Reject();
+				}
+		}
+
+		// Blit row by row, spaces are transparent
+		if (m_bDrawHook)
+		{
+			for (int j = 0; j < h; j++)
+				for (int i = 0; i < w; i++)
+					if (sprite->GetGlyph(ox + i, oy + j) != L' ')
+						Draw(x + i, y + j, sprite->GetGlyph(ox + i, oy + j), sprite->GetColour(ox + i, oy + j));
+			return;
+		}
+
+		for (int j = 0; j < h; j++)
+		{
+			const CHAR_INFO* pSrc = sprite->GetRow(oy + j) + ox;
+			CHAR_INFO* pDst = m_bufScreen + (y + j) * m_nScreenWidth + x;
+			for (int i = 0; i < w; i++)
+				if (pSrc[i].Char.UnicodeChar != L' ')
+					pDst[i] = pSrc[i];
+		}
+	}
 
-	void DrawSprite(int x, int y, olcSprite* sprite)
+	// As DrawSprite/DrawPartialSprite, but spaces are drawn too, so each row
+	// is a straight copy from the sprite into the screen buffer
+	void DrawSpriteOpaque(int x, int y, olcSprite* sprite)
 	{
 		if (sprite == nullptr)
 			return;
 
-		for (int i = 0; i < sprite->nWidth; i++)
-		{
-			for (int j = 0; j < sprite->nHeight; j++)
-			{
-				if (sprite->GetGlyph(i, j) != L' ')
-					Draw(x + i, y + j, sprite->GetGlyph(i, j), sprite->GetColour(i, j));
-			}
-		}
+		DrawPartialSpriteOpaque(x, y, sprite, 0, 0, sprite->nWidth, sprite->nHeight);
 	}
 
-	void DrawPartialSprite(int x, int y, olcSprite* sprite, int ox, int oy, int w, int h)
+	void DrawPartialSpriteOpaque(int x, int y, olcSprite* sprite, int ox, int oy, int w, int h)
 	{
 		if (sprite == nullptr)
 			return;
 
-		for (int i = 0; i < w; i++)
-		{
+		if (!ClipBlit(x, y, sprite, ox, oy, w, h))
+			return;
+
+		if (m_bFillStats)
 			for (int j = 0; j < h; j++)
+				m_fillStats.ShadeSpan(x, x + w, y + j);
+
+		for (int j = 0; j < h; j++)
+			std::memcpy(m_bufScreen + (y + j) * m_nScreenWidth + x, sprite->GetRow(oy + j) + ox, sizeof(CHAR_INFO) * w);
+	}
+
+	// As DrawSpriteOpaque, but the whole sprite is stretched or shrunk to w x h
+	// cells, each taking the sprite cell under its centre. Rows that repeat the
+	// one above are copied from it
+	void DrawSpriteOpaqueScaled(int x, int y, int w, int h, olcSprite* sprite)
+	{
+		if (sprite == nullptr || w <= 0 || h <= 0)
+			return;
+
+		int x1 = (std::max)(x, m_nClipLeft), x2 = (std::min)(x + w, m_nClipRight);
+		int y1 = (std::max)(y, m_nClipTop), y2 = (std::min)(y + h, m_nClipBottom);
+		if (x1 >= x2 || y1 >= y2)
+			return;
+
+		if (m_bFillStats)
+			for (int j = y1; j < y2; j++)
+				m_fillStats.ShadeSpan(x1, x2, j);
+
+		int nLastRow = -1;
+		CHAR_INFO* pLast = nullptr;
+		for (int j = y1; j < y2; j++)
+		{
+			CHAR_INFO* pDst = m_bufScreen + j * m_nScreenWidth + x1;
+			int nRow = (int)(((long long)(j - y) * 2 + 1) * sprite->nHeight / ((long long)h * 2));
+			if (nRow == nLastRow)
 			{
-				if (sprite->GetGlyph(i + ox, j + oy) != L' ')
-					Draw(x + i, y + j, sprite->GetGlyph(i + ox, j + oy), sprite->GetColour(i + ox, j + oy));
+				std::memcpy(pDst, pLast, sizeof(CHAR_INFO) * (x2 - x1));
+				continue;
 			}
+
+			const CHAR_INFO* pSrc = sprite->GetRow(nRow);
+			for (int i = x1; i < x2; i++)
+				pDst[i - x1] = pSrc[((long long)(i - x) * 2 + 1) * sprite->nWidth / ((long long)w * 2)];
+			nLastRow = nRow;
+			pLast = pDst;
 		}
 	}
 
@@ -804,6 +3073,105 @@ public:
 	}
 
 public:
+	// Set up a screen buffer without a console, for replays and benchmarks
+	int ConstructHeadless(int width, int height)
+	{
+		m_nScreenWidth = width;
+		m_nScreenHeight = height;
+		ResetClipRect();
+		delete[] m_bufScreen;
+		m_bufScreen = new CHAR_INFO[m_nScreenWidth * m_nScreenHeight];
+		memset(m_bufScreen, 0, sizeof(CHAR_INFO) * m_nScreenWidth * m_nScreenHeight);
+		return 1;
+	}
+
+	struct sReplayFrame
+	{
+		float fElapsedTime;	// Timestep the frame was updated with
+		float fFrameTime;	// Seconds OnUserUpdate() took
+		uint64_t nHash;		// FNV-1a of the screen buffer afterwards
+	};
+
+	// Play back a file made with EnableInputRecording() on the calling thread.
+	// Every frame gets exactly the recorded input and timestep, so two builds
+	// given the same file walk the same path through the game - compare their
+	// frame times, and their hashes to be sure they drew the same thing. Uses a
+	// headless screen buffer of the recorded size if no console was constructed.
+	// Nothing is presented and audio isn't started.
+	bool RunReplay(const std::wstring& sFile, std::vector<sReplayFrame>& vecFrames)
+	{
+		olcInputRecording replay;
+		if (!replay.OpenRead(sFile))
+			return false;
+
+		if (m_bufScreen == nullptr)
+			ConstructHeadless(replay.nWidth, replay.nHeight);
+		if (replay.nWidth != m_nScreenWidth || replay.nHeight != m_nScreenHeight)
+			return false;
+
+		vecFrames.clear();
+		m_bAtomActive = true;
+		if (!OnUserCreate())
+			m_bAtomActive = false;
+
+		olcInputRecording::sInputFrame frame;
+		while (m_bAtomActive && replay.Read(frame))
+		{
+			for (int i = 0; i < 256; i++)
+				m_keyNewState[i] = frame.Key(i) ? (short)0x8000 : 0;
+			for (int m = 0; m < 5; m++)
+				m_mouseNewState[m] = (frame.nMouse >> m) & 1;
+			m_mousePosX = frame.nMouseX;
+			m_mousePosY = frame.nMouseY;
+			m_bConsoleInFocus = frame.bFocus;
+			UpdateInputStates();
+
+			if (m_bFillStats)
+				m_fillStats.Begin(m_nScreenWidth, m_nScreenHeight, m_nFillStatsTileSize);
+
+			auto tp1 = std::chrono::steady_clock::now();
+			if (!OnUserUpdate(frame.fElapsedTime))
+				m_bAtomActive = false;
+			SetDrawTarget(nullptr);
+			auto tp2 = std::chrono::steady_clock::now();
+
+			sReplayFrame result;
+			result.fElapsedTime = frame.fElapsedTime;
+			result.fFrameTime = std::chrono::duration<float>(tp2 - tp1).count();
+			result.nHash = HashScreen();
+			vecFrames.push_back(result);
+		}
+
+		OnUserDestroy();
+		m_bAtomActive = false;
+		return true;
+	}
+
+	// Write replay results as CSV, one line per frame
+	static bool SaveReplayReport(const std::wstring& sFile, const std::vector<sReplayFrame>& vecFrames)
+	{
+		FILE* f = nullptr;
+		_wfopen_s(&f, sFile.c_str(), L"w");
+		if (f == nullptr)
+			return false;
+
+		std::fprintf(f, "frame,elapsed_ms,frame_ms,hash\n");
+		for (size_t i = 0; i < vecFrames.size(); i++)
+			std::fprintf(f, "%u,%.4f,%.4f,%016llx\n", (unsigned int)i, vecFrames[i].fElapsedTime * 1000.0f,
+				vecFrames[i].fFrameTime * 1000.0f, (unsigned long long)vecFrames[i].nHash);
+		std::fclose(f);
+		return true;
+	}
+
+	uint64_t HashScreen() const
+	{
+		uint64_t nHash = 14695981039346656037ull;
+		const unsigned char* p = (const unsigned char*)m_bufScreen;
+		for (size_t i = 0; i < sizeof(CHAR_INFO) * m_nScreenWidth * m_nScreenHeight; i++)
+			nHash = (nHash ^ p[i]) * 1099511628211ull;
+		return nHash;
+	}
+
 	void Start()
 	{
 		// Start the thread
@@ -825,6 +3193,141 @@ public:
 	}
 
 private:
+	// Pipeline used unless EnableDirectDraw() is set, routes every cell
+	// through the virtual Draw()
+	struct sDrawHook
+	{
+		olcConsoleGameEngine* pEngine;
+		short c;
+		short col;
+
+		void BeginSpan(float u, float v, float w, const float dx[3], const float dy[3], int nLength) {}
+		bool operator()(int x, int y, float u, float v, float w) { pEngine->Draw(x, y, c, col); return true; }
+	};
+
+	// Run a raster primitive through pipeline, counted if EnableFillStats() is on
+	template<class Pipeline, class Primitive>
+	void Rasterize(Pipeline& pipeline, Primitive& primitive)
+	{
+		if (m_bFillStats)
+		{
+			olcFillStatsPipeline<Pipeline> counted = { pipeline, m_fillStats };
+			primitive(counted);
+		}
+		else
+			primitive(pipeline);
+	}
+
+	void CountTriangle(int x1, int y1, int x2, int y2, int x3, int y3)
+	{
+		m_fillStats.AddTriangle((std::min)(x1, (std::min)(x2, x3)), (std::min)(y1, (std::min)(y2, y3)),
+			(std::max)(x1, (std::max)(x2, x3)), (std::max)(y1, (std::max)(y2, y3)));
+	}
+
+	olcPixelPipeline<olcDepthOff, olcSourceSolid> SolidPipeline(short c, short col)
+	{
+		olcSourceSolid source = { MakeCell(c, col) };
+		return olcMakePipeline(m_bufScreen, m_nScreenWidth, olcDepthOff(), source);
+	}
+
+	// Clip a sprite blit's source rectangle to the sprite and its destination
+	// to the clip rect. Returns false if nothing is left to draw
+	bool ClipBlit(int& x, int& y, olcSprite* sprite, int& ox, int& oy, int& w, int& h)
+	{
+		if (ox < 0) { w += ox; x -= ox; ox = 0; }
+		if (oy < 0) { h += oy; y -= oy; oy = 0; }
+		if (ox + w > sprite->nWidth) w = sprite->nWidth - ox;
+		if (oy + h > sprite->nHeight) h = sprite->nHeight - oy;
+
+		if (x < m_nClipLeft) { w -= m_nClipLeft - x; ox += m_nClipLeft - x; x = m_nClipLeft; }
+		if (y < m_nClipTop) { h -= m_nClipTop - y; oy += m_nClipTop - y; y = m_nClipTop; }
+		if (x + w > m_nClipRight) w = m_nClipRight - x;
+		if (y + h > m_nClipBottom) h = m_nClipBottom - y;
+		return w > 0 && h > 0;
+	}
+
+	static CHAR_INFO MakeCell(short c, short col)
+	{
+		CHAR_INFO cell;
+		cell.Char.UnicodeChar = c;
+		cell.Attributes = col;
+		return cell;
+	}
+
+	// Write n copies of a cell. CHAR_INFO is 4 bytes, so with SSE2 we can
+	// splat it across a register and store 4 cells per instruction
+	static void FillCells(CHAR_INFO* pDst, int n, CHAR_INFO cell)
+	{
+#ifdef OLC_CGE_SSE2
+		int nPattern;
+		std::memcpy(&nPattern, &cell, sizeof(int));
+		__m128i vCells = _mm_set1_epi32(nPattern);
+		int i = 0;
+		for (; i + 16 <= n; i += 16)
+		{
+			_mm_storeu_si128((__m128i*)(pDst + i), vCells);
+			_mm_storeu_si128((__m128i*)(pDst + i + 4), vCells);
+			_mm_storeu_si128((__m128i*)(pDst + i + 8), vCells);
+			_mm_storeu_si128((__m128i*)(pDst + i + 12), vCells);
+		}
+		for (; i + 4 <= n; i += 4)
+			_mm_storeu_si128((__m128i*)(pDst + i), vCells);
+		for (; i < n; i++)
+			pDst[i] = cell;
+#else
+		std::fill_n(pDst, n, cell);
+#endif
+	}
+
+	// Turn this frame's raw key and mouse button states into pressed, held and
+	// released
+	void UpdateInputStates()
+	{
+		for (int i = 0; i < 256; i++)
+		{
+			m_keys[i].bPressed = false;
+			m_keys[i].bReleased = false;
+
+			if (m_keyNewState[i] != m_keyOldState[i])
+			{
+				if (m_keyNewState[i] & 0x8000)
+				{
+					m_keys[i].bPressed = !m_keys[i].bHeld;
+					m_keys[i].bHeld = true;
+				}
+				else
+				{
+					m_keys[i].bReleased = true;
+					m_keys[i].bHeld = false;
+				}
+			}
+
+			m_keyOldState[i] = m_keyNewState[i];
+		}
+
+		for (int m = 0; m < 5; m++)
+		{
+			m_mouse[m].bPressed = false;
+			m_mouse[m].bReleased = false;
+
+			if (m_mouseNewState[m] != m_mouseOldState[m])
+			{
+				if (m_mouseNewState[m])
+				{
+					m_mouse[m].bPressed = true;
+					m_mouse[m].bHeld = true;
+				}
+				else
+				{
+					m_mouse[m].bReleased = true;
+					m_mouse[m].bHeld = false;
+				}
+			}
+
+			m_mouseOldState[m] = m_mouseNewState[m];
+		}
+	}
+
 	void GameThread()
 	{
 		// Create user resources as part of this thread
@@ -841,6 +3344,10 @@ private:
 			}
 		}
 
+		olcInputRecording recording;
+		if (!m_sInputRecordingFile.empty())
+			recording.OpenWrite(m_sInputRecordingFile, m_nScreenWidth, m_nScreenHeight);
+
 		auto tp1 = std::chrono::system_clock::now();
 		auto tp2 = std::chrono::system_clock::now();
 
@@ -854,31 +3361,13 @@ private:
 				std::chrono::duration<float> elapsedTime = tp2 - tp1;
 				tp1 = tp2;
 				float fElapsedTime = elapsedTime.count();
+				if (m_fFixedTimeStep > 0.0f)
+					fElapsedTime = m_fFixedTimeStep;
 
-				// Handle Keyboard Input
+				// Handle Keyboard Input. Only the held bit is kept, so a replay
+				// sees exactly the same states
 				for (int i = 0; i < 256; i++)
-				{
-					m_keyNewState[i] = GetAsyncKeyState(i);
-
-					m_keys[i].bPressed = false;
-					m_keys[i].bReleased = false;
-
-					if (m_keyNewState[i] != m_keyOldState[i])
-					{
-						if (m_keyNewState[i] & 0x8000)
-						{
-							m_keys[i].bPressed = !m_keys[i].bHeld;
-							m_keys[i].bHeld = true;
-						}
-						else
-						{
-							m_keys[i].bReleased = true;
-							m_keys[i].bHeld = false;
-						}
-					}
-
-					m_keyOldState[i] = m_keyNewState[i];
-				}
+					m_keyNewState[i] = GetAsyncKeyState(i) & 0x8000;
 
 				// Handle Mouse Input - Check for window events
 				INPUT_RECORD inBuf[32];
@@ -910,176 +3399,564 @@ private:
 						}
 						break;
 
-						case 0:
-						{
-							for (int m = 0; m < 5; m++)
-								m_mouseNewState[m] = (inBuf[i].Event.MouseEvent.dwButtonState & (1 << m)) > 0;
+						case 0:
+						{
+							for (int m = 0; m < 5; m++)
+								m_mouseNewState[m] = (inBuf[i].Event.MouseEvent.dwButtonState & (1 << m)) > 0;
+
+						}
+						break;
+
+						default:
+							break;
+						}
+					}
+					break;
+
+					default:
+						break;
+						// We don't care just at the moment
+					}
+				}
+
+				UpdateInputStates();
+
+				if (recording.IsOpen())
+				{
+					olcInputRecording::sInputFrame frame;
+					frame.fElapsedTime = fElapsedTime;
+					for (int i = 0; i < 256; i++)
+						frame.SetKey(i, m_keyNewState[i] != 0);
+					for (int m = 0; m < 5; m++)
+						frame.nMouse |= m_mouseNewState[m] ? 1 << m : 0;
+					frame.nMouseX = (short)m_mousePosX;
+					frame.nMouseY = (short)m_mousePosY;
+					frame.bFocus = m_bConsoleInFocus;
+					recording.Write(frame);
+				}
+
+				// Handle Frame Update
+				if (m_bFillStats)
+					m_fillStats.Begin(m_nScreenWidth, m_nScreenHeight, m_nFillStatsTileSize);
+				if (!OnUserUpdate(fElapsedTime))
+					m_bAtomActive = false;
+				SetDrawTarget(nullptr);
+
+				// Update Title & Present Screen Buffer
+				wchar_t s[256];
+				if (m_bAnsiOutput)
+				{
+					m_ansiPresenter.Present(m_hConsole, m_bufScreen);
+					swprintf_s(s, 256, L"OneLoneCoder.com - Console Game Engine - %s - FPS: %3.2f - %u bytes, encode %.3fms", m_sAppName.c_str(), 1.0f / fElapsedTime,
+						m_ansiPresenter.LastBytes(), m_ansiPresenter.LastEncodeTime() * 1000.0f);
+					SetConsoleTitle(s);
+				}
+				else
+				{
+					swprintf_s(s, 256, L"OneLoneCoder.com - Console Game Engine - %s - FPS: %3.2f", m_sAppName.c_str(), 1.0f / fElapsedTime);
+					SetConsoleTitle(s);
+					WriteConsoleOutput(m_hConsole, m_bufScreen, { (short)m_nScreenWidth, (short)m_nScreenHeight }, { 0,0 }, &m_rectWindow);
+				}
+			}
+
+			if (m_bEnableSound)
+			{
+				// Close and Clean up audio system
+				DestroyAudio();
+			}
+
+			// Allow the user to free resources if they have overrided the destroy function
+			if (OnUserDestroy())
+			{
+				// User has permitted destroy, so exit and clean up
+				if (m_bAnsiOutput)
+					m_ansiPresenter.Restore(m_hConsole);
+				delete[] m_bufScreen;
+				SetConsoleActiveScreenBuffer(m_hOriginalConsole);
+				m_cvGameFinished.notify_one();
+			}
+			else
+			{
+				// User denied destroy for some reason, so continue running
+				m_bAtomActive = true;
+			}
+		}
+	}
+
+public:
+	// User MUST OVERRIDE THESE!!
+	virtual bool OnUserCreate() = 0;
+	virtual bool OnUserUpdate(float fElapsedTime) = 0;
+
+	// Optional for clean up 
+	virtual bool OnUserDestroy() { return true; }
+
+
+
+protected: // Audio Engine =====================================================================
+
+	// Windowed-sinc sample rate converter. The kernel is tabulated at a fixed
+	// number of fractional phases, so converting a frame costs one table row of
+	// multiply-adds per channel. When shrinking the rate the cutoff drops with it
+	// (and the kernel widens), so there is no aliasing from the higher rate.
+	class olcResampler
+	{
+	public:
+		static const int PHASES = 256;
+
+		void Init(unsigned int nSrcRate, unsigned int nDstRate)
+		{
+			m_dStep = (double)nSrcRate / (double)nDstRate;
+			m_bPassThrough = (nSrcRate == nDstRate);
+			double fCutoff = (std::min)(1.0, (double)nDstRate / (double)nSrcRate);
+			m_nHalf = m_bPassThrough ? 1 : (int)ceil(8.0 / fCutoff);
+			m_nTaps = 2 * m_nHalf;
+
+			const double fPi = 3.14159265358979;
+			m_vecKernel.assign((PHASES + 1) * m_nTaps, 0.0f);
+			for (int p = 0; p <= PHASES; p++)
+			{
+				double fSum = 0.0;
+				float* pRow = &m_vecKernel[p * m_nTaps];
+				for (int k = 0; k < m_nTaps; k++)
+				{
+					// Distance from the interpolated position to this tap
+					double t = (double)(k - m_nHalf + 1) - (double)p / (double)PHASES;
+					double x = fPi * fCutoff * t;
+					double fSinc = (fabs(x) < 1e-9) ? 1.0 : sin(x) / x;
+					double w = t / (double)m_nHalf;
+					double fWindow = (fabs(w) >= 1.0) ? 0.0 : 0.42 + 0.5 * cos(fPi * w) + 0.08 * cos(2.0 * fPi * w);
+					pRow[k] = (float)(fSinc * fWindow);
+					fSum += pRow[k];
+				}
+
+				// Normalise each phase so DC passes at unity gain
+				for (int k = 0; k < m_nTaps; k++)
+					pRow[k] = (float)(pRow[k] / fSum);
+			}
+		}
+
+		// pFrames points at the first tap, i.e. source frame floor(dPos) - Half() + 1.
+		// Writes one output frame of nChannels samples
+		void Interpolate(const float* pFrames, int nChannels, double fFraction, float* pOut) const
+		{
+			const float* pRow = &m_vecKernel[(int)(fFraction * PHASES + 0.5) * m_nTaps];
+			for (int c = 0; c < nChannels; c++)
+			{
+				float fAcc = 0.0f;
+				for (int k = 0; k < m_nTaps; k++)
+					fAcc += pFrames[k * nChannels + c] * pRow[k];
+				pOut[c] = fAcc;
+			}
+		}
+
+		double Step() const { return m_dStep; }
+		int Half() const { return m_nHalf; }
+		int Taps() const { return m_nTaps; }
+		bool PassThrough() const { return m_bPassThrough; }
+
+	private:
+		std::vector<float> m_vecKernel;
+		double m_dStep = 1.0;
+		int m_nHalf = 1;
+		int m_nTaps = 2;
+		bool m_bPassThrough = true;
+	};
+
+	// A 16-bit PCM WAVE file converted to float samples at the mixer's rate.
+	// By default the whole file is decoded up front. Streamed samples instead
+	// keep the file open, and the stream loader thread decodes (and resamples)
+	// them into a small ring just ahead of playback, so a long music track only
+	// ever holds a few thousand frames in memory, and the mixer never touches
+	// the disk.
+	class olcAudioSample
+	{
+	public:
+		olcAudioSample()
+		{
+
+		}
+
+		olcAudioSample(std::wstring sWavFile, unsigned int nTargetRate = 44100, bool bStream = false)
+		{
+			// Load Wav file and convert to float format
+			_wfopen_s(&m_pFile, sWavFile.c_str(), L"rb");
+			if (m_pFile == nullptr)
+				return;
+
+			if (!ReadHeader())
+			{
+				Close();
+				return;
+			}
+
+			nChannels = wavHeader.nChannels;
+			m_resampler.Init(wavHeader.nSamplesPerSec, nTargetRate);
+			nSamples = (long)((double)m_nSourceFrames / m_resampler.Step());
+			bStreaming = bStream;
+
+			if (bStreaming)
+			{
+				// Room for one decode chunk plus the resampler's taps either side,
+				// and the ring of decoded chunks for the mixer to read from. The
+				// ring starts full so the first play doesn't have to wait
+				m_vecWindow.assign((STREAM_CHUNK * 2 + m_resampler.Taps() * 2) * nChannels, 0.0f);
+				m_vecDecode.resize(STREAM_CHUNK * nChannels);
+				m_vecRing.resize(STREAM_RING * STREAM_CHUNK * nChannels);
+				StreamRewind();
+				while (StreamFill());
+				bSampleValid = true;
+				return;
+			}
+
+			if (m_resampler.PassThrough())
+			{
+				vecSamples.resize((size_t)m_nSourceFrames * nChannels);
+				bSampleValid = DecodeFrames(vecSamples.data(), m_nSourceFrames) == m_nSourceFrames;
+			}
+			else
+			{
+				// Decode into a buffer padded with silence so every output frame
+				// has a full set of taps, then convert the whole thing in one pass
+				int nHalf = m_resampler.Half();
+				std::vector<float> vecSource((size_t)(m_nSourceFrames + 2 * nHalf) * nChannels, 0.0f);
+				bSampleValid = DecodeFrames(&vecSource[(size_t)nHalf * nChannels], m_nSourceFrames) == m_nSourceFrames;
+
+				vecSamples.resize((size_t)nSamples * nChannels);
+				for (long i = 0; i < nSamples; i++)
+				{
+					double dPos = (double)i * m_resampler.Step();
+					long nBase = (long)dPos;
+					m_resampler.Interpolate(&vecSource[(size_t)(nBase + 1) * nChannels], nChannels, dPos - (double)nBase, &vecSamples[(size_t)i * nChannels]);
+				}
+			}
+
+			// All done, flag sound as valid
+			Close();
+		}
+
+		~olcAudioSample()
+		{
+			Close();
+		}
+
+		// Samples are owned by exactly one object, and the mixer holds raw
+		// pointers to them, so they can't be copied or moved
+		olcAudioSample(const olcAudioSample&) = delete;
+		olcAudioSample& operator=(const olcAudioSample&) = delete;
+
+		WAVEFORMATEX wavHeader;
+		std::vector<float> vecSamples; // Interleaved, at the target rate (not used when streaming)
+		long nSamples = 0; // Frames at the target rate
+		int nChannels = 0;
+		bool bSampleValid = false;
+		bool bStreaming = false;
+
+		static constexpr unsigned int STREAM_CHUNK = 1024; // Frames per ring slot
+		static constexpr unsigned int STREAM_RING = 16; // Slots, about a third of a second at 44.1kHz
+
+		// Streaming, loader thread side: decode the next chunk into the ring.
+		// Each pass through the file ends with a chunk marked as the end, and
+		// the next pass follows straight on, so looping never waits on a seek.
+		// Returns false if the ring is full.
+		bool StreamFill()
+		{
+			unsigned int nGeneration = m_nGeneration.load(std::memory_order_acquire);
+			if (nGeneration != m_nFillGeneration)
+			{
+				// The mixer restarted the stream, so start the file again
+				m_nFillGeneration = nGeneration;
+				StreamRewind();
+			}
 
-						}
-						break;
+			size_t nTail = m_nRingTail.load(std::memory_order_relaxed);
+			if (nTail - m_nRingHead.load(std::memory_order_acquire) == STREAM_RING)
+				return false;
 
-						default:
-							break;
-						}
-					}
-					break;
+			sStreamChunk& chunk = m_ringChunks[nTail % STREAM_RING];
+			chunk.nGeneration = nGeneration;
+			chunk.bEnd = !StreamDecode(&m_vecRing[(nTail % STREAM_RING) * STREAM_CHUNK * nChannels], chunk.nFrames);
+			if (chunk.bEnd)
+				StreamRewind();
 
-					default:
-						break;
-						// We don't care just at the moment
-					}
-				}
+			m_nRingTail.store(nTail + 1, std::memory_order_release);
+			return true;
+		}
 
-				for (int m = 0; m < 5; m++)
+		// Streaming, mixer side: up to nFrames frames of what the loader has
+		// decoded, in nRead. Returns nullptr with nRead == 0 once the stream has
+		// ended (bEnded), or if the loader hasn't kept up, in which case the
+		// caller plays silence rather than waiting.
+		const float* StreamRead(unsigned int nFrames, bool bLoop, unsigned int& nRead, bool& bEnded)
+		{
+			nRead = 0;
+			bEnded = false;
+			unsigned int nGeneration = m_nGeneration.load(std::memory_order_relaxed);
+			while (true)
+			{
+				size_t nHead = m_nRingHead.load(std::memory_order_relaxed);
+				if (nHead == m_nRingTail.load(std::memory_order_acquire))
+					return nullptr;
+
+				// Chunks from before a restart, or used up, go back to the loader
+				const sStreamChunk& chunk = m_ringChunks[nHead % STREAM_RING];
+				bool bCurrent = chunk.nGeneration == nGeneration;
+				if (!bCurrent || m_nChunkRead >= chunk.nFrames)
 				{
-					m_mouse[m].bPressed = false;
-					m_mouse[m].bReleased = false;
-
-					if (m_mouseNewState[m] != m_mouseOldState[m])
+					bool bEnd = bCurrent && chunk.bEnd;
+					m_nChunkRead = 0;
+					m_nRingHead.store(nHead + 1, std::memory_order_release);
+					if (bEnd)
 					{
-						if (m_mouseNewState[m])
-						{
-							m_mouse[m].bPressed = true;
-							m_mouse[m].bHeld = true;
-						}
-						else
+						// The ring now holds the start of the next pass
+						m_bStreamAtStart = true;
+						if (!bLoop || nSamples == 0)
 						{
-							m_mouse[m].bReleased = true;
-							m_mouse[m].bHeld = false;
+							bEnded = true;
+							return nullptr;
 						}
 					}
-
-					m_mouseOldState[m] = m_mouseNewState[m];
+					continue;
 				}
 
-
-				// Handle Frame Update
-				if (!OnUserUpdate(fElapsedTime))
-					m_bAtomActive = false;
-
-				// Update Title & Present Screen Buffer
-				wchar_t s[256];
-				swprintf_s(s, 256, L"OneLoneCoder.com - Console Game Engine - %s - FPS: %3.2f", m_sAppName.c_str(), 1.0f / fElapsedTime);
-				SetConsoleTitle(s);
-				WriteConsoleOutput(m_hConsole, m_bufScreen, { (short)m_nScreenWidth, (short)m_nScreenHeight }, { 0,0 }, &m_rectWindow);
+				nRead = (std::min)(nFrames, chunk.nFrames - m_nChunkRead);
+				const float* pFrames = &m_vecRing[((nHead % STREAM_RING) * STREAM_CHUNK + m_nChunkRead) * nChannels];
+				m_nChunkRead += nRead;
+				m_bStreamAtStart = false;
+				return pFrames;
 			}
+		}
 
-			if (m_bEnableSound)
-			{
-				// Close and Clean up audio system
-			}
+		// Streaming, mixer side: play from the beginning again. If the ring
+		// already starts there nothing changes, otherwise the loader is told to
+		// start over and what it decoded before is thrown away as it's read
+		void StreamRestart()
+		{
+			if (m_bStreamAtStart)
+				return;
+			m_nGeneration.store(m_nGeneration.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+			m_nChunkRead = 0;
+			m_bStreamAtStart = true;
+		}
 
-			// Allow the user to free resources if they have overrided the destroy function
-			if (OnUserDestroy())
-			{
-				// User has permitted destroy, so exit and clean up
-				delete[] m_bufScreen;
-				SetConsoleActiveScreenBuffer(m_hOriginalConsole);
-				m_cvGameFinished.notify_one();
-			}
-			else
+		// Bulk int16 -> float, 8 samples per step with SSE2
+		static void ConvertPCM16(float* pDst, const short* pSrc, size_t n)
+		{
+			const float fScale = 1.0f / (float)MAXSHORT;
+			size_t i = 0;
+#ifdef OLC_CGE_SSE2
+			__m128 vScale = _mm_set1_ps(fScale);
+			for (; i + 8 <= n; i += 8)
 			{
-				// User denied destroy for some reason, so continue running
-				m_bAtomActive = true;
+				__m128i v = _mm_loadu_si128((const __m128i*)(pSrc + i));
+				__m128i lo = _mm_srai_epi32(_mm_unpacklo_epi16(v, v), 16);
+				__m128i hi = _mm_srai_epi32(_mm_unpackhi_epi16(v, v), 16);
+				_mm_storeu_ps(pDst + i, _mm_mul_ps(_mm_cvtepi32_ps(lo), vScale));
+				_mm_storeu_ps(pDst + i + 4, _mm_mul_ps(_mm_cvtepi32_ps(hi), vScale));
 			}
+#endif
+			for (; i < n; i++)
+				pDst[i] = (float)pSrc[i] * fScale;
 		}
-	}
 
-public:
-	// User MUST OVERRIDE THESE!!
-	virtual bool OnUserCreate() = 0;
-	virtual bool OnUserUpdate(float fElapsedTime) = 0;
+	private:
+		FILE* m_pFile = nullptr;
+		long m_nDataOffset = 0;
+		long m_nSourceFrames = 0;
+		olcResampler m_resampler;
+
+		// Streaming state, owned by the loader. The window holds decoded source
+		// frames, where window frame i is source frame i + m_nWindowOrigin -
+		// (Half() - 1). All buffers are sized at load time.
+		std::vector<float> m_vecWindow;
+		std::vector<short> m_vecDecode;
+		long m_nWindowFrames = 0;
+		long m_nWindowOrigin = 0; // Frames discarded from the front of the window since rewind
+		double m_dWindowPos = 0.0; // Current source position, as a window index
+		long m_nPosition = 0; // Output frames produced since rewind
+		long m_nSourceRead = 0;
+		bool m_bSourceDone = false;
+		unsigned int m_nFillGeneration = 0;
+
+		// The ring between the loader and the mixer. Slot i holds STREAM_CHUNK
+		// frames of m_vecRing from i * STREAM_CHUNK, described by m_ringChunks[i].
+		// The loader owns the tail, the mixer the head, as in olcSPSCQueue
+		struct sStreamChunk
+		{
+			unsigned int nGeneration = 0; // m_nGeneration when it was decoded
+			unsigned int nFrames = 0;
+			bool bEnd = false; // The last chunk of a pass through the file
+		};
+		std::vector<float> m_vecRing;
+		sStreamChunk m_ringChunks[STREAM_RING];
+		std::atomic<size_t> m_nRingHead{ 0 };
+		char m_pad[64];
+		std::atomic<size_t> m_nRingTail{ 0 };
+		std::atomic<unsigned int> m_nGeneration{ 0 }; // Bumped by the mixer to restart
+
+		// Owned by the mixer
+		unsigned int m_nChunkRead = 0; // Frames already played from the head chunk
+		bool m_bStreamAtStart = true; // Nothing read since the start of a pass
+
+		// Streaming: start again from the beginning of the file
+		void StreamRewind()
+		{
+			std::fseek(m_pFile, m_nDataOffset, SEEK_SET);
+			m_nSourceRead = 0;
+			m_bSourceDone = false;
+
+			// Prime the window with silence so the first frames have history
+			m_nWindowFrames = m_resampler.Half() - 1;
+			std::fill(m_vecWindow.begin(), m_vecWindow.begin() + m_nWindowFrames * nChannels, 0.0f);
+			m_dWindowPos = (double)m_nWindowFrames;
+			m_nWindowOrigin = 0;
+			m_nPosition = 0;
+		}
 
-	// Optional for clean up 
-	virtual bool OnUserDestroy() { return true; }
+		// Streaming: produce up to STREAM_CHUNK frames at the target rate into
+		// pOut, and how many in nRead. Returns false if the pass ended here.
+		bool StreamDecode(float* pOut, unsigned int& nRead)
+		{
+			int nHalf = m_resampler.Half();
+			nRead = 0;
 
+			while (nRead < STREAM_CHUNK)
+			{
+				if (m_nPosition >= nSamples)
+					return false;
 
+				// Make sure the window covers every tap for this frame
+				bool bStarved = false;
+				while ((long)m_dWindowPos + nHalf >= m_nWindowFrames && !bStarved)
+					bStarved = !FillWindow();
+				if (bStarved)
+					return false;
 
-protected: // Audio Engine =====================================================================
+				long nBase = (long)m_dWindowPos;
 
-	class olcAudioSample
-	{
-	public:
-		olcAudioSample()
-		{
+				if (m_resampler.PassThrough())
+					std::memcpy(&pOut[nRead * nChannels], &m_vecWindow[(size_t)nBase * nChannels], sizeof(float) * nChannels);
+				else
+					m_resampler.Interpolate(&m_vecWindow[(size_t)(nBase - nHalf + 1) * nChannels], nChannels, m_dWindowPos - (double)nBase, &pOut[nRead * nChannels]);
 
+				m_nPosition++;
+				m_dWindowPos = (double)m_nPosition * m_resampler.Step() - (double)m_nWindowOrigin + (double)(nHalf - 1);
+				nRead++;
+			}
+			return m_nPosition < nSamples;
 		}
 
-		olcAudioSample(std::wstring sWavFile)
+		void Close()
 		{
-			// Load Wav file and convert to float format
-			FILE* f = nullptr;
-			_wfopen_s(&f, sWavFile.c_str(), L"rb");
-			if (f == nullptr)
-				return;
+			if (m_pFile != nullptr)
+				std::fclose(m_pFile);
+			m_pFile = nullptr;
+		}
 
+		// Walk the RIFF chunks for "fmt " and "data", leaving the file at the
+		// start of the sample data
+		bool ReadHeader()
+		{
 			char dump[4];
-			std::fread(&dump, sizeof(char), 4, f); // Read "RIFF"
-			if (strncmp(dump, "RIFF", 4) != 0) return;
-			std::fread(&dump, sizeof(char), 4, f); // Not Interested
-			std::fread(&dump, sizeof(char), 4, f); // Read "WAVE"
-			if (strncmp(dump, "WAVE", 4) != 0) return;
-
-			// Read Wave description chunk
-			std::fread(&dump, sizeof(char), 4, f); // Read "fmt "
-			std::fread(&dump, sizeof(char), 4, f); // Not Interested
-			std::fread(&wavHeader, sizeof(WAVEFORMATEX) - 2, 1, f); // Read Wave Format Structure chunk
-			// Note the -2, because the structure has 2 bytes to indicate its own size
-			// which are not in the wav file
-
-// Just check if wave format is compatible with olcCGE
-			if (wavHeader.wBitsPerSample != 16 || wavHeader.nSamplesPerSec != 44100)
+			DWORD nChunkSize = 0;
+			std::fread(&dump, sizeof(char), 4, m_pFile); // Read "RIFF"
+			if (strncmp(dump, "RIFF", 4) != 0) return false;
+			std::fread(&nChunkSize, sizeof(DWORD), 1, m_pFile); // Not Interested
+			std::fread(&dump, sizeof(char), 4, m_pFile); // Read "WAVE"
+			if (strncmp(dump, "WAVE", 4) != 0) return false;
+
+			bool bFormat = false;
+			while (std::fread(&dump, sizeof(char), 4, m_pFile) == 4 && std::fread(&nChunkSize, sizeof(DWORD), 1, m_pFile) == 1)
 			{
-				std::fclose(f);
-				return;
+				if (strncmp(dump, "fmt ", 4) == 0)
+				{
+					// The chunk may be longer than the basic PCM fields we need
+					ZeroMemory(&wavHeader, sizeof(WAVEFORMATEX));
+					DWORD nRead = (std::min)(nChunkSize, (DWORD)(sizeof(WAVEFORMATEX) - 2));
+					std::fread(&wavHeader, nRead, 1, m_pFile);
+					std::fseek(m_pFile, (long)(nChunkSize - nRead + (nChunkSize & 1)), SEEK_CUR);
+					bFormat = true;
+				}
+				else if (strncmp(dump, "data", 4) == 0)
+				{
+					// Just check if wave format is compatible with olcCGE
+					if (!bFormat || wavHeader.wFormatTag != WAVE_FORMAT_PCM || wavHeader.wBitsPerSample != 16 || wavHeader.nChannels == 0)
+						return false;
+
+					m_nDataOffset = std::ftell(m_pFile);
+					m_nSourceFrames = (long)(nChunkSize / (wavHeader.nChannels * (wavHeader.wBitsPerSample >> 3)));
+					return true;
+				}
+				else
+				{
+					// Not audio data, so just skip it (chunks are word aligned)
+					std::fseek(m_pFile, (long)(nChunkSize + (nChunkSize & 1)), SEEK_CUR);
+				}
 			}
+			return false;
+		}
 
-			// Search for audio data chunk
-			long nChunksize = 0;
-			std::fread(&dump, sizeof(char), 4, f); // Read chunk header
-			std::fread(&nChunksize, sizeof(long), 1, f); // Read chunk size
-			while (strncmp(dump, "data", 4) != 0)
+		// Read nFrames from the current file position into pDst as floats, in
+		// large reads through a fixed size staging buffer
+		long DecodeFrames(float* pDst, long nFrames)
+		{
+			const long nChunk = 16384;
+			std::vector<short> vecStage((size_t)nChunk * nChannels);
+			long nDone = 0;
+			while (nDone < nFrames)
 			{
-				// Not audio data, so just skip it
-				std::fseek(f, nChunksize, SEEK_CUR);
-				std::fread(&dump, sizeof(char), 4, f);
-				std::fread(&nChunksize, sizeof(long), 1, f);
+				long nWant = (std::min)(nChunk, nFrames - nDone);
+				long nGot = (long)std::fread(vecStage.data(), sizeof(short) * nChannels, nWant, m_pFile);
+				ConvertPCM16(pDst + (size_t)nDone * nChannels, vecStage.data(), (size_t)nGot * nChannels);
+				nDone += nGot;
+				if (nGot < nWant)
+					break;
 			}
+			return nDone;
+		}
 
-			// Finally got to data, so read it all in and convert to float samples
-			nSamples = nChunksize / (wavHeader.nChannels * (wavHeader.wBitsPerSample >> 3));
-			nChannels = wavHeader.nChannels;
+		// Streaming: discard frames the resampler no longer needs, then decode
+		// another chunk onto the end of the window. Once the file is exhausted,
+		// pad with silence so the final frames still get their full set of taps.
+		bool FillWindow()
+		{
+			int nHalf = m_resampler.Half();
+			long nKeepFrom = (long)m_dWindowPos - nHalf + 1;
+			if (nKeepFrom > 0)
+			{
+				std::memmove(m_vecWindow.data(), &m_vecWindow[(size_t)nKeepFrom * nChannels], sizeof(float) * (m_nWindowFrames - nKeepFrom) * nChannels);
+				m_nWindowFrames -= nKeepFrom;
+				m_dWindowPos -= (double)nKeepFrom;
+				m_nWindowOrigin += nKeepFrom;
+			}
 
-			// Create floating point buffer to hold audio sample
-			fSample = new float[nSamples * nChannels];
-			float* pSample = fSample;
+			long nSpace = (long)(m_vecWindow.size() / nChannels) - m_nWindowFrames;
+			long nWant = (std::min)((long)STREAM_CHUNK, nSpace);
+			if (nWant <= 0)
+				return false;
 
-			// Read in audio data and normalise
-			for (long i = 0; i < nSamples; i++)
+			float* pDst = &m_vecWindow[(size_t)m_nWindowFrames * nChannels];
+			if (!m_bSourceDone)
 			{
-				for (int c = 0; c < nChannels; c++)
-				{
-					short s = 0;
-					std::fread(&s, sizeof(short), 1, f);
-					*pSample = (float)s / (float)(MAXSHORT);
-					pSample++;
-				}
+				long nGot = (long)std::fread(m_vecDecode.data(), sizeof(short) * nChannels, (std::min)(nWant, m_nSourceFrames - m_nSourceRead), m_pFile);
+				ConvertPCM16(pDst, m_vecDecode.data(), (size_t)nGot * nChannels);
+				m_nSourceRead += nGot;
+				m_nWindowFrames += nGot;
+				if (m_nSourceRead >= m_nSourceFrames || nGot == 0)
+					m_bSourceDone = true;
+				return true;
 			}
 
-			// All done, flag sound as valid
-			std::fclose(f);
-			bSampleValid = true;
+			std::fill(pDst, pDst + (size_t)nWant * nChannels, 0.0f);
+			m_nWindowFrames += nWant;
+			return true;
 		}
-
-		WAVEFORMATEX wavHeader;
-		float* fSample = nullptr;
-		long nSamples = 0;
-		int nChannels = 0;
-		bool bSampleValid = false;
 	};
 
-	// This vector holds all loaded sound samples in memory
-	std::vector<olcAudioSample> vecAudioSamples;
+	// This vector holds all loaded sound samples in memory. Each sample is
+	// heap allocated once and never moves, so the mixer can point at it while
+	// the game thread keeps loading more
+	std::vector<std::unique_ptr<olcAudioSample>> vecAudioSamples;
 
 	// This structure represents a sound that is currently playing. It only
 	// holds the sound ID and where this instance of it is up to for its
@@ -1087,43 +3964,152 @@ protected: // Audio Engine =====================================================
 	struct sCurrentlyPlayingSample
 	{
 		int nAudioSampleID = 0;
+		olcAudioSample* pSample = nullptr;
 		long nSamplePosition = 0;
+		float fVolume = 1.0f;
 		bool bFinished = false;
 		bool bLoop = false;
 	};
-	std::list<sCurrentlyPlayingSample> listActiveSamples;
 
-	// Load a 16-bit WAVE file @ 44100Hz ONLY into memory. A sample ID
-	// number is returned if successful, otherwise -1
+	// Playing sounds live in a fixed pool owned by the audio thread, packed at
+	// the front so only the first m_nActiveVoices entries are in use. If the
+	// pool is full, new sounds are dropped rather than allocating.
+	static const int MAX_VOICES = 64;
+	sCurrentlyPlayingSample m_voices[MAX_VOICES];
+	int m_nActiveVoices = 0;
+
+	// The game thread never touches the voice pool directly. It posts commands
+	// into this ring, and the audio thread applies them at the start of each
+	// block, so triggering sounds never waits on or races with the mixer.
+	struct sAudioCommand
+	{
+		enum { PLAY, STOP, VOLUME, STOP_ALL } nType;
+		int nAudioSampleID;
+		float fVolume;
+		bool bLoop;
+		olcAudioSample* pSample;
+	};
+	olcSPSCQueue<sAudioCommand, 256> m_queueAudioCommands;
+
+	// Load a 16-bit WAVE file into memory, resampled to the mixer's rate. A
+	// sample ID number is returned if successful, otherwise -1
 	unsigned int LoadAudioSample(std::wstring sWavFile)
+	{
+		return AddAudioSample(sWavFile, false);
+	}
+
+	// As LoadAudioSample, but the file is decoded a block at a time while it
+	// plays, for long music tracks, on the stream loader thread. A stream only
+	// plays as one voice at a time - playing it again restarts it.
+	unsigned int LoadAudioStream(std::wstring sWavFile)
+	{
+		return AddAudioSample(sWavFile, true);
+	}
+
+	unsigned int AddAudioSample(std::wstring sWavFile, bool bStream)
 	{
 		if (!m_bEnableSound)
 			return -1;
 
-		olcAudioSample a(sWavFile);
-		if (a.bSampleValid)
+		std::unique_ptr<olcAudioSample> a(new olcAudioSample(sWavFile, m_nSampleRate, bStream));
+		if (a->bSampleValid)
 		{
-			vecAudioSamples.push_back(a);
+			if (bStream)
+			{
+				std::unique_lock<std::mutex> lm(m_muxStreams);
+				m_vecStreams.push_back(a.get());
+			}
+			vecAudioSamples.push_back(std::move(a));
 			return vecAudioSamples.size();
 		}
 		else
 			return -1;
 	}
 
+	// These post commands to the mixer, and must all be called from the same
+	// thread (normally the game thread). They return false if the command
+	// queue is full, which only happens if the audio thread has stalled.
+
 	// Add sample 'id' to the mixers sounds to play list
-	void PlaySample(int id, bool bLoop = false)
+	bool PlaySample(int id, bool bLoop = false, float fVolume = 1.0f)
+	{
+		if (id <= 0 || id > (int)vecAudioSamples.size())
+			return false;
+		return m_queueAudioCommands.TryPush({ sAudioCommand::PLAY, id, fVolume, bLoop, vecAudioSamples[id - 1].get() });
+	}
+
+	// Stop every playing instance of sample 'id'
+	bool StopSample(int id)
+	{
+		return m_queueAudioCommands.TryPush({ sAudioCommand::STOP, id, 0.0f, false, nullptr });
+	}
+
+	// Change the volume of every playing instance of sample 'id'
+	bool SetSampleVolume(int id, float fVolume)
+	{
+		return m_queueAudioCommands.TryPush({ sAudioCommand::VOLUME, id, fVolume, false, nullptr });
+	}
+
+	bool StopAllSamples()
 	{
-		sCurrentlyPlayingSample a;
-		a.nAudioSampleID = id;
-		a.nSamplePosition = 0;
-		a.bFinished = false;
-		a.bLoop = bLoop;
-		listActiveSamples.push_back(a);
+		return m_queueAudioCommands.TryPush({ sAudioCommand::STOP_ALL, 0, 0.0f, false, nullptr });
 	}
 
-	void StopSample(int id)
+	// Audio thread side - apply everything posted since the last block
+	void ProcessAudioCommands()
 	{
+		sAudioCommand cmd;
+		while (m_queueAudioCommands.TryPop(cmd))
+		{
+			switch (cmd.nType)
+			{
+			case sAudioCommand::PLAY:
+				if (cmd.pSample->bStreaming)
+				{
+					// Streams keep their decode position in the sample, so retire
+					// any voice already playing it before starting again
+					for (int i = 0; i < m_nActiveVoices; i++)
+						if (m_voices[i].pSample == cmd.pSample)
+							m_voices[i] = m_voices[--m_nActiveVoices];
+					cmd.pSample->StreamRestart();
+				}
+
+				if (m_nActiveVoices < MAX_VOICES)
+				{
+					sCurrentlyPlayingSample& v = m_voices[m_nActiveVoices++];
+					v.nAudioSampleID = cmd.nAudioSampleID;
+					v.pSample = cmd.pSample;
+					v.nSamplePosition = 0;
+					v.fVolume = cmd.fVolume;
+					v.bFinished = false;
+					v.bLoop = cmd.bLoop;
+				}
+				break;
+
+			case sAudioCommand::STOP:
+				for (int i = 0; i < m_nActiveVoices; i++)
+					if (m_voices[i].nAudioSampleID == cmd.nAudioSampleID)
+						m_voices[i].bFinished = true;
+				break;
+
+			case sAudioCommand::VOLUME:
+				for (int i = 0; i < m_nActiveVoices; i++)
+					if (m_voices[i].nAudioSampleID == cmd.nAudioSampleID)
+						m_voices[i].fVolume = cmd.fVolume;
+				break;
+
+			case sAudioCommand::STOP_ALL:
+				m_nActiveVoices = 0;
+				break;
+			}
+		}
+	}
 
+	// Send audio somewhere other than the sound card (a file, or nowhere). The
+	// engine takes ownership; call before the audio system is created
+	void SetAudioSink(olcAudioSink* pSink)
+	{
+		m_pAudioSink.reset(pSink);
 	}
 
 	// The audio system uses by default a specific wave format
@@ -1136,49 +4122,19 @@ protected: // Audio Engine =====================================================
 		m_nChannels = nChannels;
 		m_nBlockCount = nBlocks;
 		m_nBlockSamples = nBlockSamples;
-		m_nBlockFree = m_nBlockCount;
-		m_nBlockCurrent = 0;
-		m_pBlockMemory = nullptr;
-		m_pWaveHeaders = nullptr;
-
-		// Device is available
-		WAVEFORMATEX waveFormat;
-		waveFormat.wFormatTag = WAVE_FORMAT_PCM;
-		waveFormat.nSamplesPerSec = m_nSampleRate;
-		waveFormat.wBitsPerSample = sizeof(short) * 8;
-		waveFormat.nChannels = m_nChannels;
-		waveFormat.nBlockAlign = (waveFormat.wBitsPerSample / 8) * waveFormat.nChannels;
-		waveFormat.nAvgBytesPerSec = waveFormat.nSamplesPerSec * waveFormat.nBlockAlign;
-		waveFormat.cbSize = 0;
-
-		// Open Device if valid
-		if (waveOutOpen(&m_hwDevice, WAVE_MAPPER, &waveFormat, (DWORD_PTR)waveOutProcWrap, (DWORD_PTR)this, CALLBACK_FUNCTION) != S_OK)
-			return DestroyAudio();
-
-		// Allocate Wave|Block Memory
-		m_pBlockMemory = new short[m_nBlockCount * m_nBlockSamples];
-		if (m_pBlockMemory == nullptr)
-			return DestroyAudio();
-		ZeroMemory(m_pBlockMemory, sizeof(short) * m_nBlockCount * m_nBlockSamples);
 
-		m_pWaveHeaders = new WAVEHDR[m_nBlockCount];
-		if (m_pWaveHeaders == nullptr)
+		if (!m_pAudioSink)
+			m_pAudioSink.reset(new olcWaveOutSink());
+		if (!m_pAudioSink->Open(m_nSampleRate, m_nChannels, m_nBlockCount, m_nBlockSamples))
 			return DestroyAudio();
-		ZeroMemory(m_pWaveHeaders, sizeof(WAVEHDR) * m_nBlockCount);
 
-		// Link headers to block memory
-		for (unsigned int n = 0; n < m_nBlockCount; n++)
-		{
-			m_pWaveHeaders[n].dwBufferLength = m_nBlockSamples * sizeof(short);
-			m_pWaveHeaders[n].lpData = (LPSTR)(m_pBlockMemory + (n * m_nBlockSamples));
-		}
+		// Floating point scratch block the mixer accumulates into
+		m_vecMixBlock.assign(m_nBlockSamples, 0.0f);
 
+		m_bStreamThreadActive = true;
+		m_StreamThread = std::thread(&olcConsoleGameEngine::StreamThread, this);
 		m_bAudioThreadActive = true;
 		m_AudioThread = std::thread(&olcConsoleGameEngine::AudioThread, this);
-
-		// Start the ball rolling with the sound delivery thread
-		std::unique_lock<std::mutex> lm(m_muxBlockNotZero);
-		m_cvBlockNotZero.notify_one();
 		return true;
 	}
 
@@ -1186,87 +4142,134 @@ protected: // Audio Engine =====================================================
 	bool DestroyAudio()
 	{
 		m_bAudioThreadActive = false;
+		if (m_pAudioSink)
+			m_pAudioSink->Interrupt();
+		if (m_AudioThread.joinable())
+			m_AudioThread.join();
+		if (m_pAudioSink)
+			m_pAudioSink->Close();
+
+		{
+			std::unique_lock<std::mutex> lm(m_muxStreams);
+			m_bStreamThreadActive = false;
+			m_cvStreams.notify_all();
+		}
+		if (m_StreamThread.joinable())
+			m_StreamThread.join();
 		return false;
 	}
 
-	// Handler for soundcard request for more data
-	void waveOutProc(HWAVEOUT hWaveOut, UINT uMsg, DWORD dwParam1, DWORD dwParam2)
+	// Stream loader thread. Keeps every stream's ring topped up, so all the
+	// file reading and seeking happens here rather than in the mixer. It only
+	// sleeps when every ring is full, and a ring holds far more than it can
+	// drain in one sleep, so a slow read eats into the ring instead of being
+	// heard.
+	void StreamThread()
 	{
-		if (uMsg != WOM_DONE) return;
-		m_nBlockFree++;
-		std::unique_lock<std::mutex> lm(m_muxBlockNotZero);
-		m_cvBlockNotZero.notify_one();
-	}
+		std::vector<olcAudioSample*> vecStreams;
+		while (true)
+		{
+			{
+				std::unique_lock<std::mutex> lm(m_muxStreams);
+				if (!m_bStreamThreadActive)
+					break;
+				vecStreams = m_vecStreams;
+			}
 
-	// Static wrapper for sound card handler
-	static void CALLBACK waveOutProcWrap(HWAVEOUT hWaveOut, UINT uMsg, DWORD dwInstance, DWORD dwParam1, DWORD dwParam2)
-	{
-		((olcConsoleGameEngine*)dwInstance)->waveOutProc(hWaveOut, uMsg, dwParam1, dwParam2);
+			bool bFilled = false;
+			for (auto s : vecStreams)
+				while (s->StreamFill())
+					bFilled = true;
+
+			if (!bFilled)
+			{
+				std::unique_lock<std::mutex> lm(m_muxStreams);
+				m_cvStreams.wait_for(lm, std::chrono::milliseconds(STREAM_POLL_MS), [&] { return !m_bStreamThreadActive; });
+			}
+		}
 	}
 
 	// Audio thread. This loop responds to requests from the soundcard to fill 'blocks'
-	// with audio data. If no requests are available it goes dormant until the sound
-	// card is ready for more data. The block is fille by the "user" in some manner
-	// and then issued to the soundcard.
+	// with audio data. If no requests are available it goes dormant (inside the
+	// sink's Submit()) until the sound card is ready for more data. The block is
+	// fille by the "user" in some manner and then issued to the soundcard.
 	void AudioThread()
 	{
 		m_fGlobalTime = 0.0f;
+		std::vector<short> vecBlock(m_nBlockSamples);
+
+		while (m_bAudioThreadActive)
+		{
+			RenderAudioBlock(vecBlock.data());
+			if (!m_pAudioSink->Submit(vecBlock.data(), m_nBlockSamples))
+				break;
+		}
+	}
+
+	// Mix the whole block in one go, then clip and convert it for the device
+	void RenderAudioBlock(short* pBlock)
+	{
 		float fTimeStep = 1.0f / (float)m_nSampleRate;
 
 		// Goofy hack to get maximum integer for a type at run-time
 		short nMaxSample = (short)pow(2, (sizeof(short) * 8) - 1) - 1;
 		float fMaxSample = (float)nMaxSample;
-		short nPreviousSample = 0;
+		unsigned int nFrames = m_nBlockSamples / m_nChannels;
 
-		while (m_bAudioThreadActive)
-		{
-			// Wait for block to become available
-			if (m_nBlockFree == 0)
-			{
-				std::unique_lock<std::mutex> lm(m_muxBlockNotZero);
-				while (m_nBlockFree == 0) // sometimes, Windows signals incorrectly
-					m_cvBlockNotZero.wait(lm);
-			}
-
-			// Block is here, so use it
-			m_nBlockFree--;
-
-			// Prepare block for processing
-			if (m_pWaveHeaders[m_nBlockCurrent].dwFlags & WHDR_PREPARED)
-				waveOutUnprepareHeader(m_hwDevice, &m_pWaveHeaders[m_nBlockCurrent], sizeof(WAVEHDR));
+		MixBlock(m_vecMixBlock.data(), nFrames, m_fGlobalTime, fTimeStep);
+		ConvertBlock(pBlock, m_vecMixBlock.data(), nFrames * m_nChannels, fMaxSample);
+		m_fGlobalTime = m_fGlobalTime + fTimeStep * (float)nFrames;
+	}
 
-			short nNewSample = 0;
-			int nCurrentBlock = m_nBlockCurrent * m_nBlockSamples;
+public:
+	struct sAudioRenderStats
+	{
+		unsigned int nBlocks = 0;
+		double fAudioSeconds = 0.0;
+		double fWallSeconds = 0.0;
+	};
 
-			auto clip = [](float fSample, float fMax)
-				{
-					if (fSample >= 0.0)
-						return fmin(fSample, fMax);
-					else
-						return fmax(fSample, -fMax);
-				};
+	// Run the mixer on the calling thread as fast as it will go, feeding fSeconds
+	// of audio into the sink, instead of starting the audio thread. Use it to
+	// render soundtracks to disk, benchmark the mixer (fAudioSeconds /
+	// fWallSeconds is how many real-time streams one core could sustain), or
+	// hash the output for regression tests. Call EnableSound() before loading
+	// samples; commands posted with PlaySample() etc. are picked up at block
+	// boundaries just as they are live.
+	sAudioRenderStats RenderAudioOffline(olcAudioSink& sink, float fSeconds, unsigned int nSampleRate = 44100,
+		unsigned int nChannels = 1, unsigned int nBlockSamples = 512)
+	{
+		sAudioRenderStats stats;
+		if (m_bAudioThreadActive)
+			return stats;
 
-			for (unsigned int n = 0; n < m_nBlockSamples; n += m_nChannels)
-			{
-				// User Process
-				for (unsigned int c = 0; c < m_nChannels; c++)
-				{
-					nNewSample = (short)(clip(GetMixerOutput(c, m_fGlobalTime, fTimeStep), 1.0) * fMaxSample);
-					m_pBlockMemory[nCurrentBlock + n + c] = nNewSample;
-					nPreviousSample = nNewSample;
-				}
+		m_nSampleRate = nSampleRate;
+		m_nChannels = nChannels;
+		m_nBlockSamples = nBlockSamples;
+		m_vecMixBlock.assign(m_nBlockSamples, 0.0f);
+		m_fGlobalTime = 0.0f;
+		if (!sink.Open(m_nSampleRate, m_nChannels, 1, m_nBlockSamples))
+			return stats;
 
-				m_fGlobalTime = m_fGlobalTime + fTimeStep;
-			}
+		std::vector<short> vecBlock(m_nBlockSamples);
+		unsigned int nBlocks = (unsigned int)ceil(fSeconds * (float)m_nSampleRate / (float)(m_nBlockSamples / m_nChannels));
 
-			// Send block to sound device
-			waveOutPrepareHeader(m_hwDevice, &m_pWaveHeaders[m_nBlockCurrent], sizeof(WAVEHDR));
-			waveOutWrite(m_hwDevice, &m_pWaveHeaders[m_nBlockCurrent], sizeof(WAVEHDR));
-			m_nBlockCurrent++;
-			m_nBlockCurrent %= m_nBlockCount;
+		auto tp1 = std::chrono::steady_clock::now();
+		for (; stats.nBlocks < nBlocks; stats.nBlocks++)
+		{
+			RenderAudioBlock(vecBlock.data());
+			if (!sink.Submit(vecBlock.data(), m_nBlockSamples))
+				break;
 		}
+		auto tp2 = std::chrono::steady_clock::now();
+		sink.Close();
+
+		stats.fAudioSeconds = (double)stats.nBlocks * (double)(m_nBlockSamples / m_nChannels) / (double)m_nSampleRate;
+		stats.fWallSeconds = std::chrono::duration<double>(tp2 - tp1).count();
+		return stats;
 	}
 
+protected:
 	// Overridden by user if they want to generate sound in real-time
 	virtual float onUserSoundSample(int nChannel, float fGlobalTime, float fTimeStep)
 	{
@@ -1279,14 +4282,41 @@ protected: // Audio Engine =====================================================
 		return fSample;
 	}
 
+	// Block versions of the two callbacks above. pBlock holds nFrames frames of
+	// m_nChannels interleaved samples. By default these just call the per-sample
+	// versions, so override these instead when you can work a block at a time.
+	virtual void onUserSoundBlock(float* pBlock, unsigned int nFrames, float fGlobalTime, float fTimeStep)
+	{
+		for (unsigned int f = 0; f < nFrames; f++)
+		{
+			for (unsigned int c = 0; c < m_nChannels; c++)
+				pBlock[f * m_nChannels + c] += onUserSoundSample(c, fGlobalTime, fTimeStep);
+			fGlobalTime += fTimeStep;
+		}
+	}
+
+	virtual void onUserSoundFilterBlock(float* pBlock, unsigned int nFrames, float fGlobalTime, float fTimeStep)
+	{
+		for (unsigned int f = 0; f < nFrames; f++)
+		{
+			for (unsigned int c = 0; c < m_nChannels; c++)
+				pBlock[f * m_nChannels + c] = onUserSoundFilter(c, fGlobalTime, pBlock[f * m_nChannels + c]);
+			fGlobalTime += fTimeStep;
+		}
+	}
+
 	// The Sound Mixer - If the user wants to play many sounds simultaneously, and
 	// perhaps the same sound overlapping itself, then you need a mixer, which
 	// takes input from all sound sources for that audio frame. This mixer maintains
-	// a list of sound locations for all concurrently playing audio samples. Instead
+	// a pool of sound locations for all concurrently playing audio samples. Instead
 	// of duplicating audio data, we simply store the fact that a sound sample is in
 	// use and an offset into its sample data. As time progresses we update this offset
 	// until it is beyound the length of the sound sample it is attached to. At this
-	// point we remove the playing souind from the list.
+	// point we remove the playing souind from the pool.
+	//
+	// The mixer works a whole block at a time: each playing sound adds its next run
+	// of samples straight into the block, and finished sounds are retired once per
+	// block rather than once per sample.
 	//
 	// Additionally, the users application may want to generate sound instead of just
 	// playing audio clips (think a synthesizer for example) in whcih case we also
@@ -1296,49 +4326,135 @@ protected: // Audio Engine =====================================================
 	// Finally, before the sound is issued to the operating system for performing, the
 	// user gets one final chance to "filter" the sound, perhaps changing the volume
 	// or adding funky effects
-	float GetMixerOutput(int nChannel, float fGlobalTime, float fTimeStep)
+	void MixBlock(float* pBlock, unsigned int nFrames, float fGlobalTime, float fTimeStep)
 	{
-		// Accumulate sample for this channel
-		float fMixerSample = 0.0f;
+		std::fill_n(pBlock, nFrames * m_nChannels, 0.0f);
 
-		for (auto& s : listActiveSamples)
+		ProcessAudioCommands();
+
+		for (int i = 0; i < m_nActiveVoices; i++)
 		{
-			// Calculate sample position
-			s.nSamplePosition += (long)((float)vecAudioSamples[s.nAudioSampleID - 1].wavHeader.nSamplesPerSec * fTimeStep);
+			sCurrentlyPlayingSample& s = m_voices[i];
+			olcAudioSample& a = *s.pSample;
+			unsigned int nDone = 0;
+			while (nDone < nFrames && !s.bFinished)
+			{
+				if (a.bStreaming)
+				{
+					// Streams only play what the loader has decoded already. If
+					// it's behind, the rest of this block is silent. Rendering
+					// offline there's no loader, and no deadline, so decode here
+					unsigned int n = 0;
+					bool bEnded = false;
+					const float* pSrc = a.StreamRead(nFrames - nDone, s.bLoop, n, bEnded);
+					if (pSrc != nullptr)
+					{
+						MixFrames(pBlock + nDone * m_nChannels, pSrc, n, a.nChannels, s.fVolume);
+						nDone += n;
+					}
+					else if (bEnded)
+						s.bFinished = true;
+					else if (m_bStreamThreadActive || !a.StreamFill())
+						break;
+					continue;
+				}
+
+				long nAvailable = a.nSamples - s.nSamplePosition;
+				if (nAvailable <= 0)
+				{
+					if (s.bLoop && a.nSamples > 0)
+					{
+						s.nSamplePosition = 0;
+						continue;
+					}
+					s.bFinished = true; // Sound has completed
+					break;
+				}
+
+				unsigned int n = (unsigned int)(std::min)((long)(nFrames - nDone), nAvailable);
+				MixFrames(pBlock + nDone * m_nChannels, a.vecSamples.data() + s.nSamplePosition * a.nChannels, n, a.nChannels, s.fVolume);
+				s.nSamplePosition += n;
+				nDone += n;
+			}
+		}
 
-			// If sample position is valid add to the mix
-			if (s.nSamplePosition < vecAudioSamples[s.nAudioSampleID - 1].nSamples)
-				fMixerSample += vecAudioSamples[s.nAudioSampleID - 1].fSample[(s.nSamplePosition * vecAudioSamples[s.nAudioSampleID - 1].nChannels) + nChannel];
+		// If sounds have completed then remove them, keeping the pool packed
+		for (int i = 0; i < m_nActiveVoices;)
+		{
+			if (m_voices[i].bFinished)
+				m_voices[i] = m_voices[--m_nActiveVoices];
 			else
-				s.bFinished = true; // Else sound has completed
+				i++;
 		}
 
-		// If sounds have completed then remove them
-		listActiveSamples.remove_if([](const sCurrentlyPlayingSample& s) {return s.bFinished; });
+		// The users application might be generating sound, or want to filter it
+		onUserSoundBlock(pBlock, nFrames, fGlobalTime, fTimeStep);
+		onUserSoundFilterBlock(pBlock, nFrames, fGlobalTime, fTimeStep);
+	}
 
-		// The users application might be generating sound, so grab that if it exists
-		fMixerSample += onUserSoundSample(nChannel, fGlobalTime, fTimeStep);
+	// Add n frames of a sound with nSrcChannels channels into the mix
+	void MixFrames(float* pDst, const float* pSrc, unsigned int n, int nSrcChannels, float fGain)
+	{
+		if ((unsigned int)nSrcChannels == m_nChannels)
+			MixAdd(pDst, pSrc, n * m_nChannels, fGain);
+		else
+		{
+			// Channel counts differ, so wrap sample channels onto output channels
+			for (unsigned int f = 0; f < n; f++)
+				for (unsigned int c = 0; c < m_nChannels; c++)
+					pDst[f * m_nChannels + c] += pSrc[f * nSrcChannels + c % nSrcChannels] * fGain;
+		}
+	}
 
-		// Return the sample via an optional user override to filter the sound
-		return onUserSoundFilter(nChannel, fGlobalTime, fMixerSample);
+	// pDst[i] += pSrc[i] * fGain
+	static void MixAdd(float* pDst, const float* pSrc, unsigned int n, float fGain)
+	{
+		unsigned int i = 0;
+#ifdef OLC_CGE_SSE2
+		__m128 vGain = _mm_set1_ps(fGain);
+		for (; i + 4 <= n; i += 4)
+			_mm_storeu_ps(pDst + i, _mm_add_ps(_mm_loadu_ps(pDst + i), _mm_mul_ps(_mm_loadu_ps(pSrc + i), vGain)));
+#endif
+		for (; i < n; i++)
+			pDst[i] += pSrc[i] * fGain;
 	}
 
-	unsigned int m_nSampleRate;
-	unsigned int m_nChannels;
-	unsigned int m_nBlockCount;
-	unsigned int m_nBlockSamples;
-	unsigned int m_nBlockCurrent;
+	// Clip floating point samples to [-1, 1] and scale to the device's format
+	static void ConvertBlock(short* pDst, const float* pSrc, unsigned int n, float fMaxSample)
+	{
+		unsigned int i = 0;
+#ifdef OLC_CGE_SSE2
+		__m128 vMax = _mm_set1_ps(1.0f), vMin = _mm_set1_ps(-1.0f), vScale = _mm_set1_ps(fMaxSample);
+		for (; i + 8 <= n; i += 8)
+		{
+			__m128 a = _mm_mul_ps(_mm_max_ps(_mm_min_ps(_mm_loadu_ps(pSrc + i), vMax), vMin), vScale);
+			__m128 b = _mm_mul_ps(_mm_max_ps(_mm_min_ps(_mm_loadu_ps(pSrc + i + 4), vMax), vMin), vScale);
+			_mm_storeu_si128((__m128i*)(pDst + i), _mm_packs_epi32(_mm_cvttps_epi32(a), _mm_cvttps_epi32(b)));
+		}
+#endif
+		for (; i < n; i++)
+			pDst[i] = (short)(fmax(fmin(pSrc[i], 1.0f), -1.0f) * fMaxSample);
+	}
 
-	short* m_pBlockMemory = nullptr;
-	WAVEHDR* m_pWaveHeaders = nullptr;
-	HWAVEOUT m_hwDevice = nullptr;
+	unsigned int m_nSampleRate = 44100;
+	unsigned int m_nChannels = 1;
+	unsigned int m_nBlockCount = 8;
+	unsigned int m_nBlockSamples = 512;
 
+	std::unique_ptr<olcAudioSink> m_pAudioSink;
 	std::thread m_AudioThread;
 	std::atomic<bool> m_bAudioThreadActive = false;
-	std::atomic<unsigned int> m_nBlockFree = 0;
-	std::condition_variable m_cvBlockNotZero;
-	std::mutex m_muxBlockNotZero;
 	std::atomic<float> m_fGlobalTime = 0.0f;
+	std::vector<float> m_vecMixBlock;
+
+	// Streamed samples, for the loader thread to fill. Each is also owned by
+	// vecAudioSamples
+	static constexpr int STREAM_POLL_MS = 5;
+	std::vector<olcAudioSample*> m_vecStreams;
+	std::mutex m_muxStreams;
+	std::condition_variable m_cvStreams;
+	std::thread m_StreamThread;
+	std::atomic<bool> m_bStreamThreadActive = false; // Changed under m_muxStreams, so the wait can't miss it
 
 
 
@@ -1392,7 +4508,13 @@ protected:
 protected:
 	int m_nScreenWidth;
 	int m_nScreenHeight;
-	CHAR_INFO* m_bufScreen;
+	int m_nClipLeft, m_nClipTop, m_nClipRight, m_nClipBottom;
+	CHAR_INFO* m_bufScreen = nullptr;
+	olcSprite* m_pDrawTarget = nullptr; // While set, m_bufScreen and its size are the target's
+	CHAR_INFO* m_bufDisplay = nullptr; // And these are the screen's
+	int m_nDisplayWidth = 0;
+	int m_nDisplayHeight = 0;
+	bool m_bDisplayFillStats = false;
 	std::wstring m_sAppName;
 	HANDLE m_hOriginalConsole;
 	CONSOLE_SCREEN_BUFFER_INFO m_OriginalConsoleInfo;
@@ -1405,6 +4527,14 @@ protected:
 	bool m_mouseNewState[5] = { 0 };
 	bool m_bConsoleInFocus = true;
 	bool m_bEnableSound = false;
+	bool m_bDrawHook = true; // Until EnableDirectDraw()
+	bool m_bFillStats = false;
+	int m_nFillStatsTileSize = 8;
+	olcFillStats m_fillStats;
+	bool m_bAnsiOutput = false;
+	std::wstring m_sInputRecordingFile;
+	float m_fFixedTimeStep = 0.0f;
+	olcAnsiPresenter m_ansiPresenter;
 
 	// These need to be static because of the OnDestroy call the OS may make. The OS
 	// spawns a special thread just for that